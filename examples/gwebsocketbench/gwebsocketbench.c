@@ -0,0 +1,654 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the gwebsocket hot paths against the code they replaced.
+ *
+ *   gwebsocketbench mask [-b 1073741824]
+ *   gwebsocketbench writev [-m 1000000] [-s 128]
+ *   gwebsocketbench message [-m 1000000] [-s 128]
+ *   gwebsocketbench broadcast [-m 1000000] [-s 1024] [-c 1000]
+ *   gwebsocketbench mux [-B 8388608]
+ *   gwebsocketbench dispatch [-m 1000000]
+ *
+ * mask:     GB/s of the frame masking kernels on 1 KB, 64 KB and 15 MB
+ *           payloads, against the byte loop gwebsocket used before.
+ * writev:   messages/s and stream writes per message sending frames over a
+ *           socketpair, header and payload written and flushed one frame
+ *           at a time against 32 frames gathered into one writev.
+ * message:  ns per message creating and dropping text messages with 64 of
+ *           them alive, a struct and a payload from malloc as before
+ *           against the pooled message with its payload inline, and the
+ *           pool allocations per message.
+ * broadcast: compression time of a broadcast to c permessage-deflate
+ *           subscribers, every subscriber compressing it with its own
+ *           stream as before against one shared compression, m counts the
+ *           deliveries.
+ * mux:      latency of small messages sent every millisecond while a bulk
+ *           message of B bytes goes to a local service, on one socket as
+ *           before against their own GWebSocketMux channels.
+ * dispatch: cost of handing a received message to the application, the
+ *           "message" signal of the socket re-emitted by the service
+ *           against a GWebSocketHandlers call.
+ *
+ * Build it against the library objects, it calls private functions the
+ * library does not export in its headers.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <gwebsocket/gwebsocket.h>
+#include <gwebsocket/gwebsocketcodec.h>
+#include <gwebsocket/gwebsocketmux.h>
+#include <gwebsocket/gwebsocketpool.h>
+#include <gwebsocket/gwebsocketservice.h>
+
+typedef struct _GWebSocketDeflate GWebSocketDeflate;
+
+/* G_WEBSOCKET_WRITE_BATCH of gwebsocket.c */
+#define G_BENCH_TOOL_WRITE_BATCH	32
+
+void		_g_websocket_mask(guint8 * dst,const guint8 * src,gsize count,guint32 mask,gsize offset);
+GWebSocketDeflate *	_g_websocket_deflate_new(GWebSocketCodecRole role,const GWebSocketDeflateParams * params);
+void		_g_websocket_deflate_free(GWebSocketDeflate * state);
+guint8 *	_g_websocket_deflate_compress(GWebSocketDeflate * state,const guint8 * data,gsize count,gsize headroom,gsize * length);
+guint8 *	_g_websocket_deflate_compress_once(guint bits,const guint8 * data,gsize count,gsize headroom,gsize * length);
+void		_g_websocket_pool_free(gpointer mem);
+void		_g_websocket_service_client_message(GWebSocket * socket,GWebSocketMessage * message,GWebSocketService * service);
+
+static gint64	bytes = 1 << 30;
+static gint	messages = 1000000;
+static gint	size = 128;
+static gint	subscribers = 1000;
+static gint	bulk = 8 << 20;
+
+static GOptionEntry entries[] =
+{
+  { "bytes", 'b', 0, G_OPTION_ARG_INT64, &bytes, "Bytes to process per payload size (mask)", "BYTES" },
+  { "messages", 'm', 0, G_OPTION_ARG_INT, &messages, "Messages per measurement", "N" },
+  { "size", 's', 0, G_OPTION_ARG_INT, &size, "Payload size in bytes (writev, message, broadcast)", "BYTES" },
+  { "subscribers", 'c', 0, G_OPTION_ARG_INT, &subscribers, "Subscribers of a broadcast (broadcast)", "N" },
+  { "bulk", 'B', 0, G_OPTION_ARG_INT, &bulk, "Size of the bulk message (mux)", "BYTES" },
+  { NULL }
+};
+
+static gdouble
+g_bench_tool_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* the loop gwebsocket masked frames with before the kernels */
+static void
+g_bench_tool_mask_bytes(
+    guint8 * buffer,
+    gsize count,
+    guint32 mask)
+{
+  guint8 * key = (guint8*)&mask;
+  for(guint index = 0;index < count;index++)
+    buffer[index] ^= key[index % 4];
+}
+
+static gboolean
+g_bench_tool_mask(GError ** error G_GNUC_UNUSED)
+{
+  static const gsize sizes[] = { 1024, 65536, 15 * 1024 * 1024 };
+  guint32 mask = g_random_int();
+
+  g_print("%-12s %12s %12s %10s\n","payload","bytes GB/s","kernel GB/s","speedup");
+  for(guint size = 0;size < G_N_ELEMENTS(sizes);size++)
+    {
+      gsize count = sizes[size];
+      guint rounds = MAX(bytes / count,1);
+      guint8 * buffer = g_malloc(count);
+      for(gsize index = 0;index < count;index++)
+	buffer[index] = index;
+
+      gdouble start = g_bench_tool_now();
+      for(guint round = 0;round < rounds;round++)
+	g_bench_tool_mask_bytes(buffer,count,mask);
+      gdouble middle = g_bench_tool_now();
+      for(guint round = 0;round < rounds;round++)
+	_g_websocket_mask(buffer,buffer,count,mask,0);
+      gdouble end = g_bench_tool_now();
+
+      gdouble total = (gdouble)count * rounds / 1e9;
+      g_print("%-12" G_GSIZE_FORMAT " %12.2f %12.2f %9.1fx\n",
+	      count,
+	      total / (middle - start),
+	      total / (end - middle),
+	      (middle - start) / (end - middle));
+      g_free(buffer);
+    }
+  return TRUE;
+}
+
+/* drains the other end of the socketpair as a client would */
+static gpointer
+g_bench_tool_writev_drain(gpointer data)
+{
+  gint fd = GPOINTER_TO_INT(data);
+  guint8 buffer[65536];
+  while(read(fd,buffer,sizeof(buffer)) > 0);
+  return NULL;
+}
+
+static gboolean
+g_bench_tool_writev_run(
+    gboolean gather,
+    GWebSocketCodec * codec,
+    guint8 * payload,
+    gdouble * elapsed,
+    guint * writes,
+    GError ** error)
+{
+  gint fds[2];
+  if(socketpair(AF_UNIX,SOCK_STREAM,0,fds) != 0)
+    {
+      g_set_error_literal(error,G_IO_ERROR,g_io_error_from_errno(errno),g_strerror(errno));
+      return FALSE;
+    }
+  GSocket * gsocket = g_socket_new_from_fd(fds[0],error);
+  if(!gsocket)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      return FALSE;
+    }
+  GSocketConnection * connection = g_socket_connection_factory_create_connection(gsocket);
+  GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+  GThread * drain = g_thread_new("drain",g_bench_tool_writev_drain,GINT_TO_POINTER(fds[1]));
+  guint8 headers[G_BENCH_TOOL_WRITE_BATCH][G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  GOutputVector vectors[G_BENCH_TOOL_WRITE_BATCH * 2];
+  GWebSocketFrame frame = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_BINARY, .buffer = payload, .count = size };
+  gboolean done = TRUE;
+
+  gdouble start = g_bench_tool_now();
+  for(gint index = 0;done && (index < messages);)
+    {
+      if(gather)
+	{
+	  /* a batch of frames per call, as gwebsocket writes them now */
+	  guint count = MIN(messages - index,G_BENCH_TOOL_WRITE_BATCH);
+	  for(guint frames = 0;frames < count;frames++)
+	    {
+	      vectors[frames * 2].buffer = headers[frames];
+	      vectors[frames * 2].size = g_websocket_codec_encode_header(codec,&frame,headers[frames]);
+	      vectors[frames * 2 + 1].buffer = payload;
+	      vectors[frames * 2 + 1].size = size;
+	    }
+	  done = g_output_stream_writev_all(output,vectors,count * 2,NULL,NULL,error);
+	  (*writes)++;
+	  index += count;
+	}
+      else
+	{
+	  /* the header, the payload and a flush per frame, as before */
+	  gsize length = g_websocket_codec_encode_header(codec,&frame,headers[0]);
+	  done = g_output_stream_write_all(output,headers[0],length,NULL,NULL,error)
+	    && g_output_stream_write_all(output,payload,size,NULL,NULL,error)
+	    && g_output_stream_flush(output,NULL,error);
+	  (*writes) += 2;
+	  index++;
+	}
+    }
+  *elapsed = g_bench_tool_now() - start;
+
+  g_io_stream_close(G_IO_STREAM(connection),NULL,NULL);
+  g_thread_join(drain);
+  close(fds[1]);
+  g_object_unref(connection);
+  g_object_unref(gsocket);
+  return done;
+}
+
+static gboolean
+g_bench_tool_writev(GError ** error G_GNUC_UNUSED)
+{
+  GWebSocketCodec * codec = g_websocket_codec_new(G_WEBSOCKET_CODEC_SERVER);
+  guint8 * payload = g_malloc(size);
+  gdouble elapsed[2] = { 0.0, 0.0 };
+  guint writes[2] = { 0, 0 };
+  memset(payload,'x',size);
+
+  gboolean done = g_bench_tool_writev_run(FALSE,codec,payload,&(elapsed[0]),&(writes[0]),error)
+    && g_bench_tool_writev_run(TRUE,codec,payload,&(elapsed[1]),&(writes[1]),error);
+  if(done)
+    {
+      g_print("%d messages of %d bytes\n",messages,size);
+      g_print("%-20s %12s %16s\n","","messages/s","writes/message");
+      g_print("%-20s %12.0f %16.3f\n","write+write+flush",messages / MAX(elapsed[0],1e-9),(gdouble)writes[0] / messages);
+      g_print("%-20s %12.0f %16.3f\n","writev",messages / MAX(elapsed[1],1e-9),(gdouble)writes[1] / messages);
+    }
+  g_free(payload);
+  g_websocket_codec_unref(codec);
+  return done;
+}
+
+/* the message as it was, a struct and a copy of the payload */
+typedef struct _GBenchToolMessage GBenchToolMessage;
+
+struct _GBenchToolMessage
+{
+  gint type;
+  gchar * text;
+  gsize length;
+};
+
+static gboolean
+g_bench_tool_message(GError ** error G_GNUC_UNUSED)
+{
+  GBenchToolMessage * before[64] = { NULL };
+  GWebSocketMessage * after[64] = { NULL };
+  GWebSocketPoolStats first, last;
+  gchar * text = g_malloc(size + 1);
+  memset(text,'x',size);
+  text[size] = 0;
+
+  gdouble start = g_bench_tool_now();
+  for(gint index = 0;index < messages;index++)
+    {
+      GBenchToolMessage ** slot = &(before[index % G_N_ELEMENTS(before)]);
+      if(*slot)
+	{
+	  g_free((*slot)->text);
+	  g_free(*slot);
+	}
+      *slot = g_new0(GBenchToolMessage,1);
+      (*slot)->text = g_strndup(text,size);
+      (*slot)->length = size;
+    }
+  gdouble middle = g_bench_tool_now();
+  g_websocket_pool_get_stats(&first);
+  for(gint index = 0;index < messages;index++)
+    {
+      GWebSocketMessage ** slot = &(after[index % G_N_ELEMENTS(after)]);
+      if(*slot)
+	g_websocket_message_free(*slot);
+      *slot = g_websocket_message_new_text(text,size);
+    }
+  g_websocket_pool_get_stats(&last);
+  gdouble end = g_bench_tool_now();
+
+  for(guint index = 0;index < G_N_ELEMENTS(before);index++)
+    {
+      if(before[index])
+	{
+	  g_free(before[index]->text);
+	  g_free(before[index]);
+	}
+      if(after[index])
+	g_websocket_message_free(after[index]);
+    }
+  g_free(text);
+
+  g_print("%d messages of %d bytes\n",messages,size);
+  g_print("%-20s %12s %16s\n","","ns/message","allocs/message");
+  g_print("%-20s %12.1f %16.3f\n","g_new+g_strndup",(middle - start) * 1e9 / messages,2.0);
+  g_print("%-20s %12.1f %16.3f\n","inline",(end - middle) * 1e9 / messages,(gdouble)(last.allocs - first.allocs) / messages);
+  g_print("pool: %" G_GSIZE_FORMAT " system allocations, %" G_GSIZE_FORMAT " bytes cached\n",last.system_allocs - first.system_allocs,last.cached_bytes);
+  return TRUE;
+}
+
+static gboolean
+g_bench_tool_broadcast(GError ** error G_GNUC_UNUSED)
+{
+  GWebSocketDeflateParams params = { FALSE, FALSE, 0, 0 };
+  GWebSocketDeflate ** streams = g_new(GWebSocketDeflate*,subscribers);
+  GString * text = g_string_sized_new(size + 64);
+  guint rounds = MAX(messages / subscribers,1);
+  gsize before_wire = 0, after_wire = 0;
+
+  /* ticker updates compress like the feeds broadcasts are made for */
+  for(guint tick = 0;text->len < (gsize)size;tick++)
+    g_string_append_printf(text,"{\"symbol\":\"S%04u\",\"price\":%u.%02u,\"volume\":%u},",tick % 64,100 + tick % 17,tick % 100,tick * 7);
+  g_string_truncate(text,size);
+  for(gint index = 0;index < subscribers;index++)
+    streams[index] = _g_websocket_deflate_new(G_WEBSOCKET_CODEC_SERVER,&params);
+
+  gdouble start = g_bench_tool_now();
+  for(guint round = 0;round < rounds;round++)
+    {
+      for(gint index = 0;index < subscribers;index++)
+	{
+	  gsize length = size;
+	  guint8 * compressed = _g_websocket_deflate_compress(streams[index],(const guint8*)text->str,size,0,&length);
+	  before_wire += compressed ? length : (gsize)size;
+	  _g_websocket_pool_free(compressed);
+	}
+    }
+  gdouble middle = g_bench_tool_now();
+  for(guint round = 0;round < rounds;round++)
+    {
+      gsize length = size;
+      guint8 * compressed = _g_websocket_deflate_compress_once(15,(const guint8*)text->str,size,0,&length);
+      after_wire += (compressed ? length : (gsize)size) * subscribers;
+      _g_websocket_pool_free(compressed);
+    }
+  gdouble end = g_bench_tool_now();
+
+  g_print("%u broadcasts of %d bytes to %d subscribers\n",rounds,size,subscribers);
+  g_print("%-20s %14s %16s\n","","us/broadcast","wire bytes");
+  g_print("%-20s %14.3f %16" G_GSIZE_FORMAT "\n","per subscriber",(middle - start) * 1e6 / rounds,before_wire);
+  g_print("%-20s %14.3f %16" G_GSIZE_FORMAT "\n","shared",(end - middle) * 1e6 / rounds,after_wire);
+
+  for(gint index = 0;index < subscribers;index++)
+    _g_websocket_deflate_free(streams[index]);
+  g_free(streams);
+  g_string_free(text,TRUE);
+  return TRUE;
+}
+
+typedef struct _GBenchToolMux GBenchToolMux;
+
+struct _GBenchToolMux
+{
+  GMainLoop *		loop;
+  guint16		port;
+  gboolean		mux;
+  GWebSocketMux *	server_mux;
+  gint			ready;
+  gint			finished;
+  guint			ticks;
+  gint64		latency_total;
+  gint64		latency_max;
+  gboolean		done;
+  GError *		error;
+};
+
+/* the ticks carry the time they were sent, the bulk message ends the run */
+static void
+g_bench_tool_mux_received(
+    GBenchToolMux * bench,
+    GWebSocketMessage * message)
+{
+  if(g_websocket_message_get_type(message) == G_WEBSOCKET_MESSAGE_TEXT)
+    {
+      gint64 latency = g_get_monotonic_time() - g_ascii_strtoll(g_websocket_message_get_text(message),NULL,10);
+      bench->ticks++;
+      bench->latency_total += latency;
+      bench->latency_max = MAX(bench->latency_max,latency);
+    }
+  else
+    {
+      g_atomic_int_set(&(bench->finished),TRUE);
+      g_main_loop_quit(bench->loop);
+    }
+}
+
+static void
+g_bench_tool_mux_message(
+    GWebSocketService * service G_GNUC_UNUSED,
+    GWebSocket * socket G_GNUC_UNUSED,
+    GWebSocketMessage * message,
+    GBenchToolMux * bench)
+{
+  g_bench_tool_mux_received(bench,message);
+}
+
+static void
+g_bench_tool_mux_channel_message(
+    GWebSocketMux * mux G_GNUC_UNUSED,
+    guint32 channel G_GNUC_UNUSED,
+    GWebSocketMessage * message,
+    GBenchToolMux * bench)
+{
+  g_bench_tool_mux_received(bench,message);
+}
+
+/* the client waits for this before sending, the mux must see every message */
+static void
+g_bench_tool_mux_connected(
+    GWebSocketService * service G_GNUC_UNUSED,
+    GWebSocket * socket,
+    GBenchToolMux * bench)
+{
+  if(bench->mux)
+    {
+      bench->server_mux = g_websocket_mux_new(socket);
+      g_signal_connect(bench->server_mux,"message",G_CALLBACK(g_bench_tool_mux_channel_message),bench);
+    }
+  g_atomic_int_set(&(bench->ready),TRUE);
+}
+
+static GWebSocketMessage *
+g_bench_tool_mux_bulk_message(void)
+{
+  guint8 * data = g_malloc0(bulk);
+  GWebSocketMessage * message = g_websocket_message_new_data(data,bulk);
+  g_free(data);
+  return message;
+}
+
+static gpointer
+g_bench_tool_mux_bulk(gpointer socket)
+{
+  GWebSocketMessage * message = g_bench_tool_mux_bulk_message();
+  g_websocket_send(socket,message,NULL);
+  g_websocket_message_unref(message);
+  return NULL;
+}
+
+static gpointer
+g_bench_tool_mux_client(gpointer data)
+{
+  GBenchToolMux * bench = data;
+  GWebSocket * socket = g_websocket_new();
+  GWebSocketMux * mux = NULL;
+  GThread * sender = NULL;
+  guint32 bulk_channel = 0, tick_channel = 0;
+
+  bench->done = g_websocket_connect(socket,"ws://127.0.0.1/",bench->port,NULL,&(bench->error));
+  if(!bench->done)
+    {
+      g_main_loop_quit(bench->loop);
+      g_object_unref(socket);
+      return NULL;
+    }
+  while(!g_atomic_int_get(&(bench->ready)))
+    g_usleep(1000);
+
+  if(bench->mux)
+    {
+      GWebSocketMessage * message = g_bench_tool_mux_bulk_message();
+      mux = g_websocket_mux_new(socket);
+      bulk_channel = g_websocket_mux_open(mux);
+      tick_channel = g_websocket_mux_open(mux);
+      g_websocket_mux_send(mux,bulk_channel,message,NULL);
+      g_websocket_message_unref(message);
+    }
+  else
+    {
+      sender = g_thread_new("bulk",g_bench_tool_mux_bulk,socket);
+    }
+
+  while(!g_atomic_int_get(&(bench->finished)))
+    {
+      gchar * text = g_strdup_printf("%" G_GINT64_FORMAT,g_get_monotonic_time());
+      GWebSocketMessage * message = g_websocket_message_new_text(text,-1);
+      if(mux)
+	g_websocket_mux_send(mux,tick_channel,message,NULL);
+      else
+	g_websocket_send(socket,message,NULL);
+      g_websocket_message_unref(message);
+      g_free(text);
+      g_usleep(1000);
+    }
+
+  if(sender)
+    g_thread_join(sender);
+  g_clear_object(&mux);
+  return socket;
+}
+
+static gboolean
+g_bench_tool_mux_run(
+    GBenchToolMux * bench,
+    GError ** error)
+{
+  GWebSocketService * service = g_websocket_service_new(4);
+  bench->port = g_socket_listener_add_any_inet_port(G_SOCKET_LISTENER(service),NULL,error);
+  if(bench->port == 0)
+    {
+      g_object_unref(service);
+      return FALSE;
+    }
+  bench->loop = g_main_loop_new(NULL,FALSE);
+  g_signal_connect(service,"connected",G_CALLBACK(g_bench_tool_mux_connected),bench);
+  g_signal_connect(service,"message",G_CALLBACK(g_bench_tool_mux_message),bench);
+  g_socket_service_start(G_SOCKET_SERVICE(service));
+
+  GThread * client = g_thread_new("client",g_bench_tool_mux_client,bench);
+  g_main_loop_run(bench->loop);
+  GWebSocket * socket = g_thread_join(client);
+
+  if(socket)
+    {
+      g_websocket_close(socket,NULL);
+      g_object_unref(socket);
+    }
+  g_clear_object(&(bench->server_mux));
+  g_socket_service_stop(G_SOCKET_SERVICE(service));
+  g_object_unref(service);
+  g_main_loop_unref(bench->loop);
+  if(!bench->done)
+    g_propagate_error(error,bench->error);
+  return bench->done;
+}
+
+static gboolean
+g_bench_tool_mux(GError ** error G_GNUC_UNUSED)
+{
+  GBenchToolMux runs[2] = { { 0 }, { 0 } };
+  runs[1].mux = TRUE;
+
+  gboolean done = g_bench_tool_mux_run(&(runs[0]),error)
+    && g_bench_tool_mux_run(&(runs[1]),error);
+  if(done)
+    {
+      g_print("ticks every millisecond behind a %d byte message\n",bulk);
+      g_print("%-20s %8s %14s %14s\n","","ticks","mean latency us","max latency us");
+      for(guint index = 0;index < G_N_ELEMENTS(runs);index++)
+	g_print("%-20s %8u %14.1f %14" G_GINT64_FORMAT "\n",
+		runs[index].mux ? "mux channels" : "one socket",
+		runs[index].ticks,
+		runs[index].ticks ? (gdouble)runs[index].latency_total / runs[index].ticks : 0.0,
+		runs[index].latency_max);
+    }
+  return done;
+}
+
+static void
+g_bench_tool_dispatch_message(
+    GObject * source G_GNUC_UNUSED,
+    GWebSocket * socket G_GNUC_UNUSED,
+    GWebSocketMessage * message G_GNUC_UNUSED,
+    guint * count)
+{
+  (*count)++;
+}
+
+static void
+g_bench_tool_dispatch_direct(
+    GWebSocket * socket G_GNUC_UNUSED,
+    GWebSocketMessage * message G_GNUC_UNUSED,
+    gpointer count)
+{
+  (*(guint*)count)++;
+}
+
+static gboolean
+g_bench_tool_dispatch(GError ** error G_GNUC_UNUSED)
+{
+  GWebSocket * socket = g_websocket_new();
+  GWebSocketService * service = g_websocket_service_new(1);
+  GWebSocketMessage * message = g_websocket_message_new_text("{\"tick\":1}",-1);
+  const GWebSocketHandlers handlers = { g_bench_tool_dispatch_direct, NULL, NULL, NULL };
+  /* through a pointer the compiler can not see into, like the socket */
+  const GWebSocketHandlers * volatile table = &handlers;
+  guint signalled = 0, called = 0;
+
+  /* wired the way the service wires every client without handlers */
+  g_signal_connect(G_OBJECT(socket),"message",G_CALLBACK(_g_websocket_service_client_message),service);
+  g_signal_connect(G_OBJECT(service),"message",G_CALLBACK(g_bench_tool_dispatch_message),&signalled);
+
+  gdouble start = g_bench_tool_now();
+  for(gint index = 0;index < messages;index++)
+    g_signal_emit_by_name(socket,"message",message);
+  gdouble middle = g_bench_tool_now();
+  for(gint index = 0;index < messages;index++)
+    table->message(socket,message,&called);
+  gdouble end = g_bench_tool_now();
+
+  g_print("%-20s %12s %12s\n","","ns/message","messages/s");
+  g_print("%-20s %12.1f %12.0f\n","signals",(middle - start) * 1e9 / messages,signalled / MAX(middle - start,1e-9));
+  g_print("%-20s %12.1f %12.0f\n","handlers",(end - middle) * 1e9 / messages,called / MAX(end - middle,1e-9));
+  g_websocket_message_unref(message);
+  g_object_unref(service);
+  g_object_unref(socket);
+  return TRUE;
+}
+
+gint
+main(gint argc,gchar * argv[])
+{
+  GError * error = NULL;
+  GOptionContext * context = g_option_context_new("mask|dispatch|writev|message|broadcast|mux");
+  gboolean done = FALSE;
+  g_option_context_set_summary(context,"Measures the gwebsocket hot paths against the code they replaced.");
+  g_option_context_add_main_entries(context,entries,NULL);
+  if(!g_option_context_parse(context,&argc,&argv,&error))
+    {
+      g_printerr("%s\n",error->message);
+      return 1;
+    }
+  if((argc != 2) || (bytes <= 0) || (messages <= 0) || (size <= 0) || (subscribers <= 0) || (bulk <= 0))
+    {
+      gchar * help = g_option_context_get_help(context,TRUE,NULL);
+      g_printerr("%s",help);
+      g_free(help);
+      return 1;
+    }
+
+  if(g_strcmp0(argv[1],"mask") == 0)
+    done = g_bench_tool_mask(&error);
+  else if(g_strcmp0(argv[1],"dispatch") == 0)
+    done = g_bench_tool_dispatch(&error);
+  else if(g_strcmp0(argv[1],"writev") == 0)
+    done = g_bench_tool_writev(&error);
+  else if(g_strcmp0(argv[1],"message") == 0)
+    done = g_bench_tool_message(&error);
+  else if(g_strcmp0(argv[1],"broadcast") == 0)
+    done = g_bench_tool_broadcast(&error);
+  else if(g_strcmp0(argv[1],"mux") == 0)
+    done = g_bench_tool_mux(&error);
+  else
+    g_set_error(&error,G_OPTION_ERROR,G_OPTION_ERROR_FAILED,"unknown benchmark %s",argv[1]);
+  if(!done)
+    g_printerr("%s\n",error ? error->message : "failed");
+  g_clear_error(&error);
+  g_option_context_free(context);
+  return done ? 0 : 1;
+}
@@ -0,0 +1,386 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Trains zstd dictionaries for x-gwebsocket-zstd from captured messages and
+ * compares them with permessage-deflate on the same messages.
+ *
+ *   gwebsocketdict train -o messages.dict [-s 65536] [-l] capture...
+ *   gwebsocketdict bench -d messages.dict [-n 20] [-l] capture...
+ *
+ * Every capture file is one message, or with -l every line of it is one.
+ * Messages are compressed as gwebsocket sends them: raw deflate with the
+ * 4 byte flush tail removed, zstd frames without the dictionary ID, and a
+ * message that does not shrink counted at its own size.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <zdict.h>
+#include <glib.h>
+#include <gwebsocket/gwebsocketcodec.h>
+
+typedef struct _GDictToolResult GDictToolResult;
+
+struct _GDictToolResult
+{
+  const gchar *	name;
+  gsize		raw;
+  gsize		wire;
+  gdouble	compress_time;
+  gdouble	decompress_time;
+};
+
+static gchar *	output = NULL;
+static gchar *	dictionary = NULL;
+static gint	dict_size = 65536;
+static gint	iterations = 10;
+static gint	level = 0;
+static gboolean	lines = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Dictionary to write (train)", "FILE" },
+  { "dictionary", 'd', 0, G_OPTION_ARG_FILENAME, &dictionary, "Dictionary to compare (bench)", "FILE" },
+  { "size", 's', 0, G_OPTION_ARG_INT, &dict_size, "Dictionary size in bytes (train)", "BYTES" },
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Passes over the messages (bench)", "N" },
+  { "level", 'L', 0, G_OPTION_ARG_INT, &level, "zstd level, 0 is the default (bench)", "LEVEL" },
+  { "lines", 'l', 0, G_OPTION_ARG_NONE, &lines, "Every line of a capture is one message", NULL },
+  { NULL }
+};
+
+static gdouble
+g_dict_tool_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static GPtrArray *
+g_dict_tool_load(
+    gchar ** files,
+    GError ** error)
+{
+  GPtrArray * messages = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+  for(guint index = 0;files[index];index++)
+    {
+      gchar * contents = NULL;
+      gsize length = 0;
+      if(!g_file_get_contents(files[index],&contents,&length,error))
+	{
+	  g_ptr_array_unref(messages);
+	  return NULL;
+	}
+      if(lines)
+	{
+	  gchar ** parts = g_strsplit(contents,"\n",-1);
+	  for(guint part = 0;parts[part];part++)
+	    {
+	      if(*(parts[part]))
+		g_ptr_array_add(messages,g_bytes_new(parts[part],strlen(parts[part])));
+	    }
+	  g_strfreev(parts);
+	  g_free(contents);
+	}
+      else
+	{
+	  g_ptr_array_add(messages,g_bytes_new_take(contents,length));
+	}
+    }
+  return messages;
+}
+
+static gboolean
+g_dict_tool_train(
+    GPtrArray * messages,
+    GError ** error)
+{
+  gsize total = 0;
+  gsize * sizes = g_new(gsize,messages->len);
+  for(guint index = 0;index < messages->len;index++)
+    {
+      sizes[index] = g_bytes_get_size(g_ptr_array_index(messages,index));
+      total += sizes[index];
+    }
+
+  guint8 * samples = g_malloc(MAX(total,1));
+  gsize offset = 0;
+  for(guint index = 0;index < messages->len;index++)
+    {
+      memcpy(samples + offset,g_bytes_get_data(g_ptr_array_index(messages,index),NULL),sizes[index]);
+      offset += sizes[index];
+    }
+
+  guint8 * buffer = g_malloc(dict_size);
+  gsize length = ZDICT_trainFromBuffer(buffer,dict_size,samples,sizes,messages->len);
+  gboolean done = !ZDICT_isError(length);
+  if(done)
+    {
+      done = g_file_set_contents(output,(const gchar*)buffer,length,error);
+      if(done)
+	g_print("%s: %" G_GSIZE_FORMAT " bytes, ID %u, from %u messages\n",output,length,ZSTD_getDictID_fromDict(buffer,length),messages->len);
+    }
+  else
+    {
+      g_set_error(error,G_FILE_ERROR,G_FILE_ERROR_FAILED,"training failed: %s",ZDICT_getErrorName(length));
+    }
+  g_free(buffer);
+  g_free(samples);
+  g_free(sizes);
+  return done;
+}
+
+/* permessage-deflate with a 15 bit window, with or without context takeover */
+static void
+g_dict_tool_bench_deflate(
+    GPtrArray * messages,
+    gboolean takeover,
+    GDictToolResult * result)
+{
+  static const guint8 tail[4] = { 0x00, 0x00, 0xff, 0xff };
+  guint8 ** compressed = g_new0(guint8*,messages->len);
+  gsize * lengths = g_new0(gsize,messages->len);
+  z_stream deflater = { 0 }, inflater = { 0 };
+  deflateInit2(&deflater,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY);
+  inflateInit2(&inflater,-15);
+
+  for(gint pass = 0;pass < iterations;pass++)
+    {
+      gdouble start = g_dict_tool_now();
+      deflateReset(&deflater);
+      for(guint index = 0;index < messages->len;index++)
+	{
+	  gsize count = 0;
+	  const guint8 * data = g_bytes_get_data(g_ptr_array_index(messages,index),&count);
+	  gsize size = deflateBound(&deflater,count) + 8;
+	  g_free(compressed[index]);
+	  compressed[index] = g_malloc(size);
+	  deflater.next_in = (Bytef*)data;
+	  deflater.avail_in = count;
+	  deflater.next_out = compressed[index];
+	  deflater.avail_out = size;
+	  deflate(&deflater,Z_SYNC_FLUSH);
+	  lengths[index] = size - deflater.avail_out - 4;
+	  /* sent as it is, the compressor forgets it like gwebsocket does */
+	  if(lengths[index] >= count)
+	    {
+	      g_clear_pointer(&(compressed[index]),g_free);
+	      deflateReset(&deflater);
+	    }
+	  else if(!takeover)
+	    {
+	      deflateReset(&deflater);
+	    }
+	}
+      gdouble middle = g_dict_tool_now();
+      inflateReset(&inflater);
+      for(guint index = 0;index < messages->len;index++)
+	{
+	  gsize count = g_bytes_get_size(g_ptr_array_index(messages,index));
+	  guint8 * buffer = NULL;
+	  if(!compressed[index])
+	    continue;
+	  buffer = g_malloc(count + 1);
+	  inflater.next_in = compressed[index];
+	  inflater.avail_in = lengths[index];
+	  inflater.next_out = buffer;
+	  inflater.avail_out = count + 1;
+	  inflate(&inflater,Z_SYNC_FLUSH);
+	  inflater.next_in = (Bytef*)tail;
+	  inflater.avail_in = 4;
+	  inflate(&inflater,Z_SYNC_FLUSH);
+	  if(!takeover)
+	    inflateReset(&inflater);
+	  g_free(buffer);
+	}
+      result->compress_time += middle - start;
+      result->decompress_time += g_dict_tool_now() - middle;
+    }
+
+  for(guint index = 0;index < messages->len;index++)
+    {
+      gsize count = g_bytes_get_size(g_ptr_array_index(messages,index));
+      result->raw += count;
+      result->wire += compressed[index] ? lengths[index] : count;
+      g_free(compressed[index]);
+    }
+  deflateEnd(&deflater);
+  inflateEnd(&inflater);
+  g_free(compressed);
+  g_free(lengths);
+}
+
+/* every message its own zstd frame, with the dictionary or without one */
+static void
+g_dict_tool_bench_zstd(
+    GPtrArray * messages,
+    GBytes * dict,
+    GDictToolResult * result)
+{
+  guint8 ** compressed = g_new0(guint8*,messages->len);
+  gsize * lengths = g_new0(gsize,messages->len);
+  ZSTD_CCtx * cctx = ZSTD_createCCtx();
+  ZSTD_DCtx * dctx = ZSTD_createDCtx();
+  ZSTD_CDict * cdict = NULL;
+  ZSTD_DDict * ddict = NULL;
+  if(dict)
+    {
+      cdict = ZSTD_createCDict(g_bytes_get_data(dict,NULL),g_bytes_get_size(dict),level ? level : ZSTD_CLEVEL_DEFAULT);
+      ddict = ZSTD_createDDict(g_bytes_get_data(dict,NULL),g_bytes_get_size(dict));
+    }
+
+  for(gint pass = 0;pass < iterations;pass++)
+    {
+      gdouble start = g_dict_tool_now();
+      for(guint index = 0;index < messages->len;index++)
+	{
+	  gsize count = 0;
+	  const guint8 * data = g_bytes_get_data(g_ptr_array_index(messages,index),&count);
+	  gsize size = ZSTD_compressBound(count);
+	  g_free(compressed[index]);
+	  compressed[index] = g_malloc(size);
+	  ZSTD_CCtx_reset(cctx,ZSTD_reset_session_and_parameters);
+	  ZSTD_CCtx_setParameter(cctx,ZSTD_c_dictIDFlag,0);
+	  if(cdict)
+	    ZSTD_CCtx_refCDict(cctx,cdict);
+	  else
+	    ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,level ? level : ZSTD_CLEVEL_DEFAULT);
+	  lengths[index] = ZSTD_compress2(cctx,compressed[index],size,data,count);
+	  if(ZSTD_isError(lengths[index]) || (lengths[index] >= count))
+	    g_clear_pointer(&(compressed[index]),g_free);
+	}
+      gdouble middle = g_dict_tool_now();
+      for(guint index = 0;index < messages->len;index++)
+	{
+	  gsize count = g_bytes_get_size(g_ptr_array_index(messages,index));
+	  if(!compressed[index])
+	    continue;
+	  guint8 * buffer = g_malloc(count + 1);
+	  ZSTD_DCtx_reset(dctx,ZSTD_reset_session_and_parameters);
+	  if(ddict)
+	    ZSTD_DCtx_refDDict(dctx,ddict);
+	  ZSTD_decompressDCtx(dctx,buffer,count + 1,compressed[index],lengths[index]);
+	  g_free(buffer);
+	}
+      result->compress_time += middle - start;
+      result->decompress_time += g_dict_tool_now() - middle;
+    }
+
+  for(guint index = 0;index < messages->len;index++)
+    {
+      gsize count = g_bytes_get_size(g_ptr_array_index(messages,index));
+      result->raw += count;
+      result->wire += compressed[index] ? lengths[index] : count;
+      g_free(compressed[index]);
+    }
+  ZSTD_freeCDict(cdict);
+  ZSTD_freeDDict(ddict);
+  ZSTD_freeCCtx(cctx);
+  ZSTD_freeDCtx(dctx);
+  g_free(compressed);
+  g_free(lengths);
+}
+
+static gboolean
+g_dict_tool_bench(
+    GPtrArray * messages,
+    GError ** error)
+{
+  gchar * contents = NULL;
+  gsize length = 0;
+  if(!g_file_get_contents(dictionary,&contents,&length,error))
+    return FALSE;
+
+  /* the dictionary must load the way a socket loads it */
+  GBytes * dict = g_bytes_new_take(contents,length);
+  GWebSocketDictionary * loaded = g_websocket_dictionary_new(dict,level,error);
+  if(!loaded)
+    {
+      g_bytes_unref(dict);
+      return FALSE;
+    }
+
+  GDictToolResult results[4] =
+  {
+    { "permessage-deflate", 0, 0, 0.0, 0.0 },
+    { "deflate no_context_takeover", 0, 0, 0.0, 0.0 },
+    { "zstd", 0, 0, 0.0, 0.0 },
+    { "zstd dictionary", 0, 0, 0.0, 0.0 }
+  };
+  g_dict_tool_bench_deflate(messages,TRUE,&(results[0]));
+  g_dict_tool_bench_deflate(messages,FALSE,&(results[1]));
+  g_dict_tool_bench_zstd(messages,NULL,&(results[2]));
+  g_dict_tool_bench_zstd(messages,dict,&(results[3]));
+
+  g_print("%u messages, dictionary ID %u, %d passes\n",messages->len,g_websocket_dictionary_get_id(loaded),iterations);
+  g_print("%-28s %12s %12s %8s %14s %14s\n","","raw","wire","ratio","compress us","decompress us");
+  for(guint index = 0;index < G_N_ELEMENTS(results);index++)
+    {
+      GDictToolResult * result = &(results[index]);
+      gdouble scale = 1e6 / ((gdouble)MAX(messages->len,1) * iterations);
+      g_print("%-28s %12" G_GSIZE_FORMAT " %12" G_GSIZE_FORMAT " %8.3f %14.3f %14.3f\n",
+	      result->name,
+	      result->raw,
+	      result->wire,
+	      result->wire ? (gdouble)result->raw / result->wire : 0.0,
+	      result->compress_time * scale,
+	      result->decompress_time * scale);
+    }
+  g_websocket_dictionary_unref(loaded);
+  g_bytes_unref(dict);
+  return TRUE;
+}
+
+gint
+main(gint argc,gchar * argv[])
+{
+  GError * error = NULL;
+  GOptionContext * context = g_option_context_new("train|bench CAPTURE...");
+  gboolean done = FALSE;
+  g_option_context_set_summary(context,"Trains and compares zstd dictionaries for x-gwebsocket-zstd.");
+  g_option_context_add_main_entries(context,entries,NULL);
+  if(!g_option_context_parse(context,&argc,&argv,&error))
+    {
+      g_printerr("%s\n",error->message);
+      return 1;
+    }
+  if((argc < 3) || ((g_strcmp0(argv[1],"train") == 0) ? !output : ((g_strcmp0(argv[1],"bench") != 0) || !dictionary)))
+    {
+      gchar * help = g_option_context_get_help(context,TRUE,NULL);
+      g_printerr("%s",help);
+      g_free(help);
+      return 1;
+    }
+
+  GPtrArray * messages = g_dict_tool_load(argv + 2,&error);
+  if(messages)
+    {
+      if(g_strcmp0(argv[1],"train") == 0)
+	done = g_dict_tool_train(messages,&error);
+      else
+	done = g_dict_tool_bench(messages,&error);
+      g_ptr_array_unref(messages);
+    }
+  if(!done)
+    g_printerr("%s\n",error ? error->message : "failed");
+  g_clear_error(&error);
+  g_option_context_free(context);
+  return done ? 0 : 1;
+}
@@ -18,25 +18,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include "gwebsocket.h"
 
 typedef struct _GWebSocketPrivate GWebSocketPrivate;
-typedef struct _GWebSocketDatagram GWebSocketDatagram;
-typedef struct _GWebSocketIdleData GWebSocketIdleData;
 typedef struct _GWebSocketReadData GWebSocketReadData;
+typedef struct _GWebSocketSendData GWebSocketSendData;
+typedef struct _GWebSocketFileData GWebSocketFileData;
+typedef struct _GWebSocketEncoding GWebSocketEncoding;
+typedef struct _GWebSocketEncodings GWebSocketEncodings;
 
 #define G_WEBSOCKET_KEY_MAGIC "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-
-typedef enum
-{
-    G_WEBSOCKET_CODEOP_CONTINUE = 0x0,
-    G_WEBSOCKET_CODEOP_TEXT = 0x1,
-    G_WEBSOCKET_CODEOP_BINARY = 0x2,
-    G_WEBSOCKET_CODEOP_CLOSE = 0x8,
-    G_WEBSOCKET_CODEOP_PING = 0x9,
-    G_WEBSOCKET_CODEOP_PONG = 0xA
-}GWebSocketCodeOp;
+#define G_WEBSOCKET_WRITE_BATCH 32
+#define G_WEBSOCKET_MASK_SCRATCH_SIZE 65536
+#define G_WEBSOCKET_ENCODINGS 16
 
 struct _GWebSocketPrivate
 {
@@ -44,48 +46,153 @@ struct _GWebSocketPrivate
   HttpRequest *		request;
   GCancellable *  	recv_cancellable;
   gboolean		use_mask;
+  GWebSocketCodec *	codec;
+  gboolean		streaming;
+  gsize			max_frame_size;
+  gsize			max_message_size;
+  gsize			max_receive_memory;
+  gsize			spill_size;
+  gboolean		deflate;
+  gboolean		deflate_no_context_takeover;
+  gsize			deflate_memory;
+  gsize			deflate_threshold;
+  gboolean		deflate_active;
+  GWebSocketDeflateParams deflate_params;
+  GPtrArray *		dictionaries;
+  GWebSocketDictionary *	dictionary;
+  GWebSocketMessageType	chunk_type;
+  gsize			fragment_size;
+  GMainContext *	context;
+  gint			priority;
+  gboolean		inline_dispatch;
+  guint			batch_size;
+  guint			batch_time;
+  guint			queue_depth;
+  gsize			queue_high_water;
+  GWebSocketHandlers	handlers;
+  gpointer		handlers_data;
+  GMutex		write_mutex;
+  GMutex		message_mutex;
 };
 
-struct _GWebSocketDatagram
+struct _GWebSocketReadData
 {
-  gboolean fin;
-  GWebSocketCodeOp code;
-  guint32 mask;
-  guint8 * buffer;
-  gsize count;
+  GWebSocket	*	socket;
+  GInputStream	* 	stream;
+  GCancellable * 	cancellable;
+  GWebSocketCodec *	codec;
+  GMainContext *	context;
+  gint			priority;
+  gboolean		inline_dispatch;
+  GWebSocketMessage **	batch;
+  guint			batch_size;
+  guint			batch_time;
+  guint			queue_depth;
+  gsize			queue_high_water;
+  gboolean		reading;
+  gboolean		dispatching;
 };
 
-struct _GWebSocketIdleData
+struct _GWebSocketSendData
 {
-  GWebSocket * socket;
-  GWebSocketDatagram * datagram;
+  GInputStream *	stream;
+  GWebSocketMessageType	type;
 };
 
-struct _GWebSocketReadData
+struct _GWebSocketFileData
 {
-  GWebSocket	*	socket;
-  GInputStream	* 	stream;
-  GCancellable * 	cancellable;
-  gpointer 		data;
-  guint8 		header_buffer[2];
-  gboolean		have_mask;
-  GWebSocketDatagram * 	datagram;
+  gint			fd;
+  goffset		offset;
+  goffset		length;
+  GWebSocketMessageType	type;
+};
+
+struct _GWebSocketEncoding
+{
+  gboolean		ready;
+  GWebSocketFrame	frame;
+  guint8 *		compressed;
+  guint8		header[G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  gsize			header_size;
+};
+
+/*
+ * Wire bytes of one message for every encoding a peer may have agreed,
+ * index 0 uncompressed and the others deflated with that many window bits,
+ * plus one for each zstd dictionary. Each one is made the first time a
+ * socket needs it.
+ */
+struct _GWebSocketEncodings
+{
+  GWebSocketMessage *	message;
+  GWebSocketEncoding	encodings[G_WEBSOCKET_ENCODINGS];
+  GHashTable *		dictionaries;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(GWebSocket,g_websocket,G_TYPE_OBJECT)
 
 static void	_g_websocket_dispose(GObject* object);
+static void	_g_websocket_finalize(GObject* object);
 static void	_g_websocket_start(GWebSocket * self);
 static void	_g_websocket_stop(GWebSocket * self);
 
 static gboolean	_g_websocket_read_async(GWebSocket * socket,GCancellable * cancellable,GError ** error);
 
-static gboolean	_g_websocket_write(GOutputStream * output,GWebSocketDatagram * datagram,GCancellable * cancellable,GError ** error);
+static gboolean	_g_websocket_write(GWebSocket * socket,GWebSocketFrame * frame,GCancellable * cancellable,GError ** error);
+
+static gboolean	_g_websocket_write_frames(GWebSocket * socket,GWebSocketFrame ** frames,guint n_frames,GCancellable * cancellable,GError ** error);
 
 static gboolean _g_websocket_recv_idle(gpointer idle_data);
 
+static void	_g_websocket_read_next(GWebSocketReadData * data);
+
+static void	_g_websocket_read_free(GWebSocketReadData * data);
+
+static void	_g_websocket_read_attach(GWebSocketReadData * data,GSource * source,GSourceFunc func);
+
+static void	_g_websocket_read_resume(GWebSocketReadData * data);
+
+static void	_g_websocket_read_release(GWebSocketReadData * data);
+
 static gboolean _g_websocket_send(GWebSocket * socket,GWebSocketMessage * message,GCancellable * cancellable,GError ** error);
 
+void		_g_websocket_mask(guint8 * dst,const guint8 * src,gsize count,guint32 mask,gsize offset);
+
+guint8 *	_g_websocket_message_builder_steal(GWebSocketMessageBuilder * builder,gsize * length);
+
+void		_g_websocket_random(guint8 * buffer,gsize count);
+
+gboolean	_g_websocket_mux_attached(GWebSocket * socket);
+
+guint8 *	_g_websocket_codec_compress(GWebSocketCodec * codec,const guint8 * data,gsize count,gsize headroom,gsize * length);
+guint		_g_websocket_codec_get_deflate_bits(GWebSocketCodec * codec,gsize count);
+void		_g_websocket_codec_reset_deflate(GWebSocketCodec * codec);
+guint		_g_websocket_codec_budget_serial(void);
+void		_g_websocket_codec_budget_wait(GSource * source,GMainContext * context,guint serial);
+void		_g_websocket_codec_budget_wake(void);
+
+GWebSocketEncodings *	_g_websocket_encodings_new(GWebSocketMessage * message);
+void			_g_websocket_encodings_free(GWebSocketEncodings * encodings);
+gboolean		_g_websocket_send_encoded(GWebSocket * socket,GWebSocketEncodings * encodings,GError ** error);
+
+guint		_g_websocket_deflate_window_bits(gsize memory);
+gboolean	_g_websocket_deflate_negotiate(const gchar * offers,guint window_bits,gboolean no_context_takeover,GWebSocketDeflateParams * params,gchar ** response);
+gchar *		_g_websocket_deflate_offer(guint window_bits,gboolean no_context_takeover);
+gboolean	_g_websocket_deflate_accept(const gchar * response,guint window_bits,gboolean no_context_takeover,GWebSocketDeflateParams * params);
+guint8 *	_g_websocket_deflate_compress_once(guint bits,const guint8 * data,gsize count,gsize headroom,gsize * length);
+
+guint8 *	_g_websocket_zstd_compress(GWebSocketDictionary * dictionary,const guint8 * data,gsize count,gsize headroom,gsize * length);
+GWebSocketDictionary *	_g_websocket_zstd_negotiate(const gchar * offers,GPtrArray * dictionaries,gchar ** response);
+gchar *		_g_websocket_zstd_offer(GPtrArray * dictionaries);
+GWebSocketDictionary *	_g_websocket_zstd_accept(const gchar * response,GPtrArray * dictionaries);
+
+GWebSocketMessage *	_g_websocket_message_new_take(GWebSocketMessageType type,guint8 * buffer,gsize length);
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_alloc0(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+
 enum
 {
 	PROP_CONNECTION = 1,
@@ -97,6 +204,8 @@ enum
 {
 	SIGNAL_MESSAGE = 0,
 	SIGNAL_CLOSED = 1,
+	SIGNAL_MESSAGE_CHUNK = 2,
+	SIGNAL_MESSAGES = 3,
 	N_SIGNALS
 };
 
@@ -133,16 +242,41 @@ g_websocket_init(GWebSocket * self)
 {
   GWebSocketPrivate * priv = g_websocket_get_instance_private(self);
   priv->connection = NULL;
+  priv->streaming = FALSE;
+  priv->max_frame_size = 15728640L;
+  priv->max_message_size = 15728640L; //-> 15MB
+  priv->max_receive_memory = 0;
+  priv->spill_size = 0;
+  priv->deflate = FALSE;
+  priv->deflate_no_context_takeover = FALSE;
+  priv->deflate_memory = 0;
+  priv->deflate_threshold = G_WEBSOCKET_CODEC_DEFLATE_THRESHOLD;
+  priv->deflate_active = FALSE;
+  priv->dictionaries = g_ptr_array_new_with_free_func((GDestroyNotify)g_websocket_dictionary_unref);
+  priv->dictionary = NULL;
+  priv->fragment_size = 0;
+  priv->context = NULL;
+  priv->priority = G_PRIORITY_DEFAULT_IDLE;
+  priv->inline_dispatch = FALSE;
+  priv->batch_size = 0;
+  priv->batch_time = 0;
+  priv->queue_depth = G_WEBSOCKET_QUEUE_DEPTH;
+  priv->queue_high_water = G_WEBSOCKET_QUEUE_HIGH_WATER;
+  g_mutex_init(&(priv->write_mutex));
+  g_mutex_init(&(priv->message_mutex));
 }
 
 static void
 g_websocket_class_init(GWebSocketClass * klass)
 {
   G_OBJECT_CLASS(klass)->dispose = _g_websocket_dispose;
+  G_OBJECT_CLASS(klass)->finalize = _g_websocket_finalize;
   /*<override>*/
   klass->send = _g_websocket_send;
 
   const GType message_params[1] = {G_TYPE_POINTER};
+  const GType chunk_params[2] = {G_TYPE_POINTER,G_TYPE_BOOLEAN};
+  const GType messages_params[2] = {G_TYPE_POINTER,G_TYPE_UINT};
 
   g_websocket_signals[SIGNAL_MESSAGE] =
       g_signal_newv ("message",
@@ -167,6 +301,30 @@ g_websocket_class_init(GWebSocketClass * klass)
        G_TYPE_NONE /* return_type */,
        0     /* n_params */,
        NULL  /* param_types */);
+
+  g_websocket_signals[SIGNAL_MESSAGE_CHUNK] =
+      g_signal_newv ("message-chunk",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       2     /* n_params */,
+       (GType*)chunk_params  /* param_types */);
+
+  g_websocket_signals[SIGNAL_MESSAGES] =
+      g_signal_newv ("messages",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       2     /* n_params */,
+       (GType*)messages_params  /* param_types */);
 }
 
 
@@ -177,20 +335,33 @@ _g_websocket_dispose(GObject* object)
   GWebSocketPrivate * priv = g_websocket_get_instance_private(self);
   if(g_websocket_is_connected(self))
     {
-      GWebSocketDatagram * datagram = g_new0(GWebSocketDatagram,1);
-      datagram->code = G_WEBSOCKET_CODEOP_CLOSE;
-      datagram->buffer = NULL;
-      datagram->count = 0;
-      datagram->fin = TRUE;
-      datagram->mask = 0;
-      _g_websocket_write(g_io_stream_get_output_stream(G_IO_STREAM(priv->connection)),datagram,NULL,NULL);
-      g_free(datagram);
+      GWebSocketFrame * frame = g_new0(GWebSocketFrame,1);
+      frame->code = G_WEBSOCKET_CODEOP_CLOSE;
+      frame->buffer = NULL;
+      frame->count = 0;
+      frame->fin = TRUE;
+      _g_websocket_write(self,frame,NULL,NULL);
+      g_free(frame);
       _g_websocket_stop(self);
     }
   g_clear_object(&(priv->request));
+  g_clear_pointer(&(priv->codec),g_websocket_codec_unref);
+  g_clear_pointer(&(priv->dictionary),g_websocket_dictionary_unref);
   G_OBJECT_CLASS(g_websocket_parent_class)->dispose(object);
 }
 
+static void
+_g_websocket_finalize(GObject* object)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(G_WEBSOCKET(object));
+  g_ptr_array_unref(priv->dictionaries);
+  if(priv->context)
+    g_main_context_unref(priv->context);
+  g_mutex_clear(&(priv->write_mutex));
+  g_mutex_clear(&(priv->message_mutex));
+  G_OBJECT_CLASS(g_websocket_parent_class)->finalize(object);
+}
+
 gchar *
 g_websocket_generate_handshake(
     const gchar *key
@@ -215,32 +386,13 @@ g_websocket_generate_handshake(
   return g_base64_encode (handshake, handshake_len);
 }
 
+/* the key is a random 16 byte nonce, RFC 6455 section 4.1 */
 gchar *
 g_websocket_generate_key()
 {
-  guchar key[13];
-  struct timespec tm_spec;
-  guint8 index;
-  if(!clock_gettime(0,&tm_spec))
-  {
-    srand(tm_spec.tv_nsec);
-    for(index = 0;index <= 12;index ++)
-      key[index] = (rand() % 256);
-  }
-  return g_base64_encode(key,12);
-}
-
-guint32
-g_websocket_generate_mask()
-{
-  struct timespec tm_spec;
-  guint32 mask = 0;
-  if(!clock_gettime(0,&tm_spec))
-  {
-    srand(tm_spec.tv_nsec);
-    mask = rand();
-  }
-  return mask;
+  guint8 key[16];
+  _g_websocket_random(key,16);
+  return g_base64_encode(key,16);
 }
 
 void
@@ -250,9 +402,34 @@ _g_websocket_start(GWebSocket * self)
   g_return_if_fail(priv->connection != NULL);
   g_return_if_fail(g_socket_connection_is_connected(priv->connection) == TRUE);
   priv->recv_cancellable = g_cancellable_new();
+  priv->codec = g_websocket_codec_new(priv->use_mask ? G_WEBSOCKET_CODEC_CLIENT : G_WEBSOCKET_CODEC_SERVER);
+  g_websocket_codec_set_max_frame_size(priv->codec,priv->max_frame_size);
+  g_websocket_codec_set_max_message_size(priv->codec,priv->max_message_size);
+  g_websocket_codec_set_max_memory(priv->codec,priv->max_receive_memory);
+  g_websocket_codec_set_spill_size(priv->codec,priv->spill_size);
+  g_websocket_codec_set_reassemble(priv->codec,!priv->streaming);
+  g_websocket_codec_set_deflate_threshold(priv->codec,priv->deflate_threshold);
+  if(priv->dictionary)
+    g_websocket_codec_set_dictionary(priv->codec,priv->dictionary);
+  else if(priv->deflate_active)
+    g_websocket_codec_set_deflate(priv->codec,&(priv->deflate_params));
   _g_websocket_read_async(self,priv->recv_cancellable,NULL);
 }
 
+/*
+ * With a direct handler installed the signal is a slower extra layer,
+ * only emitted when something is connected to it.
+ */
+static gboolean
+_g_websocket_signal_pending(
+    GWebSocket * socket,
+    gboolean direct,
+    gint signal
+    )
+{
+  return !direct || g_signal_has_handler_pending(socket,g_websocket_signals[signal],0,TRUE);
+}
+
 void
 _g_websocket_stop(GWebSocket * self)
 {
@@ -261,72 +438,251 @@ _g_websocket_stop(GWebSocket * self)
   g_return_if_fail(priv->recv_cancellable != NULL);
   g_return_if_fail(g_cancellable_is_cancelled(priv->recv_cancellable) == FALSE);
   g_cancellable_cancel(priv->recv_cancellable);
+  /* a reader paused by the memory budget wakes up to see the cancellation */
+  _g_websocket_codec_budget_wake();
   if(g_socket_connection_is_connected(priv->connection))
     g_io_stream_close(G_IO_STREAM(priv->connection),NULL,NULL);
-  g_signal_emit(self,g_websocket_signals[SIGNAL_CLOSED],0);
+  if(priv->handlers.closed)
+    priv->handlers.closed(self,priv->handlers_data);
+  if(_g_websocket_signal_pending(self,priv->handlers.closed != NULL,SIGNAL_CLOSED))
+    g_signal_emit(self,g_websocket_signals[SIGNAL_CLOSED],0);
+  g_mutex_lock(&(priv->write_mutex));
   g_clear_object(&(priv->connection));
+  g_mutex_unlock(&(priv->write_mutex));
   g_clear_object(&(priv->recv_cancellable));
 }
 
-static gboolean
-_g_websocket_recv_idle(
-    gpointer idle_data
+/* the message takes the payload of frame, both come from the pool */
+static GWebSocketMessage *
+_g_websocket_frame_to_message(
+    GWebSocketMessageType type,
+    GWebSocketFrame * frame
     )
 {
-  GWebSocketIdleData * data = (GWebSocketIdleData*)idle_data;
-  if(G_IS_WEBSOCKET(data->socket))
-    {
-      GWebSocketPrivate * priv = g_websocket_get_instance_private(data->socket);
-      GOutputStream * output = NULL;
-      if(g_socket_connection_is_connected(priv->connection))
-	output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+  GWebSocketMessage * message = _g_websocket_message_new_take(type,frame->buffer,frame->count);
+  frame->buffer = NULL;
+  return message;
+}
 
-      switch(data->datagram->code)
-      {
-      case G_WEBSOCKET_CODEOP_CLOSE:
-	g_websocket_close(data->socket,NULL);
-	break;
-      case G_WEBSOCKET_CODEOP_TEXT:
+static void
+_g_websocket_emit_message(
+    GWebSocket * socket,
+    GWebSocketMessage * message
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  /* a mux takes the messages of its socket from the signal */
+  if(priv->handlers.message && !_g_websocket_mux_attached(socket))
+    priv->handlers.message(socket,message,priv->handlers_data);
+  if(_g_websocket_signal_pending(socket,priv->handlers.message != NULL,SIGNAL_MESSAGE))
+    g_signal_emit (socket, g_websocket_signals[SIGNAL_MESSAGE],0,message);
+}
+
+static void
+_g_websocket_emit_chunk(
+    GWebSocket * socket,
+    GWebSocketMessage * message,
+    gboolean last
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  if(priv->handlers.message_chunk)
+    priv->handlers.message_chunk(socket,message,last,priv->handlers_data);
+  if(_g_websocket_signal_pending(socket,priv->handlers.message_chunk != NULL,SIGNAL_MESSAGE_CHUNK))
+    g_signal_emit (socket, g_websocket_signals[SIGNAL_MESSAGE_CHUNK],0,message,last);
+}
+
+static void
+_g_websocket_dispatch(
+    GWebSocket * socket,
+    GWebSocketFrame * frame
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  switch(frame->code)
+  {
+  case G_WEBSOCKET_CODEOP_CLOSE:
+    g_websocket_close(socket,NULL);
+    break;
+  case G_WEBSOCKET_CODEOP_TEXT:
+  case G_WEBSOCKET_CODEOP_BINARY:
+    {
+      GWebSocketMessageType type = (frame->code == G_WEBSOCKET_CODEOP_TEXT) ? G_WEBSOCKET_MESSAGE_TEXT : G_WEBSOCKET_MESSAGE_BINARY;
+      GWebSocketMessage * message = _g_websocket_frame_to_message(type,frame);
+      if(frame->fin)
 	{
-	  GWebSocketMessage * message = g_websocket_message_new_text((const gchar*)data->datagram->buffer,data->datagram->count);
-	  g_signal_emit (data->socket, g_websocket_signals[SIGNAL_MESSAGE],0,message);
-	  g_websocket_message_free(message);
+	  _g_websocket_emit_message(socket,message);
 	}
-	break;
-      case G_WEBSOCKET_CODEOP_BINARY:
+      else
 	{
-	  GWebSocketMessage * message = g_websocket_message_new_data(data->datagram->buffer,data->datagram->count);
-	   g_signal_emit (data->socket, g_websocket_signals[SIGNAL_MESSAGE],0,message);
-	   g_websocket_message_free(message);
+	  /* first fragment, only popped by the codec in streaming mode */
+	  priv->chunk_type = type;
+	  _g_websocket_emit_chunk(socket,message,FALSE);
 	}
-	break;
-      case G_WEBSOCKET_CODEOP_CONTINUE:
-	break;
-      case G_WEBSOCKET_CODEOP_PING:
-	if(output)
-	  {
-	    GWebSocketDatagram * pong = g_new0(GWebSocketDatagram,1);
-	    pong->code = G_WEBSOCKET_CODEOP_PONG;
-	    pong->count = data->datagram->count;
-	    pong->buffer = data->datagram->buffer;
-	    pong->fin = TRUE;
-	    pong->mask = 0;
-	    _g_websocket_write(output,pong,NULL,NULL);
-	    g_free(pong);
-	  }
-	break;
-      default:
-	break;
+      g_websocket_message_unref(message);
+    }
+    break;
+  case G_WEBSOCKET_CODEOP_CONTINUE:
+    {
+      GWebSocketMessage * message = _g_websocket_frame_to_message(priv->chunk_type,frame);
+      _g_websocket_emit_chunk(socket,message,frame->fin);
+      g_websocket_message_unref(message);
+    }
+    break;
+  case G_WEBSOCKET_CODEOP_PING:
+    if(g_websocket_is_connected(socket))
+      {
+	GWebSocketFrame pong = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_PONG, .buffer = frame->buffer, .count = frame->count };
+	_g_websocket_write(socket,&pong,NULL,NULL);
       }
-      if(g_websocket_is_connected(data->socket))
-	_g_websocket_read_async(data->socket,priv->recv_cancellable,NULL);
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+_g_websocket_flush_batch(
+    GWebSocket * socket,
+    GWebSocketMessage ** messages,
+    guint count
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  if(count > 0)
+    {
+      if(priv->handlers.messages)
+	priv->handlers.messages(socket,messages,count,priv->handlers_data);
+      if(_g_websocket_signal_pending(socket,priv->handlers.messages != NULL,SIGNAL_MESSAGES))
+	g_signal_emit (socket, g_websocket_signals[SIGNAL_MESSAGES],0,messages,count);
+      for(guint index = 0;index < count;index++)
+	g_websocket_message_unref(messages[index]);
     }
-  g_free(data->datagram->buffer);
-  g_free(data->datagram);
-  g_free(data);
+}
+
+/*
+ * Emits the complete messages decoded so far with one "messages" signal per
+ * batch_size of them. Any other frame flushes the batch first so the order
+ * is kept. Once batch_time microseconds are spent it yields to the loop and
+ * goes on from a new source.
+ */
+static gboolean
+_g_websocket_recv_batch(
+    GWebSocketReadData * data
+    )
+{
+  GWebSocketFrame * frame = NULL;
+  gint64 deadline = data->batch_time ? g_get_monotonic_time() + data->batch_time : 0;
+  gboolean yield = FALSE;
+  guint count = 0;
+  while(!yield && !g_cancellable_is_cancelled(data->cancellable) && (frame = g_websocket_codec_pop_frame(data->codec)))
+    {
+      if(frame->fin && ((frame->code == G_WEBSOCKET_CODEOP_TEXT) || (frame->code == G_WEBSOCKET_CODEOP_BINARY)))
+	{
+	  GWebSocketMessageType type = (frame->code == G_WEBSOCKET_CODEOP_TEXT) ? G_WEBSOCKET_MESSAGE_TEXT : G_WEBSOCKET_MESSAGE_BINARY;
+	  data->batch[count++] = _g_websocket_frame_to_message(type,frame);
+	  if(count == data->batch_size)
+	    {
+	      _g_websocket_flush_batch(data->socket,data->batch,count);
+	      count = 0;
+	    }
+	}
+      else
+	{
+	  _g_websocket_flush_batch(data->socket,data->batch,count);
+	  count = 0;
+	  _g_websocket_dispatch(data->socket,frame);
+	}
+      g_websocket_frame_free(frame);
+      yield = deadline && (g_get_monotonic_time() >= deadline);
+    }
+  _g_websocket_flush_batch(data->socket,data->batch,count);
+
+  if(!g_cancellable_is_cancelled(data->cancellable) && yield && g_websocket_codec_has_frames(data->codec))
+    {
+      _g_websocket_read_attach(data,g_idle_source_new(),_g_websocket_recv_idle);
+      _g_websocket_read_resume(data);
+    }
+  else
+    {
+      data->dispatching = FALSE;
+      if(g_cancellable_is_cancelled(data->cancellable))
+	_g_websocket_read_release(data);
+      else
+	_g_websocket_read_resume(data);
+    }
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_g_websocket_recv_idle(
+    gpointer idle_data
+    )
+{
+  GWebSocketReadData * data = (GWebSocketReadData*)idle_data;
+  GWebSocketFrame * frame = NULL;
+  if(data->batch_size > 0)
+    return _g_websocket_recv_batch(data);
+  while(!g_cancellable_is_cancelled(data->cancellable) && (frame = g_websocket_codec_pop_frame(data->codec)))
+    {
+      _g_websocket_dispatch(data->socket,frame);
+      g_websocket_frame_free(frame);
+    }
+  data->dispatching = FALSE;
+  if(g_cancellable_is_cancelled(data->cancellable))
+    _g_websocket_read_release(data);
+  else
+    _g_websocket_read_resume(data);
   return G_SOURCE_REMOVE;
 }
 
+static void
+_g_websocket_message_to_frame(
+    GWebSocketMessage * message,
+    GWebSocketFrame * frame
+    )
+{
+  frame->fin = TRUE;
+  if(g_websocket_message_get_type(message) == G_WEBSOCKET_MESSAGE_TEXT)
+    {
+      frame->code = G_WEBSOCKET_CODEOP_TEXT;
+      frame->buffer = (guint8*)g_websocket_message_get_text(message);
+    }
+  else
+    {
+      frame->code = G_WEBSOCKET_CODEOP_BINARY;
+      frame->buffer = (guint8*)g_websocket_message_get_data(message);
+    }
+  frame->count = g_websocket_message_get_length(message);
+}
+
+/*
+ * Compresses the payload of frame when permessage-deflate is in use and
+ * returns the new buffer, headroom bytes in front of the payload, to be
+ * freed once the frame is sent. Must be called with message_mutex held,
+ * in the order the messages go out.
+ */
+static guint8 *
+_g_websocket_compress_frame(
+    GWebSocket * socket,
+    GWebSocketFrame * frame,
+    gsize headroom
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  guint8 * compressed = NULL;
+  gsize length = 0;
+  if(priv->codec)
+    compressed = _g_websocket_codec_compress(priv->codec,frame->buffer,frame->count,headroom,&length);
+  if(compressed)
+    {
+      frame->buffer = compressed + headroom;
+      frame->count = length;
+      frame->compressed = TRUE;
+    }
+  return compressed;
+}
+
 static gboolean
 _g_websocket_send(
     GWebSocket * socket,
@@ -340,28 +696,14 @@ _g_websocket_send(
 
   if(g_socket_connection_is_connected(priv->connection))
     {
-      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
-      GWebSocketDatagram * msg = g_new0(GWebSocketDatagram,1);
-      msg->fin = TRUE;
-      if(g_websocket_message_get_type(message) == G_WEBSOCKET_MESSAGE_TEXT)
-	{
-	  msg->code = G_WEBSOCKET_CODEOP_TEXT;
-	  msg->buffer = (guint8*)g_websocket_message_get_text(message);
-	}
-      else
-	{
-	  msg->code = G_WEBSOCKET_CODEOP_BINARY;
-	  msg->buffer = (guint8*)g_websocket_message_get_data(message);
-	}
-      msg->count = g_websocket_message_get_length(message);
-
-      if(priv->use_mask)
-	msg->mask = g_websocket_generate_mask();
-      else
-	msg->mask = 0;
-
-      gboolean done = _g_websocket_write(output,msg,cancellable,error);
-      g_free(msg);
+      GWebSocketFrame msg = { 0 };
+      _g_websocket_message_to_frame(message,&msg);
+
+      g_mutex_lock(&(priv->message_mutex));
+      guint8 * compressed = _g_websocket_compress_frame(socket,&msg,0);
+      gboolean done = _g_websocket_write(socket,&msg,cancellable,error);
+      g_mutex_unlock(&(priv->message_mutex));
+      _g_websocket_pool_free(compressed);
       return done;
     }
   else
@@ -371,237 +713,609 @@ _g_websocket_send(
     }
 }
 
+/* runs func once on the context of the socket, at its dispatch priority */
+void
+_g_websocket_idle_add(
+    GWebSocket * socket,
+    GSourceFunc func,
+    gpointer data)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GSource * source = g_idle_source_new();
+  g_source_set_priority(source,priv->priority);
+  g_source_set_callback(source,func,data,NULL);
+  g_source_attach(source,priv->context);
+  g_source_unref(source);
+}
+
+/* TRUE on the client side of the connection */
+gboolean
+_g_websocket_get_use_mask(GWebSocket * socket)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->use_mask;
+}
+
 gboolean
 _g_websocket_ping(GWebSocket * socket)
 {
   GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
   gboolean done = FALSE;
-  GOutputStream * output = NULL;
   if(g_socket_connection_is_connected(priv->connection))
     {
-      output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
-      GWebSocketDatagram * ping = g_new0(GWebSocketDatagram,1);
+      GWebSocketFrame * ping = g_new0(GWebSocketFrame,1);
       ping->code = G_WEBSOCKET_CODEOP_PING;
       ping->buffer = (guint8*)"ARE YOU CONNECTED";
       ping->count = 17;
       ping->fin = TRUE;
-      ping->mask = 0;
-      done = _g_websocket_write(output,ping,NULL,NULL);
+      done = _g_websocket_write(socket,ping,NULL,NULL);
       g_free(ping);
     }
   return done;
 }
 
 
+/* tells the peer why the connection is closed, see G_WEBSOCKET_CLOSE_* */
 static void
-_g_websocket_read_content(GObject *source_object,
-                        GAsyncResult *res,
-                        gpointer user_data)
+_g_websocket_close_status(
+    GWebSocket * socket,
+    guint16 close_code)
 {
-  GWebSocketReadData *  data = (GWebSocketReadData *)(user_data);
-  gsize read = 0;
-  if(g_input_stream_read_all_finish(data->stream,res,&read,NULL))
-   {
-      GWebSocketDatagram * datagram = data->datagram;
-      guint8 * mask = (guint8*)&(datagram->mask);
-      if(data->have_mask)
-	{
-	  for(guint i = 0;i<datagram->count;i++)
-	    (datagram->buffer)[i] ^= mask[i % 4];
-	}
-      GWebSocketIdleData * idle_data = g_new0(GWebSocketIdleData,1);
-      idle_data->datagram = data->datagram;
-      idle_data->socket = data->socket;
-      g_idle_add(_g_websocket_recv_idle,idle_data);
-   }
-  else
-   {
-     _g_websocket_stop(data->socket);
-     g_free(data->datagram->buffer);
-     g_free(data->datagram);
-   }
+  guint16 status = GUINT16_TO_BE(close_code);
+  GWebSocketFrame frame = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_CLOSE, .buffer = (guint8*)&status, .count = 2 };
+  _g_websocket_write(socket,&frame,NULL,NULL);
+}
+
+static void
+_g_websocket_read_free(GWebSocketReadData * data)
+{
+  g_websocket_codec_unref(data->codec);
+  g_object_unref(data->cancellable);
+  if(data->context)
+    g_main_context_unref(data->context);
+  g_free(data->batch);
   g_free(data);
 }
 
+/* frees the reader once neither a read nor a dispatch is pending */
+static void
+_g_websocket_read_release(GWebSocketReadData * data)
+{
+  if(!data->reading && !data->dispatching)
+    _g_websocket_read_free(data);
+}
+
+/*
+ * Reads on while the frames waiting for dispatch stay under queue_depth and
+ * queue_high_water bytes. Otherwise the dispatch resumes reading once it
+ * drains them, meanwhile the peer is held back by TCP.
+ */
+static void
+_g_websocket_read_resume(GWebSocketReadData * data)
+{
+  gsize bytes = 0;
+  guint depth = g_websocket_codec_get_queued(data->codec,&bytes);
+  if(!data->reading
+     && (depth < MAX(data->queue_depth,1))
+     && (!data->queue_high_water || (bytes < data->queue_high_water)))
+    _g_websocket_read_next(data);
+}
+
+/* runs func on the context of the reader, at its dispatch priority */
+static void
+_g_websocket_read_attach(
+    GWebSocketReadData * data,
+    GSource * source,
+    GSourceFunc func
+    )
+{
+  g_source_set_priority(source,data->priority);
+  g_source_set_callback(source,func,data,NULL);
+  g_source_attach(source,data->context);
+  g_source_unref(source);
+}
+
 static void
-_g_websocket_read_header(GObject *source_object,
+_g_websocket_read_ready(GObject *source_object G_GNUC_UNUSED,
                         GAsyncResult *res,
                         gpointer user_data)
 {
-  const guint64 max_frame_size = 15728640L; //-> 15MB
-  gsize read_size = 0;
-  gboolean done = FALSE;
   GWebSocketReadData *  data = (GWebSocketReadData *)(user_data);
-  if(g_input_stream_read_all_finish(data->stream,res,&read_size,NULL))
+  gssize read = g_input_stream_read_finish(data->stream,res,NULL);
+  gboolean done = (read > 0) && !g_cancellable_is_cancelled(data->cancellable);
+  data->reading = FALSE;
+  if(done)
+    done = g_websocket_codec_commit(data->codec,read,NULL);
+
+  if(done)
     {
-      if(read_size == 2)
+      if(g_websocket_codec_has_frames(data->codec) && !data->dispatching)
 	{
-	  data->datagram = g_new0(GWebSocketDatagram,1);
-	  data->datagram->fin = data->header_buffer[0] & 0b10000000;
-	  data->datagram->code = data->header_buffer[0] & 0b00001111;
-
-	  gboolean have_mask = data->header_buffer[1] & 0b10000000;
-	  guint8 header_size = data->header_buffer[1] & 0b01111111;
-
-	  if(header_size < 126)
-	    {
-	      done = TRUE;
-	      data->datagram->count = header_size;
-	    }
-	  else if(header_size == 126)
+	  data->dispatching = TRUE;
+	  if(data->inline_dispatch)
 	    {
-	      done = g_input_stream_read_all(data->stream,&(data->datagram->count),2,NULL,data->cancellable,NULL);
-	      data->datagram->count = GUINT16_FROM_BE((guint16)(data->datagram->count));
-	    }
-	  else if(header_size == 127)
-	    {
-	      done = g_input_stream_read_all(data->stream,&(data->datagram->count),8,NULL,data->cancellable,NULL);
-	      data->datagram->count = GUINT64_FROM_BE((guint64)(data->datagram->count));
-	    }
-	  if(done)
-	    {
-	      if((data->datagram->count > 0) && (data->datagram->count <= max_frame_size))
-		{
-		  guint8 mask[4] = {0,};
-		  data->have_mask = have_mask;
-		  if(have_mask)
-		    {
-		      done = g_input_stream_read_all(data->stream,mask,4,NULL,data->cancellable,NULL);
-		      data->datagram->mask = *((guint32 *)(mask));
-		    }
-		  data->datagram->buffer = g_new0(guint8,(data->datagram->count) + 1);
-		  g_input_stream_read_all_async(data->stream,
-						data->datagram->buffer,
-						data->datagram->count,
-						G_THREAD_PRIORITY_NORMAL,
-						data->cancellable,
-						_g_websocket_read_content,
-						data);
-		}
-	      else if(data->datagram->count == 0)
-		{
-		  GWebSocketIdleData * idle_data = g_new0(GWebSocketIdleData,1);
-		  idle_data->datagram = data->datagram;
-		  idle_data->socket = data->socket;
-		  g_idle_add(_g_websocket_recv_idle,idle_data);
-		  g_free(data);
-		}
-	      else
-		{
-		  _g_websocket_stop(data->socket);
-		  g_free(data->datagram);
-		  g_free(data);
-		}
-	    }
-	  else
-	    {
-	      _g_websocket_stop(data->socket);
-	      g_free(data->datagram);
-	      g_free(data);
+	      /* reads on by itself once the frames are out */
+	      _g_websocket_recv_idle(data);
+	      return;
 	    }
+	  _g_websocket_read_attach(data,g_idle_source_new(),_g_websocket_recv_idle);
 	}
-      else
-	{
-	  _g_websocket_stop(data->socket);
-	}
+      _g_websocket_read_resume(data);
     }
   else
     {
-      _g_websocket_stop(data->socket);
-      g_free(data->datagram);
-      g_free(data);
+      if(!g_cancellable_is_cancelled(data->cancellable))
+	{
+	  guint16 close_code = g_websocket_codec_get_close_code(data->codec);
+	  if(close_code)
+	    _g_websocket_close_status(data->socket,close_code);
+	  _g_websocket_stop(data->socket);
+	}
+      _g_websocket_read_release(data);
     }
 }
 
+/* reads again once the budget has room, also makes the first read on a context */
 static gboolean
-_g_websocket_read_async(
-    GWebSocket * socket,
-    GCancellable * cancellable,
-    GError ** error
+_g_websocket_read_retry(
+    gpointer retry_data
     )
 {
-  GWebSocketReadData * read_data = g_new0(GWebSocketReadData,1);
-  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
-  GInputStream * stream = g_io_stream_get_input_stream(G_IO_STREAM(priv->connection));
-  read_data->socket = socket;
-  read_data->stream = stream;
-  read_data->cancellable = cancellable;
-  g_input_stream_read_all_async(
-			      stream,
-			      &(read_data->header_buffer),
-			      2,
-			      G_THREAD_PRIORITY_NORMAL,
-			      cancellable,
-			      _g_websocket_read_header,
-			      read_data);
-  return TRUE;
+  GWebSocketReadData * data = (GWebSocketReadData*)retry_data;
+  data->reading = FALSE;
+  if(g_cancellable_is_cancelled(data->cancellable))
+    _g_websocket_read_release(data);
+  else
+    _g_websocket_read_resume(data);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+_g_websocket_read_next(
+    GWebSocketReadData * data
+    )
+{
+  gsize size = 0;
+  guint serial = _g_websocket_codec_budget_serial();
+  guint8 * buffer = g_websocket_codec_get_buffer(data->codec,&size);
+  data->reading = TRUE;
+  if(buffer)
+    {
+      /*
+       * The completion is delivered to the thread default context. This
+       * only runs on the thread dispatching data->context, which can
+       * always acquire it.
+       */
+      if(data->context)
+	g_main_context_push_thread_default(data->context);
+      g_input_stream_read_async(data->stream,
+				buffer,
+				size,
+				G_PRIORITY_DEFAULT,
+				data->cancellable,
+				_g_websocket_read_ready,
+				data);
+      if(data->context)
+	g_main_context_pop_thread_default(data->context);
+    }
+  else
+    {
+      /* the memory budget is exhausted, stop reading until some is released */
+      GSource * source = g_idle_source_new();
+      g_source_set_priority(source,data->priority);
+      g_source_set_callback(source,_g_websocket_read_retry,data,NULL);
+      _g_websocket_codec_budget_wait(source,data->context,serial);
+    }
+}
+
+static gboolean
+_g_websocket_read_async(
+    GWebSocket * socket,
+    GCancellable * cancellable,
+    GError ** error G_GNUC_UNUSED
+    )
+{
+  GWebSocketReadData * read_data = g_new0(GWebSocketReadData,1);
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  read_data->socket = socket;
+  read_data->stream = g_io_stream_get_input_stream(G_IO_STREAM(priv->connection));
+  read_data->cancellable = g_object_ref(cancellable);
+  read_data->codec = g_websocket_codec_ref(priv->codec);
+  read_data->context = priv->context ? g_main_context_ref(priv->context) : NULL;
+  read_data->priority = priv->priority;
+  read_data->inline_dispatch = priv->inline_dispatch;
+  read_data->batch_size = priv->batch_size;
+  read_data->batch_time = priv->batch_time;
+  if(read_data->batch_size > 0)
+    read_data->batch = g_new(GWebSocketMessage*,read_data->batch_size);
+  read_data->queue_depth = priv->queue_depth;
+  read_data->queue_high_water = priv->queue_high_water;
+  if(read_data->context)
+    {
+      /* started from the service worker, the context runs on another thread */
+      read_data->reading = TRUE;
+      _g_websocket_read_attach(read_data,g_idle_source_new(),_g_websocket_read_retry);
+    }
+  else
+    {
+      _g_websocket_read_next(read_data);
+    }
+  return TRUE;
+}
+
+/*
+ * Writes frames with one vectored write per G_WEBSOCKET_WRITE_BATCH frames,
+ * header and payload of every frame included. Data messages are also
+ * serialised with message_mutex so the fragments of a message are never
+ * mixed with another message, control frames only take write_mutex and may
+ * go out between two fragments.
+ */
+static gboolean
+_g_websocket_write_frames(
+    GWebSocket * socket,
+    GWebSocketFrame ** frames,
+    guint n_frames,
+    GCancellable * cancellable,
+    GError ** error)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  guint8 headers[G_WEBSOCKET_WRITE_BATCH][G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  GOutputVector vectors[G_WEBSOCKET_WRITE_BATCH * 2];
+  gboolean done = TRUE;
+
+  guint8 *
+  masked_buf = NULL;
+  if(g_websocket_codec_get_role(priv->codec) == G_WEBSOCKET_CODEC_CLIENT)
+    {
+      gsize masked_size = 0;
+      for(guint index = 0;index < n_frames;index++)
+	masked_size += frames[index]->count;
+      if(masked_size > 0)
+	masked_buf = _g_websocket_pool_alloc(masked_size);
+    }
+
+  g_mutex_lock(&(priv->write_mutex));
+  if(priv->connection)
+    {
+      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+      guint8 * masked = masked_buf;
+      for(guint first = 0;done && (first < n_frames);first += G_WEBSOCKET_WRITE_BATCH)
+	{
+	  guint count = MIN(n_frames - first,G_WEBSOCKET_WRITE_BATCH);
+	  gsize n_vectors = 0;
+	  for(guint index = 0;index < count;index++)
+	    {
+	      GWebSocketFrame * frame = frames[first + index];
+	      vectors[n_vectors].buffer = headers[index];
+	      vectors[n_vectors].size = g_websocket_codec_encode_header(priv->codec,frame,headers[index]);
+	      n_vectors++;
+	      if(frame->count > 0)
+		{
+		  if(frame->mask)
+		    {
+		      _g_websocket_mask(masked,frame->buffer,frame->count,frame->mask,0);
+		      vectors[n_vectors].buffer = masked;
+		      masked += frame->count;
+		    }
+		  else
+		    {
+		      vectors[n_vectors].buffer = frame->buffer;
+		    }
+		  vectors[n_vectors].size = frame->count;
+		  n_vectors++;
+		}
+	    }
+	  done = g_output_stream_writev_all(output,vectors,n_vectors,NULL,cancellable,error);
+	}
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+      done = FALSE;
+    }
+  g_mutex_unlock(&(priv->write_mutex));
+  _g_websocket_pool_free(masked_buf);
+
+  return done;
 }
 
 static gboolean
 _g_websocket_write(
-    GOutputStream * output,
-    GWebSocketDatagram * datagram,
+    GWebSocket * socket,
+    GWebSocketFrame * frame,
     GCancellable * cancellable,
     GError ** error)
 {
-  guint8 header[16];
-  size_t p;
+  return _g_websocket_write_frames(socket,&frame,1,cancellable,error);
+}
+
+static gsize
+_g_websocket_get_fragment_size(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  gint size = 0;
+  if(priv->fragment_size > 0)
+    return priv->fragment_size;
+
+  /* linux reports twice the size it reserves for the payload */
+  if(priv->connection && g_socket_get_option(g_socket_connection_get_socket(priv->connection),SOL_SOCKET,SO_SNDBUF,&size,NULL))
+    return CLAMP(size / 2,4096,1048576);
+  return 65536;
+}
+
+static gboolean
+_g_websocket_stop_idle(gpointer socket)
+{
+  if(g_websocket_is_connected(G_WEBSOCKET(socket)))
+    _g_websocket_stop(G_WEBSOCKET(socket));
+  g_object_unref(socket);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * A send worker that broke a message off stops the socket from its
+ * context, where the reader stops it too and "closed" is expected.
+ */
+static void
+_g_websocket_stop_later(GWebSocket * socket)
+{
+  _g_websocket_idle_add(socket,_g_websocket_stop_idle,g_object_ref(socket));
+}
+
+static void
+_g_websocket_send_data_free(GWebSocketSendData * data)
+{
+  g_object_unref(data->stream);
+  g_free(data);
+}
 
-  gboolean mid_header = datagram->count > 125 && datagram->count <= 65535;
-  gboolean long_header = datagram->count > 65535;
+static void
+_g_websocket_send_stream_thread(
+    GTask * task,
+    gpointer source_object,
+    gpointer task_data,
+    GCancellable * cancellable)
+{
+  GWebSocket * socket = G_WEBSOCKET(source_object);
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketSendData * data = (GWebSocketSendData*)task_data;
+  gsize fragment_size = _g_websocket_get_fragment_size(socket);
+  GWebSocketFrame * frame = g_new0(GWebSocketFrame,1);
+  GError * error = NULL;
+  gboolean done = TRUE, sent = FALSE;
+  gsize read = 0;
 
-  /* NB. big-endian spec => bit 0 == MSB */
-  header[0] = (datagram->fin ? 0b10000000:0b00000000)|(((guint8)datagram->code) & 0b00001111);
-  header[1] = (datagram->mask ? 0b10000000:0b00000000)|(((guint8)(mid_header ? 126 : long_header ? 127 : datagram->count)) & 0b01111111);
+  frame->code = (data->type == G_WEBSOCKET_MESSAGE_TEXT) ? G_WEBSOCKET_CODEOP_TEXT : G_WEBSOCKET_CODEOP_BINARY;
+  frame->buffer = _g_websocket_pool_alloc(fragment_size);
 
-  p = 2;
-  if (mid_header)
+  /*
+   * The first chunk is read before the message starts, so other senders
+   * are not held while the source gets going and a source that fits one
+   * fragment is never read under the lock. Once the first fragment is out
+   * the rest must follow before any other data frame, RFC 6455 5.4.
+   */
+  done = g_input_stream_read_all(data->stream,frame->buffer,fragment_size,&read,cancellable,&error);
+  if(done)
     {
-      *(guint16 *)(header + p) = GUINT16_TO_BE( (guint16)datagram->count );
-      p += 2;
+      g_mutex_lock(&(priv->message_mutex));
+      do
+	{
+	  /* a short read means the end of the stream */
+	  frame->count = read;
+	  frame->fin = read < fragment_size;
+	  done = _g_websocket_write(socket,frame,cancellable,&error);
+	  frame->code = G_WEBSOCKET_CODEOP_CONTINUE;
+	  sent = TRUE;
+	  if(done && !frame->fin)
+	    done = g_input_stream_read_all(data->stream,frame->buffer,fragment_size,&read,cancellable,&error);
+	}
+      while(done && !frame->fin);
+      g_mutex_unlock(&(priv->message_mutex));
     }
-  else if (long_header)
+
+  _g_websocket_pool_free(frame->buffer);
+  g_free(frame);
+
+  if(done)
     {
-      *(guint64 *)(header + p) = GUINT64_TO_BE( datagram->count );
-      p += 8;
+      g_task_return_boolean(task,TRUE);
     }
-  guint8 *
-  masked_buf = NULL;
-  if(datagram->mask)
+  else
     {
-      guint8 * mask_val = ((guint8*)&(datagram->mask));
-      *((guint8*)(header + p)) = mask_val[0];
-      *((guint8*)(header + p + 1)) = mask_val[1];
-      *((guint8*)(header + p + 2)) = mask_val[2];
-      *((guint8*)(header + p + 3)) = mask_val[3];
+      /* the message can not be finished, stop instead of leaving it open */
+      if(sent && g_websocket_is_connected(socket))
+	_g_websocket_stop_later(socket);
+      g_task_return_error(task,error);
+    }
+}
 
-      p += 4;
-      masked_buf = g_malloc(datagram->count);
+static void
+_g_websocket_file_data_free(GWebSocketFileData * data)
+{
+  close(data->fd);
+  g_free(data);
+}
 
-      for(guint32 index = 0;index < datagram->count;index++)
-	masked_buf[index] = datagram->buffer[index] ^ mask_val[index % 4];
+static gboolean
+_g_websocket_pread_all(
+    gint fd,
+    guint8 * buffer,
+    gsize count,
+    goffset offset,
+    GError ** error)
+{
+  while(count > 0)
+    {
+      gssize done = pread(fd,buffer,count,offset);
+      if(done < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  g_set_error_literal(error,G_IO_ERROR,g_io_error_from_errno(errno),g_strerror(errno));
+	  return FALSE;
+	}
+      if(done == 0)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_FAILED,"file ended before the message");
+	  return FALSE;
+	}
+      buffer += done;
+      count -= done;
+      offset += done;
     }
+  return TRUE;
+}
 
-  gboolean done = FALSE;
-  done = g_output_stream_write_all(output, header, p,NULL, cancellable,error);
-  if(done)
+/*
+ * The header goes out with MSG_MORE, the kernel holds it back and puts it
+ * in the same segment as the start of the payload that follows.
+ */
+static gboolean
+_g_websocket_send_header(
+    GSocket * gsocket,
+    const guint8 * header,
+    gsize count,
+    GCancellable * cancellable,
+    GError ** error)
+{
+  while(count > 0)
+    {
+      GOutputVector vector = { header, count };
+      gssize done = g_socket_send_message(gsocket,NULL,&vector,1,NULL,0,MSG_MORE,cancellable,error);
+      if(done < 0)
+	return FALSE;
+      header += done;
+      count -= done;
+    }
+  return TRUE;
+}
+
+/* copies count bytes of fd from offset to the socket inside the kernel */
+static gboolean
+_g_websocket_sendfile(
+    GSocket * gsocket,
+    gint fd,
+    goffset offset,
+    gsize count,
+    GCancellable * cancellable,
+    GError ** error)
+{
+  gint out_fd = g_socket_get_fd(gsocket);
+  off_t position = offset;
+  while(count > 0)
+    {
+      gssize done = sendfile(out_fd,fd,&position,count);
+      if(done < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN)
+	    {
+	      if(!g_socket_condition_wait(gsocket,G_IO_OUT,cancellable,error))
+		return FALSE;
+	      continue;
+	    }
+	  g_set_error_literal(error,G_IO_ERROR,g_io_error_from_errno(errno),g_strerror(errno));
+	  return FALSE;
+	}
+      if(done == 0)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_FAILED,"file ended before the message");
+	  return FALSE;
+	}
+      count -= done;
+    }
+  return TRUE;
+}
+
+static void
+_g_websocket_send_file_thread(
+    GTask * task,
+    gpointer source_object,
+    gpointer task_data,
+    GCancellable * cancellable)
+{
+  GWebSocket * socket = G_WEBSOCKET(source_object);
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketFileData * data = (GWebSocketFileData*)task_data;
+  GWebSocketFrame frame = { .fin = FALSE, .code = G_WEBSOCKET_CODEOP_BINARY };
+  guint8 header[G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  gsize fragment_size = _g_websocket_get_fragment_size(socket);
+  gboolean kernel_copy = g_websocket_codec_get_role(priv->codec) == G_WEBSOCKET_CODEC_SERVER;
+  goffset offset = data->offset, remain = data->length;
+  guint8 * buffer = NULL;
+  GError * error = NULL;
+  gboolean done = TRUE, sent = FALSE;
+
+  if(data->type == G_WEBSOCKET_MESSAGE_TEXT)
+    frame.code = G_WEBSOCKET_CODEOP_TEXT;
+
+  /* a client has to mask the payload, so it goes through user space */
+  if(!kernel_copy)
+    buffer = _g_websocket_pool_alloc(MIN((goffset)fragment_size,MAX(remain,1)));
+
+  g_mutex_lock(&(priv->message_mutex));
+  do
     {
-      if(datagram->buffer)
+      frame.count = MIN((goffset)fragment_size,remain);
+      frame.fin = (goffset)frame.count == remain;
+      if(!kernel_copy)
 	{
-	  if(!(datagram->mask))
+	  frame.buffer = buffer;
+	  done = _g_websocket_pread_all(data->fd,buffer,frame.count,offset,&error);
+	}
+
+      if(done)
+	{
+	  g_mutex_lock(&(priv->write_mutex));
+	  if(priv->connection)
 	    {
-	      done = g_output_stream_write_all (output, datagram->buffer, datagram->count, NULL, cancellable, error);
+	      gsize header_size = g_websocket_codec_encode_header(priv->codec,&frame,header);
+	      if(kernel_copy)
+		{
+		  GSocket * gsocket = g_socket_connection_get_socket(priv->connection);
+		  done = _g_websocket_send_header(gsocket,header,header_size,cancellable,&error)
+		      && _g_websocket_sendfile(gsocket,data->fd,offset,frame.count,cancellable,&error);
+		}
+	      else
+		{
+		  GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+		  GOutputVector vectors[2] = { { header, header_size }, { buffer, frame.count } };
+		  if(frame.mask)
+		    _g_websocket_mask(buffer,buffer,frame.count,frame.mask,0);
+		  done = g_output_stream_writev_all(output,vectors,2,NULL,cancellable,&error);
+		}
+	      sent = TRUE;
 	    }
 	  else
 	    {
-	      done = g_output_stream_write_all (output, masked_buf, datagram->count, NULL, cancellable, error);
-	      g_free(masked_buf);
+	      g_set_error_literal(&error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+	      done = FALSE;
 	    }
+	  g_mutex_unlock(&(priv->write_mutex));
 	}
-      done = g_output_stream_flush(output,cancellable,error);
+      offset += frame.count;
+      remain -= frame.count;
+      frame.code = G_WEBSOCKET_CODEOP_CONTINUE;
     }
+  while(done && !frame.fin);
+  g_mutex_unlock(&(priv->message_mutex));
 
-  return done;
+  _g_websocket_pool_free(buffer);
+
+  if(done)
+    {
+      g_task_return_boolean(task,TRUE);
+    }
+  else
+    {
+      /* a frame may be cut short, the stream can not be recovered */
+      if(sent && g_websocket_is_connected(socket))
+	_g_websocket_stop_later(socket);
+      g_task_return_error(task,error);
+    }
 }
 
 gboolean
@@ -624,6 +1338,23 @@ _g_websocket_complete(
   http_package_set_string(HTTP_PACKAGE(response),"Connection","upgrade",-1);
   http_package_set_string(HTTP_PACKAGE(response),"Sec-WebSocket-Accept",handshake,-1);
   http_package_set_string(HTTP_PACKAGE(response),"Sec-WebSocket-Origin",origin,-1);
+  if(priv->deflate || priv->dictionaries->len)
+    {
+      const gchar * offers = http_package_get_string(HTTP_PACKAGE(request),"Sec-WebSocket-Extensions",NULL);
+      gchar * extensions = NULL;
+      /* a shared dictionary beats deflate, both can not be agreed */
+      g_clear_pointer(&(priv->dictionary),g_websocket_dictionary_unref);
+      priv->dictionary = _g_websocket_zstd_negotiate(offers,priv->dictionaries,&extensions);
+      if(!priv->dictionary && priv->deflate)
+	priv->deflate_active = _g_websocket_deflate_negotiate(offers,
+							      _g_websocket_deflate_window_bits(priv->deflate_memory),
+							      priv->deflate_no_context_takeover,
+							      &(priv->deflate_params),
+							      &extensions);
+      if(extensions)
+	http_package_set_string(HTTP_PACKAGE(response),"Sec-WebSocket-Extensions",extensions,-1);
+      g_free(extensions);
+    }
   done = http_package_write_to_stream(HTTP_PACKAGE(response),output,NULL,NULL,NULL);
   g_free(handshake);
 
@@ -646,7 +1377,9 @@ _g_websocket_complete_client(GWebSocket * socket,const gchar * hostname,const gc
   HttpRequest * request = http_request_new(HTTP_REQUEST_METHOD_GET,"",1.1);
   HttpResponse* response = http_response_new(HTTP_RESPONSE_SWITCHING_PROTOCOLS,1.1);
   gchar   * key = g_websocket_generate_key(),
-	  * handshake = g_websocket_generate_handshake(key);
+	  * handshake = g_websocket_generate_handshake(key),
+	  * offer = NULL;
+  guint window_bits = _g_websocket_deflate_window_bits(priv->deflate_memory);
 
   http_request_set_query(request,query);
   http_request_set_method(request,HTTP_REQUEST_METHOD_GET);
@@ -654,6 +1387,25 @@ _g_websocket_complete_client(GWebSocket * socket,const gchar * hostname,const gc
   http_package_set_string(HTTP_PACKAGE(request),"Upgrade","websocket",-1);
   http_package_set_string(HTTP_PACKAGE(request),"Origin",hostname,-1);
   http_package_set_string(HTTP_PACKAGE(request),"Sec-WebSocket-Key",key,-1);
+  if(priv->dictionaries->len || (priv->deflate && window_bits))
+    {
+      /* the dictionaries first, in order of preference */
+      GString * offers = g_string_new(NULL);
+      if(priv->dictionaries->len)
+	{
+	  gchar * text = _g_websocket_zstd_offer(priv->dictionaries);
+	  g_string_append(offers,text);
+	  g_free(text);
+	}
+      if(priv->deflate && window_bits)
+	{
+	  gchar * text = _g_websocket_deflate_offer(window_bits,priv->deflate_no_context_takeover);
+	  g_string_append_printf(offers,"%s%s",offers->len ? ", " : "",text);
+	  g_free(text);
+	}
+      offer = g_string_free(offers,FALSE);
+      http_package_set_string(HTTP_PACKAGE(request),"Sec-WebSocket-Extensions",offer,-1);
+    }
 
   if(http_package_write_to_stream(HTTP_PACKAGE(request),output,NULL,NULL,NULL))
   {
@@ -663,7 +1415,19 @@ _g_websocket_complete_client(GWebSocket * socket,const gchar * hostname,const gc
 	http_package_read_from_stream(HTTP_PACKAGE(response),data_stream,NULL,NULL,NULL);
 	g_input_stream_close(G_INPUT_STREAM(data_stream),NULL,NULL);
 	g_object_unref(data_stream);
-	if((http_response_get_code(response) == HTTP_RESPONSE_SWITCHING_PROTOCOLS) && (g_strcmp0(handshake,http_package_get_string(HTTP_PACKAGE(response),"Sec-WebSocket-Accept",NULL)) == 0))
+	/* an extension that was not offered or can not be honoured fails the handshake */
+	const gchar * extensions = http_package_get_string(HTTP_PACKAGE(response),"Sec-WebSocket-Extensions",NULL);
+	g_clear_pointer(&(priv->dictionary),g_websocket_dictionary_unref);
+	priv->deflate_active = FALSE;
+	if(extensions && offer)
+	  {
+	    priv->dictionary = _g_websocket_zstd_accept(extensions,priv->dictionaries);
+	    priv->deflate_active = !priv->dictionary && priv->deflate && window_bits
+				   && _g_websocket_deflate_accept(extensions,window_bits,priv->deflate_no_context_takeover,&(priv->deflate_params));
+	  }
+	if((http_response_get_code(response) == HTTP_RESPONSE_SWITCHING_PROTOCOLS)
+	   && (g_strcmp0(handshake,http_package_get_string(HTTP_PACKAGE(response),"Sec-WebSocket-Accept",NULL)) == 0)
+	   && (!extensions || priv->deflate_active || priv->dictionary))
 	  {
 	    priv->request = HTTP_REQUEST(g_object_ref(request));
 	    _g_websocket_start(socket);
@@ -686,6 +1450,7 @@ _g_websocket_complete_client(GWebSocket * socket,const gchar * hostname,const gc
 
   g_free(key);
   g_free(handshake);
+  g_free(offer);
 
   g_object_unref(request);
   g_object_unref(response);
@@ -740,74 +1505,1013 @@ g_websocket_connect(
   return done;
 }
 
-HttpRequest *
-g_websocket_get_request(
-    GWebSocket * socket)
+/*
+ * In streaming mode the fragments of a fragmented message are not
+ * reassembled, each one is emitted with the "message-chunk" signal as soon
+ * as it arrives. Unfragmented messages are still emitted with "message".
+ * A message already being received finishes in the mode it started in.
+ */
+void
+g_websocket_set_streaming(
+    GWebSocket * socket,
+    gboolean streaming
+    )
 {
   GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
-  return priv->request;
+  priv->streaming = streaming;
+  if(priv->codec)
+    g_websocket_codec_set_reassemble(priv->codec,!streaming);
 }
 
 gboolean
-g_websocket_send(
+g_websocket_get_streaming(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->streaming;
+}
+
+void
+g_websocket_set_max_message_size(
     GWebSocket * socket,
-    GWebSocketMessage * message,
-    GError ** error
+    gsize max_message_size
     )
 {
-  GWebSocketClass * klass = G_WEBSOCKET_GET_CLASS(socket);
   GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
-  gboolean done = klass->send(socket,message,priv->recv_cancellable,error);
-  if(!done)
-    _g_websocket_stop(socket);
-  return done;
+  priv->max_message_size = max_message_size;
+  if(priv->codec)
+    g_websocket_codec_set_max_message_size(priv->codec,max_message_size);
 }
 
-gboolean
-g_websocket_send_text(
+gsize
+g_websocket_get_max_message_size(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->max_message_size;
+}
+
+void
+g_websocket_set_max_frame_size(
     GWebSocket * socket,
-    const gchar * text,
-    gssize length,
-    GError ** error
+    gsize max_frame_size
     )
 {
-  GWebSocketMessage * msg = g_websocket_message_new_text(text,length);
-  gboolean done = g_websocket_send(socket,msg,error);
-  g_websocket_message_free(msg);
-  return done;
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->max_frame_size = max_frame_size;
+  if(priv->codec)
+    g_websocket_codec_set_max_frame_size(priv->codec,max_frame_size);
 }
 
-gboolean
-g_websocket_send_data(
+gsize
+g_websocket_get_max_frame_size(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->max_frame_size;
+}
+
+/*
+ * Limits the memory held by the messages being received, 0 means no limit.
+ * The process wide budget is set with g_websocket_codec_set_memory_budget().
+ */
+void
+g_websocket_set_max_receive_memory(
     GWebSocket * socket,
-    const guint8 * data,
-    gssize length,
-    GError ** error
+    gsize max_receive_memory
     )
 {
-  GWebSocketMessage * msg = g_websocket_message_new_data(data,length);
-  gboolean done = g_websocket_send(socket,msg,error);
-  g_websocket_message_free(msg);
-  return done;
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->max_receive_memory = max_receive_memory;
+  if(priv->codec)
+    g_websocket_codec_set_max_memory(priv->codec,max_receive_memory);
+}
+
+gsize
+g_websocket_get_max_receive_memory(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->max_receive_memory;
 }
 
+/*
+ * Received messages larger than spill_size are kept in a memfd instead of
+ * the heap, see g_websocket_message_get_fd(). 0 disables it.
+ */
 void
-g_websocket_close(
+g_websocket_set_spill_size(
     GWebSocket * socket,
-    GError ** error
+    gsize spill_size
     )
 {
   GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->spill_size = spill_size;
+  if(priv->codec)
+    g_websocket_codec_set_spill_size(priv->codec,spill_size);
+}
+
+gsize
+g_websocket_get_spill_size(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->spill_size;
+}
+
+/*
+ * Offers permessage-deflate to the server, or accepts it from the client,
+ * on the next handshake. Messages sent with g_websocket_send(),
+ * g_websocket_send_messages() and g_websocket_send_builder() are then
+ * compressed, the other ways of sending bypass it.
+ */
+void
+g_websocket_set_deflate(
+    GWebSocket * socket,
+    gboolean deflate
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->deflate = deflate;
+}
+
+gboolean
+g_websocket_get_deflate(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->deflate;
+}
+
+/* TRUE once permessage-deflate or a zstd dictionary was agreed in the handshake */
+gboolean
+g_websocket_is_compressed(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->deflate_active || priv->dictionary;
+}
+
+/*
+ * Asks for no context takeover on the side of this socket, the compressor
+ * is released after every message instead of being kept between them.
+ */
+void
+g_websocket_set_deflate_no_context_takeover(
+    GWebSocket * socket,
+    gboolean no_context_takeover
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->deflate_no_context_takeover = no_context_takeover;
+}
+
+gboolean
+g_websocket_get_deflate_no_context_takeover(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->deflate_no_context_takeover;
+}
+
+/*
+ * Bytes the zlib compressor and decompressor of the connection may use,
+ * the window bits negotiated for both directions are chosen to fit. Too
+ * little memory for the smallest window disables compression, 0 means no
+ * limit.
+ */
+void
+g_websocket_set_deflate_memory(
+    GWebSocket * socket,
+    gsize memory
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->deflate_memory = memory;
+}
+
+gsize
+g_websocket_get_deflate_memory(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->deflate_memory;
+}
+
+/* messages shorter than threshold are not worth compressing */
+void
+g_websocket_set_deflate_threshold(
+    GWebSocket * socket,
+    gsize threshold
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->deflate_threshold = threshold;
+  if(priv->codec)
+    g_websocket_codec_set_deflate_threshold(priv->codec,threshold);
+}
+
+gsize
+g_websocket_get_deflate_threshold(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->deflate_threshold;
+}
+
+/*
+ * Adds a zstd dictionary for x-gwebsocket-zstd, a private extension only
+ * other gwebsocket peers know. A client offers its dictionaries in the
+ * order they were added, a server accepts the first offer naming one of
+ * its own and prefers it over permessage-deflate. Set before connecting.
+ */
+void
+g_websocket_add_dictionary(
+    GWebSocket * socket,
+    GWebSocketDictionary * dictionary
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  g_return_if_fail(dictionary != NULL);
+  g_ptr_array_add(priv->dictionaries,g_websocket_dictionary_ref(dictionary));
+}
+
+/* the dictionary agreed in the handshake, NULL if none was */
+GWebSocketDictionary *
+g_websocket_get_dictionary(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->dictionary;
+}
+
+/*
+ * Handlers called directly on the hot path, before and much cheaper than
+ * the signals, which are then only emitted when connected. NULL members
+ * leave their signal alone, NULL handlers removes them all. The read loop
+ * uses them without a lock, they can only be set before the websocket
+ * connects.
+ */
+void
+g_websocket_set_handlers(
+    GWebSocket * socket,
+    const GWebSocketHandlers * handlers,
+    gpointer user_data
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  g_return_if_fail(!g_websocket_is_connected(socket));
+  if(handlers)
+    priv->handlers = *handlers;
+  else
+    memset(&(priv->handlers),0,sizeof(GWebSocketHandlers));
+  priv->handlers_data = user_data;
+}
+
+HttpRequest *
+g_websocket_get_request(
+    GWebSocket * socket)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->request;
+}
+
+gboolean
+g_websocket_send(
+    GWebSocket * socket,
+    GWebSocketMessage * message,
+    GError ** error
+    )
+{
+  GWebSocketClass * klass = G_WEBSOCKET_GET_CLASS(socket);
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  gboolean done = klass->send(socket,message,priv->recv_cancellable,error);
+  if(!done)
+    _g_websocket_stop(socket);
+  return done;
+}
+
+/*
+ * Sends several messages at once, gathered in as few vectored writes as
+ * possible.
+ */
+gboolean
+g_websocket_send_messages(
+    GWebSocket * socket,
+    GWebSocketMessage ** messages,
+    guint n_messages,
+    GError ** error
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketFrame * frames = g_new0(GWebSocketFrame,n_messages);
+  GWebSocketFrame ** frame_list = g_new0(GWebSocketFrame*,n_messages);
+  guint8 ** compressed = g_new0(guint8*,n_messages);
+  gboolean done = FALSE;
+
+  for(guint index = 0;index < n_messages;index++)
+    {
+      _g_websocket_message_to_frame(messages[index],&(frames[index]));
+      frame_list[index] = &(frames[index]);
+    }
+
+  if(g_websocket_is_connected(socket))
+    {
+      g_mutex_lock(&(priv->message_mutex));
+      for(guint index = 0;index < n_messages;index++)
+	compressed[index] = _g_websocket_compress_frame(socket,frame_list[index],0);
+      done = _g_websocket_write_frames(socket,frame_list,n_messages,priv->recv_cancellable,error);
+      g_mutex_unlock(&(priv->message_mutex));
+      if(!done)
+	_g_websocket_stop(socket);
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+
+  for(guint index = 0;index < n_messages;index++)
+    _g_websocket_pool_free(compressed[index]);
+  g_free(compressed);
+  g_free(frame_list);
+  g_free(frames);
+  return done;
+}
+
+/*
+ * Sends the content of builder as one frame and frees it. The header is
+ * encoded in the headroom reserved by the builder and a client masks the
+ * payload in place, so the frame goes out with one write and no copy.
+ */
+gboolean
+g_websocket_send_builder(
+    GWebSocket * socket,
+    GWebSocketMessageBuilder * builder,
+    GError ** error
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketFrame frame = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_BINARY };
+  gboolean done = FALSE;
+
+  if(g_websocket_message_builder_get_type(builder) == G_WEBSOCKET_MESSAGE_TEXT)
+    frame.code = G_WEBSOCKET_CODEOP_TEXT;
+
+  guint8 *
+  buffer = _g_websocket_message_builder_steal(builder,&(frame.count));
+  frame.buffer = buffer + G_WEBSOCKET_CODEC_MAX_HEADER_SIZE;
+
+  g_mutex_lock(&(priv->message_mutex));
+  guint8 * compressed = _g_websocket_compress_frame(socket,&frame,G_WEBSOCKET_CODEC_MAX_HEADER_SIZE);
+  if(compressed)
+    {
+      _g_websocket_pool_free(buffer);
+      buffer = compressed;
+    }
+  g_mutex_lock(&(priv->write_mutex));
+  if(priv->connection)
+    {
+      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+      gsize header_size = g_websocket_codec_get_header_size(priv->codec,frame.count);
+      guint8 * header = frame.buffer - header_size;
+      g_websocket_codec_encode_header(priv->codec,&frame,header);
+      if(frame.mask)
+	_g_websocket_mask(frame.buffer,frame.buffer,frame.count,frame.mask,0);
+      done = g_output_stream_write_all(output,header,header_size + frame.count,NULL,priv->recv_cancellable,error);
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+  g_mutex_unlock(&(priv->write_mutex));
+  g_mutex_unlock(&(priv->message_mutex));
+  _g_websocket_pool_free(buffer);
+
+  if(!done && g_websocket_is_connected(socket))
+    _g_websocket_stop(socket);
+  return done;
+}
+
+/*
+ * Sends data as one message masking it in place, so data is overwritten
+ * with the masked payload and must be writable. Saves the copy a client
+ * makes otherwise, a server sends data as it is and leaves it untouched.
+ */
+gboolean
+g_websocket_send_in_place(
+    GWebSocket * socket,
+    GWebSocketMessageType type,
+    guint8 * data,
+    gsize length,
+    GError ** error
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketFrame frame = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_BINARY, .buffer = data, .count = length };
+  guint8 header[G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  gboolean done = FALSE;
+
+  if(type == G_WEBSOCKET_MESSAGE_TEXT)
+    frame.code = G_WEBSOCKET_CODEOP_TEXT;
+
+  g_mutex_lock(&(priv->message_mutex));
+  g_mutex_lock(&(priv->write_mutex));
+  if(priv->connection)
+    {
+      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+      GOutputVector vectors[2];
+      vectors[0].buffer = header;
+      vectors[0].size = g_websocket_codec_encode_header(priv->codec,&frame,header);
+      vectors[1].buffer = data;
+      vectors[1].size = length;
+      if(frame.mask)
+	_g_websocket_mask(data,data,length,frame.mask,0);
+      done = g_output_stream_writev_all(output,vectors,2,NULL,priv->recv_cancellable,error);
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+  g_mutex_unlock(&(priv->write_mutex));
+  g_mutex_unlock(&(priv->message_mutex));
+
+  if(!done && g_websocket_is_connected(socket))
+    _g_websocket_stop(socket);
+  return done;
+}
+
+/*
+ * Sends the n_vectors buffers as a single message without joining them. A
+ * server writes the header and the buffers with one vectored write, a client
+ * masks them across buffer boundaries through a bounded scratch buffer.
+ */
+gboolean
+g_websocket_send_vectors(
+    GWebSocket * socket,
+    GWebSocketMessageType type,
+    const GOutputVector * vectors,
+    gsize n_vectors,
+    GError ** error
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketFrame frame = { .fin = TRUE, .code = G_WEBSOCKET_CODEOP_BINARY };
+  guint8 header[G_WEBSOCKET_CODEC_MAX_HEADER_SIZE];
+  gboolean done = FALSE;
+
+  if(type == G_WEBSOCKET_MESSAGE_TEXT)
+    frame.code = G_WEBSOCKET_CODEOP_TEXT;
+  for(gsize index = 0;index < n_vectors;index++)
+    frame.count += vectors[index].size;
+
+  g_mutex_lock(&(priv->message_mutex));
+  g_mutex_lock(&(priv->write_mutex));
+  if(priv->connection)
+    {
+      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+      gsize header_size = g_websocket_codec_encode_header(priv->codec,&frame,header);
+      if(frame.mask)
+	{
+	  guint8 * scratch = _g_websocket_pool_alloc(MIN(header_size + frame.count,G_WEBSOCKET_MASK_SCRATCH_SIZE));
+	  gsize used = header_size, offset = 0;
+	  memcpy(scratch,header,header_size);
+	  done = TRUE;
+	  for(gsize index = 0;done && (index < n_vectors);index++)
+	    {
+	      const guint8 * data = vectors[index].buffer;
+	      gsize remain = vectors[index].size;
+	      while(done && (remain > 0))
+		{
+		  gsize count = MIN(remain,G_WEBSOCKET_MASK_SCRATCH_SIZE - used);
+		  _g_websocket_mask(scratch + used,data,count,frame.mask,offset);
+		  used += count;
+		  offset += count;
+		  data += count;
+		  remain -= count;
+		  if(used == G_WEBSOCKET_MASK_SCRATCH_SIZE)
+		    {
+		      done = g_output_stream_write_all(output,scratch,used,NULL,priv->recv_cancellable,error);
+		      used = 0;
+		    }
+		}
+	    }
+	  if(done && (used > 0))
+	    done = g_output_stream_write_all(output,scratch,used,NULL,priv->recv_cancellable,error);
+	  _g_websocket_pool_free(scratch);
+	}
+      else
+	{
+	  GOutputVector * all = g_new(GOutputVector,n_vectors + 1);
+	  all[0].buffer = header;
+	  all[0].size = header_size;
+	  memcpy(all + 1,vectors,n_vectors * sizeof(GOutputVector));
+	  done = g_output_stream_writev_all(output,all,n_vectors + 1,NULL,priv->recv_cancellable,error);
+	  g_free(all);
+	}
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+  g_mutex_unlock(&(priv->write_mutex));
+  g_mutex_unlock(&(priv->message_mutex));
+
+  if(!done && g_websocket_is_connected(socket))
+    _g_websocket_stop(socket);
+  return done;
+}
+
+GWebSocketEncodings *
+_g_websocket_encodings_new(
+    GWebSocketMessage * message)
+{
+  GWebSocketEncodings * encodings = g_new0(GWebSocketEncodings,1);
+  encodings->message = g_websocket_message_ref(message);
+  return encodings;
+}
+
+static void
+_g_websocket_encoding_free(
+    gpointer encoding)
+{
+  _g_websocket_pool_free(((GWebSocketEncoding*)encoding)->compressed);
+  g_free(encoding);
+}
+
+void
+_g_websocket_encodings_free(
+    GWebSocketEncodings * encodings)
+{
+  for(guint index = 0;index < G_WEBSOCKET_ENCODINGS;index++)
+    _g_websocket_pool_free(encodings->encodings[index].compressed);
+  if(encodings->dictionaries)
+    g_hash_table_unref(encodings->dictionaries);
+  g_websocket_message_unref(encodings->message);
+  g_free(encodings);
+}
+
+/*
+ * The encoding of the message for window bits or a zstd dictionary,
+ * compressed without reference to earlier messages so every peer with the
+ * same window or dictionary shares it. Falls back to the plain payload
+ * when compression does not make it smaller.
+ */
+static GWebSocketEncoding *
+_g_websocket_encodings_get(
+    GWebSocketEncodings * encodings,
+    GWebSocketCodec * codec,
+    guint bits,
+    GWebSocketDictionary * dictionary)
+{
+  GWebSocketEncoding * encoding = &(encodings->encodings[MIN(bits,G_WEBSOCKET_ENCODINGS - 1)]);
+  if(dictionary)
+    {
+      if(!encodings->dictionaries)
+	encodings->dictionaries = g_hash_table_new_full(NULL,NULL,NULL,_g_websocket_encoding_free);
+      encoding = g_hash_table_lookup(encodings->dictionaries,dictionary);
+      if(!encoding)
+	{
+	  encoding = g_new0(GWebSocketEncoding,1);
+	  g_hash_table_insert(encodings->dictionaries,dictionary,encoding);
+	}
+    }
+  if(!encoding->ready)
+    {
+      GWebSocketFrame * frame = &(encoding->frame);
+      gsize length = 0;
+      _g_websocket_message_to_frame(encodings->message,frame);
+      if(dictionary)
+	encoding->compressed = _g_websocket_zstd_compress(dictionary,frame->buffer,frame->count,0,&length);
+      else if(bits)
+	encoding->compressed = _g_websocket_deflate_compress_once(bits,frame->buffer,frame->count,0,&length);
+      if(encoding->compressed)
+	{
+	  frame->buffer = encoding->compressed;
+	  frame->count = length;
+	  frame->compressed = TRUE;
+	}
+      encoding->header_size = g_websocket_codec_encode_header(codec,frame,encoding->header);
+      encoding->ready = TRUE;
+    }
+  return encoding;
+}
+
+/*
+ * Sends the message of encodings as framed for the peer's encoding, writing
+ * the shared header and payload without copying or compressing again. A
+ * client masks every frame with its own key, so it sends the usual way.
+ */
+gboolean
+_g_websocket_send_encoded(
+    GWebSocket * socket,
+    GWebSocketEncodings * encodings,
+    GError ** error)
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  GWebSocketEncoding * encoding = NULL;
+  GWebSocketDictionary * dictionary = NULL;
+  gsize count = g_websocket_message_get_length(encodings->message);
+  gboolean done = FALSE;
+
+  if(!priv->codec || (g_websocket_codec_get_role(priv->codec) == G_WEBSOCKET_CODEC_CLIENT))
+    return g_websocket_send(socket,encodings->message,error);
+
+  if(count >= g_websocket_codec_get_deflate_threshold(priv->codec))
+    dictionary = g_websocket_codec_get_dictionary(priv->codec);
+  encoding = _g_websocket_encodings_get(encodings,priv->codec,_g_websocket_codec_get_deflate_bits(priv->codec,count),dictionary);
+
+  g_mutex_lock(&(priv->message_mutex));
+  /* the peer's window now holds a message our compressor never saw */
+  if(encoding->frame.compressed)
+    _g_websocket_codec_reset_deflate(priv->codec);
+  g_mutex_lock(&(priv->write_mutex));
+  if(priv->connection)
+    {
+      GOutputStream * output = g_io_stream_get_output_stream(G_IO_STREAM(priv->connection));
+      GOutputVector vectors[2];
+      vectors[0].buffer = encoding->header;
+      vectors[0].size = encoding->header_size;
+      vectors[1].buffer = encoding->frame.buffer;
+      vectors[1].size = encoding->frame.count;
+      done = g_output_stream_writev_all(output,vectors,2,NULL,priv->recv_cancellable,error);
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+  g_mutex_unlock(&(priv->write_mutex));
+  g_mutex_unlock(&(priv->message_mutex));
+
+  if(!done && g_websocket_is_connected(socket))
+    _g_websocket_stop(socket);
+  return done;
+}
+
+/*
+ * The default send is done with the payload before it returns, so the
+ * caller's memory does not need to be copied. An overriding send may keep
+ * the message, it gets a copy.
+ */
+static GWebSocketMessage *
+_g_websocket_message_new_borrowed(
+    GWebSocket * socket,
+    GWebSocketMessageType type,
+    gconstpointer data,
+    gsize length)
+{
+  if(G_WEBSOCKET_GET_CLASS(socket)->send == _g_websocket_send)
+    return g_websocket_message_new_static(type,data,length);
+  else if(type == G_WEBSOCKET_MESSAGE_TEXT)
+    return g_websocket_message_new_text(data,length);
+  else
+    return g_websocket_message_new_data(data,length);
+}
+
+gboolean
+g_websocket_send_text(
+    GWebSocket * socket,
+    const gchar * text,
+    gssize length,
+    GError ** error
+    )
+{
+  GWebSocketMessage * msg = _g_websocket_message_new_borrowed(socket,G_WEBSOCKET_MESSAGE_TEXT,text,(length < 0) ? strlen(text) : (gsize)length);
+  gboolean done = g_websocket_send(socket,msg,error);
+  g_websocket_message_unref(msg);
+  return done;
+}
+
+gboolean
+g_websocket_send_data(
+    GWebSocket * socket,
+    const guint8 * data,
+    gssize length,
+    GError ** error
+    )
+{
+  GWebSocketMessage * msg = _g_websocket_message_new_borrowed(socket,G_WEBSOCKET_MESSAGE_BINARY,data,length);
+  gboolean done = g_websocket_send(socket,msg,error);
+  g_websocket_message_unref(msg);
+  return done;
+}
+
+/*
+ * Sends the content of stream as one message, read and sent in fragments of
+ * g_websocket_get_fragment_size() bytes so it is never fully held in memory.
+ * Other messages wait until this one is finished, control frames do not.
+ */
+void
+g_websocket_send_stream_async(
+    GWebSocket * socket,
+    GInputStream * stream,
+    GWebSocketMessageType type,
+    GCancellable * cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data
+    )
+{
+  GTask * task = g_task_new(socket,cancellable,callback,user_data);
+  GWebSocketSendData * data = g_new0(GWebSocketSendData,1);
+  data->stream = g_object_ref(stream);
+  data->type = type;
+  g_task_set_source_tag(task,g_websocket_send_stream_async);
+  g_task_set_task_data(task,data,(GDestroyNotify)_g_websocket_send_data_free);
+  if(g_websocket_is_connected(socket))
+    g_task_run_in_thread(task,_g_websocket_send_stream_thread);
+  else
+    g_task_return_new_error(task,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+  g_object_unref(task);
+}
+
+gboolean
+g_websocket_send_stream_finish(
+    GWebSocket * socket,
+    GAsyncResult * result,
+    GError ** error
+    )
+{
+  g_return_val_if_fail(g_task_is_valid(result,socket),FALSE);
+  return g_task_propagate_boolean(G_TASK(result),error);
+}
+
+/*
+ * Sends length bytes of fd from offset as one binary or text message, a
+ * negative length sends up to the end of the file. A server passes the
+ * payload to the socket with sendfile() without copying it through user
+ * space, a client reads and masks it one fragment at a time. fd is
+ * duplicated, the caller may close it right away.
+ */
+void
+g_websocket_send_file_async(
+    GWebSocket * socket,
+    gint fd,
+    goffset offset,
+    goffset length,
+    GWebSocketMessageType type,
+    GCancellable * cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data
+    )
+{
+  GTask * task = g_task_new(socket,cancellable,callback,user_data);
+  g_task_set_source_tag(task,g_websocket_send_file_async);
+
+  if(length < 0)
+    {
+      struct stat st;
+      if(fstat(fd,&st) < 0)
+	{
+	  gint saved = errno;
+	  g_task_return_new_error(task,G_IO_ERROR,g_io_error_from_errno(saved),"%s",g_strerror(saved));
+	  g_object_unref(task);
+	  return;
+	}
+      length = MAX(st.st_size - offset,0);
+    }
+
+  GWebSocketFileData * data = g_new0(GWebSocketFileData,1);
+  data->fd = fcntl(fd,F_DUPFD_CLOEXEC,0);
+  data->offset = offset;
+  data->length = length;
+  data->type = type;
+  if(data->fd < 0)
+    {
+      gint saved = errno;
+      g_free(data);
+      g_task_return_new_error(task,G_IO_ERROR,g_io_error_from_errno(saved),"%s",g_strerror(saved));
+    }
+  else
+    {
+      g_task_set_task_data(task,data,(GDestroyNotify)_g_websocket_file_data_free);
+      if(g_websocket_is_connected(socket))
+	g_task_run_in_thread(task,_g_websocket_send_file_thread);
+      else
+	g_task_return_new_error(task,G_IO_ERROR,G_IO_ERROR_NOT_CONNECTED,"websocket is not connected");
+    }
+  g_object_unref(task);
+}
+
+gboolean
+g_websocket_send_file_finish(
+    GWebSocket * socket,
+    GAsyncResult * result,
+    GError ** error
+    )
+{
+  g_return_val_if_fail(g_task_is_valid(result,socket),FALSE);
+  return g_task_propagate_boolean(G_TASK(result),error);
+}
+
+/*
+ * Size of the fragments sent by g_websocket_send_stream_async() and
+ * g_websocket_send_file_async(), 0 sizes them from the send buffer of the
+ * socket.
+ */
+void
+g_websocket_set_fragment_size(
+    GWebSocket * socket,
+    gsize fragment_size
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->fragment_size = fragment_size;
+}
+
+gsize
+g_websocket_get_fragment_size(
+    GWebSocket * socket
+    )
+{
+  return _g_websocket_get_fragment_size(socket);
+}
+
+/*
+ * Context the received messages are delivered on, NULL for the global
+ * default one. The reads complete on it too, so it must be running. Takes
+ * effect when the websocket connects.
+ */
+void
+g_websocket_set_context(
+    GWebSocket * socket,
+    GMainContext * context
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  if(context)
+    g_main_context_ref(context);
+  if(priv->context)
+    g_main_context_unref(priv->context);
+  priv->context = context;
+}
+
+GMainContext *
+g_websocket_get_context(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->context;
+}
+
+/* priority of the dispatch source, G_PRIORITY_DEFAULT_IDLE by default */
+void
+g_websocket_set_priority(
+    GWebSocket * socket,
+    gint priority
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->priority = priority;
+}
+
+gint
+g_websocket_get_priority(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->priority;
+}
+
+/*
+ * Emits the messages right from the read completion instead of from a
+ * source of their own, saving one trip through the main loop. Handlers
+ * must not block, reading waits for them.
+ */
+void
+g_websocket_set_inline_dispatch(
+    GWebSocket * socket,
+    gboolean inline_dispatch
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->inline_dispatch = inline_dispatch;
+}
+
+gboolean
+g_websocket_get_inline_dispatch(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->inline_dispatch;
+}
+
+/*
+ * Delivers complete messages in arrays of up to batch_size on "messages"
+ * instead of one by one on "message". Both are only valid during the
+ * emission, handlers ref the messages they keep. 0 turns batching off.
+ * Takes effect when the websocket connects.
+ */
+void
+g_websocket_set_batch_size(
+    GWebSocket * socket,
+    guint batch_size
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->batch_size = batch_size;
+}
+
+guint
+g_websocket_get_batch_size(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->batch_size;
+}
+
+/* microseconds a batched dispatch may run before yielding, 0 is no limit */
+void
+g_websocket_set_batch_time(
+    GWebSocket * socket,
+    guint batch_time
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->batch_time = batch_time;
+}
+
+guint
+g_websocket_get_batch_time(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->batch_time;
+}
+
+/*
+ * Frames read and decoded ahead of the dispatch before reading pauses, 1
+ * reads again only after the handlers ran. Takes effect when the websocket
+ * connects.
+ */
+void
+g_websocket_set_queue_depth(
+    GWebSocket * socket,
+    guint queue_depth
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->queue_depth = queue_depth;
+}
+
+guint
+g_websocket_get_queue_depth(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->queue_depth;
+}
+
+/* payload bytes waiting for dispatch that pause reading, 0 is no limit */
+void
+g_websocket_set_queue_high_water(
+    GWebSocket * socket,
+    gsize queue_high_water
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  priv->queue_high_water = queue_high_water;
+}
+
+gsize
+g_websocket_get_queue_high_water(
+    GWebSocket * socket
+    )
+{
+  GWebSocketPrivate * priv = g_websocket_get_instance_private(socket);
+  return priv->queue_high_water;
+}
+
+void
+g_websocket_close(
+    GWebSocket * socket,
+    GError ** error
+    )
+{
   if(g_websocket_is_connected(socket))
     {
-      GWebSocketDatagram * datagram = g_new0(GWebSocketDatagram,1);
-      datagram->code = G_WEBSOCKET_CODEOP_CLOSE;
-      datagram->buffer = NULL;
-      datagram->count = 0;
-      datagram->fin = TRUE;
-      datagram->mask = 0;
-      _g_websocket_write(g_io_stream_get_output_stream(G_IO_STREAM(priv->connection)),datagram,NULL,error);
-      g_free(datagram);
+      GWebSocketFrame * frame = g_new0(GWebSocketFrame,1);
+      frame->code = G_WEBSOCKET_CODEOP_CLOSE;
+      frame->buffer = NULL;
+      frame->count = 0;
+      frame->fin = TRUE;
+      _g_websocket_write(socket,frame,NULL,error);
+      g_free(frame);
       _g_websocket_stop(socket);
     }
 }
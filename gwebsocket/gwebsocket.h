@@ -20,9 +20,16 @@
 
 #include "httprequest.h"
 #include "httpresponse.h"
+#include "gwebsocketcodec.h"
+#include "gwebsocketpool.h"
+
+#define G_WEBSOCKET_QUEUE_DEPTH		64
+#define G_WEBSOCKET_QUEUE_HIGH_WATER	1048576
 
 typedef enum	_GWebSocketMessageType	GWebSocketMessageType;
 typedef struct	_GWebSocketMessage 	GWebSocketMessage;
+typedef struct	_GWebSocketMessageBuilder	GWebSocketMessageBuilder;
+typedef struct	_GWebSocketHandlers	GWebSocketHandlers;
 
 #define G_TYPE_WEBSOCKET	(g_websocket_get_type())
 G_DECLARE_DERIVABLE_TYPE	(GWebSocket,g_websocket,G,WEBSOCKET,GObject)
@@ -41,6 +48,14 @@ struct _GWebSocketClass
   gboolean 	(*send)(GWebSocket * socket,GWebSocketMessage * message,GCancellable * cancellable,GError ** error);
 };
 
+struct _GWebSocketHandlers
+{
+  void		(*message)(GWebSocket * socket,GWebSocketMessage * message,gpointer user_data);
+  void		(*message_chunk)(GWebSocket * socket,GWebSocketMessage * message,gboolean last,gpointer user_data);
+  void		(*messages)(GWebSocket * socket,GWebSocketMessage ** messages,guint n_messages,gpointer user_data);
+  void		(*closed)(GWebSocket * socket,gpointer user_data);
+};
+
 gboolean	g_websocket_uri_parse(const gchar * uri,gchar ** scheme,gchar ** hostname,gchar ** query);
 
 GType		g_websocket_get_type(void);
@@ -65,6 +80,106 @@ gboolean	g_websocket_connect(
 		    GCancellable * cancellable,
 		    GError ** error);
 
+void		g_websocket_set_streaming(
+		    GWebSocket * socket,
+		    gboolean streaming
+		    );
+
+gboolean	g_websocket_get_streaming(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_max_message_size(
+		    GWebSocket * socket,
+		    gsize max_message_size
+		    );
+
+gsize		g_websocket_get_max_message_size(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_max_frame_size(
+		    GWebSocket * socket,
+		    gsize max_frame_size
+		    );
+
+gsize		g_websocket_get_max_frame_size(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_max_receive_memory(
+		    GWebSocket * socket,
+		    gsize max_receive_memory
+		    );
+
+gsize		g_websocket_get_max_receive_memory(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_spill_size(
+		    GWebSocket * socket,
+		    gsize spill_size
+		    );
+
+gsize		g_websocket_get_spill_size(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_deflate(
+		    GWebSocket * socket,
+		    gboolean deflate
+		    );
+
+gboolean	g_websocket_get_deflate(
+		    GWebSocket * socket
+		    );
+
+gboolean	g_websocket_is_compressed(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_deflate_no_context_takeover(
+		    GWebSocket * socket,
+		    gboolean no_context_takeover
+		    );
+
+gboolean	g_websocket_get_deflate_no_context_takeover(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_deflate_memory(
+		    GWebSocket * socket,
+		    gsize memory
+		    );
+
+gsize		g_websocket_get_deflate_memory(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_deflate_threshold(
+		    GWebSocket * socket,
+		    gsize threshold
+		    );
+
+gsize		g_websocket_get_deflate_threshold(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_add_dictionary(
+		    GWebSocket * socket,
+		    GWebSocketDictionary * dictionary
+		    );
+
+GWebSocketDictionary *	g_websocket_get_dictionary(
+			    GWebSocket * socket
+			    );
+
+void		g_websocket_set_handlers(
+		    GWebSocket * socket,
+		    const GWebSocketHandlers * handlers,
+		    gpointer user_data
+		    );
+
 HttpRequest *	g_websocket_get_request(
 		    GWebSocket * socket);
 
@@ -74,6 +189,35 @@ gboolean	g_websocket_send(
 		    GError ** error
 		    );
 
+gboolean	g_websocket_send_messages(
+		    GWebSocket * socket,
+		    GWebSocketMessage ** messages,
+		    guint n_messages,
+		    GError ** error
+		    );
+
+gboolean	g_websocket_send_builder(
+		    GWebSocket * socket,
+		    GWebSocketMessageBuilder * builder,
+		    GError ** error
+		    );
+
+gboolean	g_websocket_send_in_place(
+		    GWebSocket * socket,
+		    GWebSocketMessageType type,
+		    guint8 * data,
+		    gsize length,
+		    GError ** error
+		    );
+
+gboolean	g_websocket_send_vectors(
+		    GWebSocket * socket,
+		    GWebSocketMessageType type,
+		    const GOutputVector * vectors,
+		    gsize n_vectors,
+		    GError ** error
+		    );
+
 gboolean	g_websocket_send_text(
 		    GWebSocket * socket,
 		    const gchar * text,
@@ -88,6 +232,110 @@ gboolean	g_websocket_send_data(
 		    GError ** error
 		    );
 
+void		g_websocket_send_stream_async(
+		    GWebSocket * socket,
+		    GInputStream * stream,
+		    GWebSocketMessageType type,
+		    GCancellable * cancellable,
+		    GAsyncReadyCallback callback,
+		    gpointer user_data
+		    );
+
+gboolean	g_websocket_send_stream_finish(
+		    GWebSocket * socket,
+		    GAsyncResult * result,
+		    GError ** error
+		    );
+
+void		g_websocket_send_file_async(
+		    GWebSocket * socket,
+		    gint fd,
+		    goffset offset,
+		    goffset length,
+		    GWebSocketMessageType type,
+		    GCancellable * cancellable,
+		    GAsyncReadyCallback callback,
+		    gpointer user_data
+		    );
+
+gboolean	g_websocket_send_file_finish(
+		    GWebSocket * socket,
+		    GAsyncResult * result,
+		    GError ** error
+		    );
+
+void		g_websocket_set_fragment_size(
+		    GWebSocket * socket,
+		    gsize fragment_size
+		    );
+
+gsize		g_websocket_get_fragment_size(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_context(
+		    GWebSocket * socket,
+		    GMainContext * context
+		    );
+
+GMainContext *	g_websocket_get_context(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_priority(
+		    GWebSocket * socket,
+		    gint priority
+		    );
+
+gint		g_websocket_get_priority(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_inline_dispatch(
+		    GWebSocket * socket,
+		    gboolean inline_dispatch
+		    );
+
+gboolean	g_websocket_get_inline_dispatch(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_batch_size(
+		    GWebSocket * socket,
+		    guint batch_size
+		    );
+
+guint		g_websocket_get_batch_size(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_batch_time(
+		    GWebSocket * socket,
+		    guint batch_time
+		    );
+
+guint		g_websocket_get_batch_time(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_queue_depth(
+		    GWebSocket * socket,
+		    guint queue_depth
+		    );
+
+guint		g_websocket_get_queue_depth(
+		    GWebSocket * socket
+		    );
+
+void		g_websocket_set_queue_high_water(
+		    GWebSocket * socket,
+		    gsize queue_high_water
+		    );
+
+gsize		g_websocket_get_queue_high_water(
+		    GWebSocket * socket
+		    );
+
 void		g_websocket_close(
 		    GWebSocket * socket,
 		    GError ** error
@@ -104,6 +352,25 @@ GWebSocketMessage *	g_websocket_message_new_data(
 			    gsize length
 			    );
 
+GWebSocketMessage *	g_websocket_message_new_from_bytes(
+			    GWebSocketMessageType type,
+			    GBytes * bytes
+			    );
+
+GWebSocketMessage *	g_websocket_message_new_static(
+			    GWebSocketMessageType type,
+			    gconstpointer data,
+			    gsize length
+			    );
+
+GWebSocketMessage *	g_websocket_message_ref(
+			    GWebSocketMessage * message
+			    );
+
+void			g_websocket_message_unref(
+			    GWebSocketMessage * message
+			    );
+
 GWebSocketMessageType	g_websocket_message_get_type(
 			    GWebSocketMessage * message
 			    );
@@ -116,6 +383,15 @@ const guint8 *		g_websocket_message_get_data(
 			    GWebSocketMessage * message
 			    );
 
+GBytes *		g_websocket_message_get_bytes(
+			    GWebSocketMessage * message
+			    );
+
+gint			g_websocket_message_get_fd(
+			    GWebSocketMessage * message,
+			    goffset * offset
+			    );
+
 gsize			g_websocket_message_get_length(
 			    GWebSocketMessage * message
 			    );
@@ -124,4 +400,41 @@ void			g_websocket_message_free(
 			    GWebSocketMessage * message
 			    );
 
+GWebSocketMessageBuilder *	g_websocket_message_builder_new(
+				    GWebSocketMessageType type,
+				    gsize size_hint
+				    );
+
+GWebSocketMessageType		g_websocket_message_builder_get_type(
+				    GWebSocketMessageBuilder * builder
+				    );
+
+guint8 *			g_websocket_message_builder_reserve(
+				    GWebSocketMessageBuilder * builder,
+				    gsize count
+				    );
+
+void				g_websocket_message_builder_append(
+				    GWebSocketMessageBuilder * builder,
+				    gconstpointer data,
+				    gsize count
+				    );
+
+guint8 *			g_websocket_message_builder_get_data(
+				    GWebSocketMessageBuilder * builder
+				    );
+
+gsize				g_websocket_message_builder_get_length(
+				    GWebSocketMessageBuilder * builder
+				    );
+
+void				g_websocket_message_builder_set_length(
+				    GWebSocketMessageBuilder * builder,
+				    gsize length
+				    );
+
+void				g_websocket_message_builder_free(
+				    GWebSocketMessageBuilder * builder
+				    );
+
 #endif /* GWEBSOCKET_H_ */
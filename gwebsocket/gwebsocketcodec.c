@@ -0,0 +1,1335 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include "gwebsocketcodec.h"
+
+#define G_WEBSOCKET_CODEC_BUFFER_SIZE 16384
+#define G_WEBSOCKET_CODEC_MAX_FRAME_SIZE 15728640L //-> 15MB
+#define G_WEBSOCKET_CODEC_MAX_MESSAGE_SIZE 15728640L
+#define G_WEBSOCKET_CODEC_UNMASK_BLOCK 4096
+#define G_WEBSOCKET_RANDOM_BATCH 1024
+
+typedef struct _GWebSocketDeflate GWebSocketDeflate;
+typedef struct _GWebSocketZstd GWebSocketZstd;
+
+/* process wide receive memory, memory_budget 0 means no budget */
+static gsize memory_budget = 0;
+static gsize memory_used = 0;
+
+/*
+ * Readers paused by the budget, their sources are attached once memory is
+ * released. budget_serial counts the releases, budget_waiting the waiters.
+ */
+typedef struct _GWebSocketCodecWaiter GWebSocketCodecWaiter;
+
+struct _GWebSocketCodecWaiter
+{
+  GSource *		source;
+  GMainContext *	context;
+};
+
+static GMutex budget_mutex;
+static GSList * budget_waiters = NULL;
+static gint budget_waiting = 0;
+static gint budget_serial = 0;
+
+struct _GWebSocketCodec
+{
+  gint			ref_count;
+  GWebSocketCodecRole	role;
+  gsize			max_frame_size;
+  gsize			max_message_size;
+  gsize			max_memory;
+  gsize			spill_size;
+  gsize			memory;
+  gboolean		reassemble;
+  gboolean		reassembling;
+  gboolean		(*decode)(GWebSocketCodec * codec,GError ** error);
+  gboolean		failed;
+  guint16		close_code;
+  guint32		utf8_state;
+  guint8 		buffer[G_WEBSOCKET_CODEC_BUFFER_SIZE];
+  gsize			start;
+  gsize			end;
+  GWebSocketFrame * 	frame;
+  GWebSocketFrame *	target;
+  gsize			offset;
+  gsize			frame_size;
+  gsize			received;
+  GWebSocketCodeOp	message_code;
+  GWebSocketFrame *	message;
+  gsize			message_size;
+  gsize			streamed;
+  GQueue		frames;
+  gsize			queued;
+  GWebSocketDeflate *	deflate;
+  GWebSocketZstd *	zstd;
+  gsize			deflate_threshold;
+  gboolean		compressed;
+};
+
+void		_g_websocket_mask(guint8 * dst,const guint8 * src,gsize count,guint32 mask,gsize offset);
+
+gboolean	_g_websocket_utf8_validate(guint32 * state,const guint8 * data,gsize count);
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_alloc0(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+gpointer	_g_websocket_pool_alloc_mapped(gsize size);
+gpointer	_g_websocket_pool_seal(gpointer mem);
+gint		_g_websocket_pool_get_fd(gconstpointer mem,gsize * offset);
+
+void		_g_websocket_random(guint8 * buffer,gsize count);
+
+guint8 *	_g_websocket_codec_compress(GWebSocketCodec * codec,const guint8 * data,gsize count,gsize headroom,gsize * length);
+guint		_g_websocket_codec_get_deflate_bits(GWebSocketCodec * codec,gsize count);
+void		_g_websocket_codec_reset_deflate(GWebSocketCodec * codec);
+guint		_g_websocket_codec_budget_serial(void);
+void		_g_websocket_codec_budget_wait(GSource * source,GMainContext * context,guint serial);
+void		_g_websocket_codec_budget_wake(void);
+
+GWebSocketDeflate *	_g_websocket_deflate_new(GWebSocketCodecRole role,const GWebSocketDeflateParams * params);
+void		_g_websocket_deflate_free(GWebSocketDeflate * deflate);
+guint8 *	_g_websocket_deflate_compress(GWebSocketDeflate * deflate,const guint8 * data,gsize count,gsize headroom,gsize * length);
+guint8 *	_g_websocket_deflate_inflate(GWebSocketDeflate * deflate,const guint8 * data,gsize count,gboolean fin,gsize limit,gsize * length,GError ** error);
+guint		_g_websocket_deflate_get_bits(GWebSocketDeflate * deflate);
+void		_g_websocket_deflate_reset(GWebSocketDeflate * deflate);
+
+GWebSocketZstd *	_g_websocket_zstd_new(GWebSocketDictionary * dictionary);
+void		_g_websocket_zstd_free(GWebSocketZstd * zstd);
+GWebSocketDictionary *	_g_websocket_zstd_get_dictionary(GWebSocketZstd * zstd);
+guint8 *	_g_websocket_zstd_compress(GWebSocketDictionary * dictionary,const guint8 * data,gsize count,gsize headroom,gsize * length);
+guint8 *	_g_websocket_zstd_decompress(GWebSocketZstd * zstd,const guint8 * data,gsize count,gboolean fin,gsize limit,gsize * length,GError ** error);
+
+/* random bytes of one thread, refilled from the kernel a batch at a time */
+typedef struct
+{
+  guint8	bytes[G_WEBSOCKET_RANDOM_BATCH];
+  gsize		used;
+} GWebSocketRandom;
+
+static GPrivate random_batch = G_PRIVATE_INIT(g_free);
+
+/* for kernels without getrandom(), FALSE when the device can not be read */
+static gboolean
+_g_websocket_random_device(
+    guint8 * buffer,
+    gsize count)
+{
+  gint fd = -1;
+  do
+    fd = open("/dev/urandom",O_RDONLY | O_CLOEXEC);
+  while((fd < 0) && (errno == EINTR));
+  if(fd < 0)
+    return FALSE;
+
+  while(count > 0)
+    {
+      gssize done = read(fd,buffer,count);
+      if(done > 0)
+	{
+	  buffer += done;
+	  count -= done;
+	}
+      else if((done == 0) || (errno != EINTR))
+	{
+	  break;
+	}
+    }
+  close(fd);
+  return count == 0;
+}
+
+/*
+ * Masks and handshake keys must not be predictable, so there is no
+ * fallback to a weaker generator: without a random source it aborts.
+ */
+static void
+_g_websocket_random_fill(
+    GWebSocketRandom * random)
+{
+  gsize filled = 0;
+  while(filled < G_WEBSOCKET_RANDOM_BATCH)
+    {
+      gssize count = getrandom(random->bytes + filled,G_WEBSOCKET_RANDOM_BATCH - filled,0);
+      if(count > 0)
+	{
+	  filled += count;
+	}
+      else if(errno != EINTR)
+	{
+	  gint saved = errno;
+	  if(!_g_websocket_random_device(random->bytes + filled,G_WEBSOCKET_RANDOM_BATCH - filled))
+	    g_error("no random source: getrandom() failed with %s and /dev/urandom can not be read",g_strerror(saved));
+	  filled = G_WEBSOCKET_RANDOM_BATCH;
+	}
+    }
+  random->used = 0;
+}
+
+/*
+ * Fills buffer with cryptographically secure random bytes without taking
+ * any lock, every thread reads them from the kernel in batches.
+ */
+void
+_g_websocket_random(
+    guint8 * buffer,
+    gsize count)
+{
+  GWebSocketRandom * random = g_private_get(&random_batch);
+  if(!random)
+    {
+      random = g_new(GWebSocketRandom,1);
+      random->used = G_WEBSOCKET_RANDOM_BATCH;
+      g_private_set(&random_batch,random);
+    }
+  while(count > 0)
+    {
+      if(random->used == G_WEBSOCKET_RANDOM_BATCH)
+	_g_websocket_random_fill(random);
+      gsize size = MIN(count,G_WEBSOCKET_RANDOM_BATCH - random->used);
+      memcpy(buffer,random->bytes + random->used,size);
+      random->used += size;
+      buffer += size;
+      count -= size;
+    }
+}
+
+guint32
+g_websocket_generate_mask()
+{
+  guint32 mask = 0;
+  _g_websocket_random((guint8*)&mask,4);
+  return mask;
+}
+
+/*
+ * Checks the opcode of a new frame against the fragmented message in
+ * progress, control frames may arrive between the fragments.
+ */
+static gboolean
+_g_websocket_codec_check(
+    GWebSocketCodec * codec,
+    GWebSocketCodeOp code,
+    gboolean fin,
+    guint64 count,
+    GError ** error)
+{
+  switch(code)
+  {
+  case G_WEBSOCKET_CODEOP_CONTINUE:
+    if(codec->message_code == G_WEBSOCKET_CODEOP_CONTINUE)
+      {
+	g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"continuation frame without a message");
+	return FALSE;
+      }
+    break;
+  case G_WEBSOCKET_CODEOP_TEXT:
+  case G_WEBSOCKET_CODEOP_BINARY:
+    if(codec->message_code != G_WEBSOCKET_CODEOP_CONTINUE)
+      {
+	g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"new message before the end of a fragmented message");
+	return FALSE;
+      }
+    break;
+  case G_WEBSOCKET_CODEOP_CLOSE:
+  case G_WEBSOCKET_CODEOP_PING:
+  case G_WEBSOCKET_CODEOP_PONG:
+    if(!fin || (count > 125))
+      {
+	g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid control frame");
+	return FALSE;
+      }
+    break;
+  default:
+    g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"unknown opcode");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+_g_websocket_codec_account(
+    GWebSocketCodec * codec,
+    gssize delta)
+{
+  codec->memory += delta;
+  g_atomic_pointer_add(&memory_used,delta);
+  if((delta < 0) && g_atomic_pointer_get(&memory_budget))
+    _g_websocket_codec_budget_wake();
+}
+
+/*
+ * Chooses where the payload of frame is stored. Fragments of a message being
+ * reassembled go straight to the end of the message buffer. Nothing is
+ * allocated yet, the buffer grows as the payload arrives. A change of the
+ * reassemble setting takes effect with the next message.
+ */
+static gboolean
+_g_websocket_codec_payload(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    GError ** error)
+{
+  if((frame->code == G_WEBSOCKET_CODEOP_TEXT) || (frame->code == G_WEBSOCKET_CODEOP_BINARY))
+    codec->reassembling = codec->reassemble;
+  gboolean fragment = codec->reassembling
+		      && (frame->code < G_WEBSOCKET_CODEOP_CLOSE)
+		      && ((frame->code == G_WEBSOCKET_CODEOP_CONTINUE) || !frame->fin);
+  if(fragment)
+    {
+      if(frame->code != G_WEBSOCKET_CODEOP_CONTINUE)
+	{
+	  codec->message = _g_websocket_pool_alloc0(sizeof(GWebSocketFrame));
+	  codec->message->code = frame->code;
+	  codec->message->fin = TRUE;
+	  codec->message_size = 0;
+	}
+
+      GWebSocketFrame * message = codec->message;
+      if(!message)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"continuation frame without a message");
+	  codec->close_code = G_WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+	  return FALSE;
+	}
+      codec->streamed = 0;
+      if(frame->count > codec->max_message_size - message->count)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+	  codec->close_code = G_WEBSOCKET_CLOSE_TOO_LARGE;
+	  return FALSE;
+	}
+      codec->target = message;
+      codec->offset = message->count;
+    }
+  else
+    {
+      /* a message delivered fragment by fragment is held to the limit as a whole */
+      if(frame->code < G_WEBSOCKET_CODEOP_CLOSE)
+	{
+	  if(frame->code != G_WEBSOCKET_CODEOP_CONTINUE)
+	    codec->streamed = 0;
+	  if(frame->count > codec->max_message_size - codec->streamed)
+	    {
+	      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+	      codec->close_code = G_WEBSOCKET_CLOSE_TOO_LARGE;
+	      return FALSE;
+	    }
+	}
+      codec->target = frame;
+      codec->offset = 0;
+      codec->frame_size = 0;
+    }
+  return TRUE;
+}
+
+/*
+ * Makes room in the target buffer for count payload bytes of frame plus a
+ * NUL terminator, growing it at least twice its size but never past the
+ * end of the frame.
+ */
+static guint8 *
+_g_websocket_codec_reserve(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    gsize count)
+{
+  GWebSocketFrame * target = codec->target;
+  gsize * size = (target == frame) ? &(codec->frame_size) : &(codec->message_size);
+  gsize needed = codec->offset + count + 1;
+  if(needed > *size)
+    {
+      gsize grown = MIN(MAX(needed,*size * 2),codec->offset + frame->count + 1);
+      if(codec->spill_size && (grown > codec->spill_size)
+	 && (!target->buffer || (_g_websocket_pool_get_fd(target->buffer,NULL) < 0)))
+	{
+	  /* too large for the heap, move it to a memfd */
+	  guint8 * spilled = _g_websocket_pool_alloc_mapped(grown);
+	  if(target->buffer)
+	    memcpy(spilled,target->buffer,*size);
+	  _g_websocket_pool_free(target->buffer);
+	  target->buffer = spilled;
+	}
+      else
+	{
+	  target->buffer = _g_websocket_pool_realloc(target->buffer,grown);
+	}
+      _g_websocket_codec_account(codec,grown - *size);
+      *size = grown;
+    }
+  return target->buffer + codec->offset;
+}
+
+/*
+ * Stores count payload bytes of frame, src may be the place where they go.
+ * The bytes are unmasked and the text validated a block at a time so the
+ * payload is read from memory only once.
+ */
+static gboolean
+_g_websocket_codec_store(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    const guint8 * src,
+    gsize count,
+    GError ** error)
+{
+  guint8 * dst = codec->target->buffer + codec->offset + codec->received;
+  gboolean text = !codec->compressed
+		  && ((frame->code == G_WEBSOCKET_CODEOP_TEXT)
+		      || ((frame->code == G_WEBSOCKET_CODEOP_CONTINUE) && (codec->message_code == G_WEBSOCKET_CODEOP_TEXT)));
+  gboolean valid = TRUE;
+
+  if((frame->code == G_WEBSOCKET_CODEOP_TEXT) && (codec->received == 0))
+    codec->utf8_state = 0;
+
+  for(gsize index = 0;valid && (index < count);index += G_WEBSOCKET_CODEC_UNMASK_BLOCK)
+    {
+      gsize block = MIN(count - index,G_WEBSOCKET_CODEC_UNMASK_BLOCK);
+      if(frame->mask)
+	_g_websocket_mask(dst + index,src + index,block,frame->mask,codec->received + index);
+      else if(dst != src)
+	memcpy(dst + index,src + index,block);
+      if(text)
+	valid = _g_websocket_utf8_validate(&(codec->utf8_state),dst + index,block);
+    }
+
+  /* a character cut by the end of the message is invalid too */
+  if(valid && text && frame->fin && (codec->received + count == frame->count))
+    valid = codec->utf8_state == 0;
+
+  if(!valid)
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid UTF-8 text");
+      codec->close_code = G_WEBSOCKET_CLOSE_INVALID_DATA;
+    }
+  return valid;
+}
+
+/*
+ * Replaces the compressed payload of target with the inflated one. The text
+ * is validated here, it could not be while it was compressed.
+ */
+static gboolean
+_g_websocket_codec_inflate(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * target,
+    gboolean text,
+    GError ** error)
+{
+  GError * inflate_error = NULL;
+  gsize limit = codec->max_message_size - codec->streamed, length = 0;
+  if(codec->max_memory)
+    limit = MIN(limit,codec->max_memory - MIN(codec->memory,codec->max_memory));
+
+  guint8 * buffer = codec->zstd
+		     ? _g_websocket_zstd_decompress(codec->zstd,target->buffer,target->count,target->fin,limit,&length,&inflate_error)
+		     : _g_websocket_deflate_inflate(codec->deflate,target->buffer,target->count,target->fin,limit,&length,&inflate_error);
+  if(!buffer)
+    {
+      if(g_error_matches(inflate_error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE))
+	codec->close_code = G_WEBSOCKET_CLOSE_TOO_LARGE;
+      g_propagate_error(error,inflate_error);
+      return FALSE;
+    }
+  if(codec->spill_size && (length > codec->spill_size))
+    {
+      guint8 * spilled = _g_websocket_pool_alloc_mapped(length + 1);
+      memcpy(spilled,buffer,length + 1);
+      _g_websocket_pool_free(buffer);
+      buffer = spilled;
+    }
+
+  _g_websocket_codec_account(codec,(gssize)length - (gssize)target->count);
+  _g_websocket_pool_free(target->buffer);
+  target->buffer = buffer;
+  target->count = length;
+  target->compressed = FALSE;
+
+  if(text && !(_g_websocket_utf8_validate(&(codec->utf8_state),buffer,length) && (!target->fin || (codec->utf8_state == 0))))
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid UTF-8 text");
+      codec->close_code = G_WEBSOCKET_CLOSE_INVALID_DATA;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+_g_websocket_codec_queue(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame)
+{
+  codec->queued += frame->count;
+  g_queue_push_tail(&(codec->frames),frame);
+}
+
+/*
+ * Called once the whole payload of frame is stored in the target buffer.
+ * Completed frames hold exactly count + 1 bytes while they are queued.
+ * Compressed messages are inflated here, a frame that fails is dropped.
+ */
+static gboolean
+_g_websocket_codec_complete(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    GError ** error)
+{
+  GWebSocketFrame * target = codec->target;
+  gboolean text = (frame->code == G_WEBSOCKET_CODEOP_TEXT)
+		  || ((frame->code == G_WEBSOCKET_CODEOP_CONTINUE) && (codec->message_code == G_WEBSOCKET_CODEOP_TEXT));
+  gboolean done = TRUE;
+  codec->target = NULL;
+
+  if(frame->code >= G_WEBSOCKET_CODEOP_CLOSE)
+    {
+      frame->buffer[frame->count] = 0;
+      _g_websocket_codec_queue(codec,frame);
+      return TRUE;
+    }
+
+  if(frame->fin)
+    codec->message_code = G_WEBSOCKET_CODEOP_CONTINUE;
+  else if(frame->code != G_WEBSOCKET_CODEOP_CONTINUE)
+    codec->message_code = frame->code;
+
+  if(target != frame)
+    {
+      target->count += frame->count;
+      if(frame->fin)
+	{
+	  if(codec->message_size > target->count + 1)
+	    {
+	      target->buffer = _g_websocket_pool_realloc(target->buffer,target->count + 1);
+	      _g_websocket_codec_account(codec,-(gssize)(codec->message_size - target->count - 1));
+	    }
+	  target->buffer[target->count] = 0;
+	  codec->message = NULL;
+	  codec->message_size = 0;
+	  if(codec->compressed)
+	    done = _g_websocket_codec_inflate(codec,target,text,error);
+	  if(done)
+	    {
+	      target->buffer = _g_websocket_pool_seal(target->buffer);
+	      _g_websocket_codec_queue(codec,target);
+	    }
+	  else
+	    {
+	      g_websocket_frame_free(target);
+	    }
+	}
+      g_websocket_frame_free(frame);
+    }
+  else
+    {
+      frame->buffer[frame->count] = 0;
+      if(codec->compressed)
+	done = _g_websocket_codec_inflate(codec,frame,text,error);
+      if(done)
+	{
+	  codec->streamed += frame->count;
+	  frame->buffer = _g_websocket_pool_seal(frame->buffer);
+	  _g_websocket_codec_queue(codec,frame);
+	}
+      else
+	{
+	  g_websocket_frame_free(frame);
+	}
+    }
+  return done;
+}
+
+/*
+ * Decodes every complete frame held in the buffer. A frame whose payload is
+ * not complete yet is kept in codec->frame and the rest of the payload is
+ * received straight into its final place. masked is constant in both
+ * callers so the compiler emits a server and a client version of the loop.
+ */
+static inline gboolean
+_g_websocket_codec_decode(
+    GWebSocketCodec * codec,
+    const gboolean masked,
+    GError ** error)
+{
+  while(codec->frame == NULL)
+    {
+      const guint8 * header = codec->buffer + codec->start;
+      gsize available = codec->end - codec->start;
+      gsize header_size = 2;
+      guint64 count = 0;
+
+      if(available < 2)
+	break;
+
+      if(((header[1] & 0b10000000) != 0) != masked)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,masked ? "unmasked frame received" : "masked frame received");
+	  return FALSE;
+	}
+
+      count = header[1] & 0b01111111;
+      if(count == 126)
+	header_size += 2;
+      else if(count == 127)
+	header_size += 8;
+      if(masked)
+	header_size += 4;
+
+      if(available < header_size)
+	break;
+
+      if(count == 126)
+	{
+	  guint16 count16 = 0;
+	  memcpy(&count16,header + 2,2);
+	  count = GUINT16_FROM_BE(count16);
+	}
+      else if(count == 127)
+	{
+	  memcpy(&count,header + 2,8);
+	  count = GUINT64_FROM_BE(count);
+	}
+
+      if(count > codec->max_frame_size)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"frame too large");
+	  codec->close_code = G_WEBSOCKET_CLOSE_TOO_LARGE;
+	  return FALSE;
+	}
+
+      if(codec->max_memory && (count > codec->max_memory - MIN(codec->memory,codec->max_memory)))
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE,"receive memory limit exceeded");
+	  codec->close_code = G_WEBSOCKET_CLOSE_TOO_LARGE;
+	  return FALSE;
+	}
+
+      /* RSV1 marks the first frame of a compressed message, RFC 7692 */
+      guint8 reserved = header[0] & 0b01110000;
+      gboolean compressed = (codec->deflate || codec->zstd) && (reserved == 0b01000000)
+			    && (((header[0] & 0b00001111) == G_WEBSOCKET_CODEOP_TEXT)
+				|| ((header[0] & 0b00001111) == G_WEBSOCKET_CODEOP_BINARY));
+      if(reserved && !compressed)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"reserved bits set");
+	  return FALSE;
+	}
+
+      if(!_g_websocket_codec_check(codec,header[0] & 0b00001111,(header[0] & 0b10000000) != 0,count,error))
+	return FALSE;
+
+      GWebSocketFrame * frame = _g_websocket_pool_alloc0(sizeof(GWebSocketFrame));
+      frame->fin = (header[0] & 0b10000000) != 0;
+      frame->code = header[0] & 0b00001111;
+      frame->count = count;
+      frame->compressed = compressed;
+      if(masked)
+	memcpy(&(frame->mask),header + header_size - 4,4);
+      if(frame->code != G_WEBSOCKET_CODEOP_CONTINUE && frame->code < G_WEBSOCKET_CODEOP_CLOSE)
+	codec->compressed = compressed;
+
+      codec->start += header_size;
+      available -= header_size;
+
+      if(!_g_websocket_codec_payload(codec,frame,error))
+	{
+	  _g_websocket_pool_free(frame);
+	  return FALSE;
+	}
+
+      /* only the bytes already buffered are allocated, the rest on demand */
+      gsize stored = MIN(count,available);
+      codec->received = 0;
+      _g_websocket_codec_reserve(codec,frame,stored);
+      if(!_g_websocket_codec_store(codec,frame,codec->buffer + codec->start,stored,error))
+	{
+	  codec->frame = frame;
+	  return FALSE;
+	}
+      if(count <= available)
+	{
+	  codec->start += count;
+	  if(!_g_websocket_codec_complete(codec,frame,error))
+	    return FALSE;
+	}
+      else
+	{
+	  codec->received = available;
+	  codec->start = codec->end = 0;
+	  codec->frame = frame;
+	}
+    }
+  return TRUE;
+}
+
+static gboolean
+_g_websocket_codec_decode_masked(GWebSocketCodec * codec,GError ** error)
+{
+  return _g_websocket_codec_decode(codec,TRUE,error);
+}
+
+static gboolean
+_g_websocket_codec_decode_unmasked(GWebSocketCodec * codec,GError ** error)
+{
+  return _g_websocket_codec_decode(codec,FALSE,error);
+}
+
+GWebSocketCodec *
+g_websocket_codec_new(
+    GWebSocketCodecRole role
+    )
+{
+  GWebSocketCodec * codec = g_new0(GWebSocketCodec,1);
+  codec->ref_count = 1;
+  codec->role = role;
+  codec->max_frame_size = G_WEBSOCKET_CODEC_MAX_FRAME_SIZE;
+  codec->max_message_size = G_WEBSOCKET_CODEC_MAX_MESSAGE_SIZE;
+  codec->reassemble = TRUE;
+  codec->reassembling = TRUE;
+  codec->message_code = G_WEBSOCKET_CODEOP_CONTINUE;
+  codec->deflate_threshold = G_WEBSOCKET_CODEC_DEFLATE_THRESHOLD;
+  if(role == G_WEBSOCKET_CODEC_SERVER)
+    codec->decode = _g_websocket_codec_decode_masked;
+  else
+    codec->decode = _g_websocket_codec_decode_unmasked;
+  g_queue_init(&(codec->frames));
+  return codec;
+}
+
+GWebSocketCodec *
+g_websocket_codec_ref(
+    GWebSocketCodec * codec
+    )
+{
+  g_return_val_if_fail(codec != NULL,NULL);
+  g_atomic_int_inc(&(codec->ref_count));
+  return codec;
+}
+
+void
+g_websocket_codec_unref(
+    GWebSocketCodec * codec
+    )
+{
+  g_return_if_fail(codec != NULL);
+  if(g_atomic_int_dec_and_test(&(codec->ref_count)))
+    {
+      g_queue_clear_full(&(codec->frames),(GDestroyNotify)g_websocket_frame_free);
+      g_clear_pointer(&(codec->frame),g_websocket_frame_free);
+      g_clear_pointer(&(codec->message),g_websocket_frame_free);
+      g_clear_pointer(&(codec->deflate),_g_websocket_deflate_free);
+      g_clear_pointer(&(codec->zstd),_g_websocket_zstd_free);
+      g_atomic_pointer_add(&memory_used,-(gssize)codec->memory);
+      if(codec->memory && g_atomic_pointer_get(&memory_budget))
+	_g_websocket_codec_budget_wake();
+      g_free(codec);
+    }
+}
+
+/*
+ * Returns the status the connection should be closed with after the codec
+ * failed, 0 while it has not failed.
+ */
+guint16
+g_websocket_codec_get_close_code(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->close_code;
+}
+
+GWebSocketCodecRole
+g_websocket_codec_get_role(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->role;
+}
+
+void
+g_websocket_codec_set_max_frame_size(
+    GWebSocketCodec * codec,
+    gsize max_frame_size
+    )
+{
+  codec->max_frame_size = max_frame_size;
+}
+
+gsize
+g_websocket_codec_get_max_frame_size(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->max_frame_size;
+}
+
+void
+g_websocket_codec_set_max_message_size(
+    GWebSocketCodec * codec,
+    gsize max_message_size
+    )
+{
+  codec->max_message_size = max_message_size;
+}
+
+gsize
+g_websocket_codec_get_max_message_size(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->max_message_size;
+}
+
+/*
+ * Limits the memory held by the payloads being received and the frames not
+ * popped yet, a frame that does not fit is an error. 0 means no limit.
+ */
+void
+g_websocket_codec_set_max_memory(
+    GWebSocketCodec * codec,
+    gsize max_memory
+    )
+{
+  codec->max_memory = max_memory;
+}
+
+gsize
+g_websocket_codec_get_max_memory(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->max_memory;
+}
+
+/*
+ * Payloads larger than spill_size are stored in a memfd instead of the heap
+ * and delivered sealed and read only, see g_websocket_message_get_fd().
+ * 0, the default, keeps every payload on the heap.
+ */
+void
+g_websocket_codec_set_spill_size(
+    GWebSocketCodec * codec,
+    gsize spill_size
+    )
+{
+  codec->spill_size = spill_size;
+}
+
+gsize
+g_websocket_codec_get_spill_size(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->spill_size;
+}
+
+/*
+ * Sets the receive memory all the codecs of the process may use before
+ * g_websocket_codec_get_buffer() stops handing out buffers. The bytes
+ * already buffered are still decoded, so the budget is a soft limit. A
+ * GWebSocket refused a buffer reads again once some memory is released.
+ */
+void
+g_websocket_codec_set_memory_budget(
+    gsize budget
+    )
+{
+  g_atomic_pointer_set(&memory_budget,budget);
+  _g_websocket_codec_budget_wake();
+}
+
+static void
+_g_websocket_codec_budget_attach(
+    GWebSocketCodecWaiter * waiter)
+{
+  g_source_attach(waiter->source,waiter->context);
+  g_source_unref(waiter->source);
+  if(waiter->context)
+    g_main_context_unref(waiter->context);
+  g_free(waiter);
+}
+
+/* the release count a reader reads before it asks for a buffer */
+guint
+_g_websocket_codec_budget_serial()
+{
+  return (guint)g_atomic_int_get(&budget_serial);
+}
+
+/*
+ * Attaches source to context once memory is released. serial is what
+ * _g_websocket_codec_budget_serial() returned before the buffer was refused,
+ * a release since then attaches it at once.
+ */
+void
+_g_websocket_codec_budget_wait(
+    GSource * source,
+    GMainContext * context,
+    guint serial)
+{
+  GWebSocketCodecWaiter * waiter = g_new(GWebSocketCodecWaiter,1);
+  waiter->source = source;
+  waiter->context = context ? g_main_context_ref(context) : NULL;
+  g_mutex_lock(&budget_mutex);
+  budget_waiters = g_slist_prepend(budget_waiters,waiter);
+  g_atomic_int_inc(&budget_waiting);
+  if((guint)g_atomic_int_get(&budget_serial) != serial)
+    {
+      budget_waiters = g_slist_remove(budget_waiters,waiter);
+      g_atomic_int_add(&budget_waiting,-1);
+    }
+  else
+    {
+      waiter = NULL;
+    }
+  g_mutex_unlock(&budget_mutex);
+
+  if(waiter)
+    _g_websocket_codec_budget_attach(waiter);
+}
+
+/*
+ * Counts a release and wakes the paused readers, they ask for a buffer
+ * again and pause anew when there is still no room.
+ */
+void
+_g_websocket_codec_budget_wake()
+{
+  g_atomic_int_inc(&budget_serial);
+  if(!g_atomic_int_get(&budget_waiting))
+    return;
+
+  g_mutex_lock(&budget_mutex);
+  GSList * waiters = budget_waiters;
+  budget_waiters = NULL;
+  g_atomic_int_set(&budget_waiting,0);
+  g_mutex_unlock(&budget_mutex);
+
+  g_slist_free_full(waiters,(GDestroyNotify)_g_websocket_codec_budget_attach);
+}
+
+gsize
+g_websocket_codec_get_memory_budget()
+{
+  return (gsize)g_atomic_pointer_get(&memory_budget);
+}
+
+gsize
+g_websocket_codec_get_memory_used()
+{
+  return (gsize)g_atomic_pointer_get(&memory_used);
+}
+
+/*
+ * When reassemble is TRUE, the default, the fragments of a message are
+ * joined and popped as a single TEXT or BINARY frame. Otherwise every
+ * fragment is popped as it arrives, the whole message is still held to
+ * the max_message_size limit. A message already in progress keeps the
+ * setting it started with.
+ */
+void
+g_websocket_codec_set_reassemble(
+    GWebSocketCodec * codec,
+    gboolean reassemble
+    )
+{
+  codec->reassemble = reassemble;
+}
+
+gboolean
+g_websocket_codec_get_reassemble(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->reassemble;
+}
+
+/*
+ * Enables permessage-deflate with the parameters agreed in the handshake,
+ * NULL disables it. Received messages are inflated before they are popped.
+ */
+void
+g_websocket_codec_set_deflate(
+    GWebSocketCodec * codec,
+    const GWebSocketDeflateParams * params
+    )
+{
+  g_clear_pointer(&(codec->deflate),_g_websocket_deflate_free);
+  if(params)
+    codec->deflate = _g_websocket_deflate_new(codec->role,params);
+}
+
+gboolean
+g_websocket_codec_get_deflate(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->deflate != NULL;
+}
+
+/* messages shorter than threshold are sent uncompressed */
+void
+g_websocket_codec_set_deflate_threshold(
+    GWebSocketCodec * codec,
+    gsize threshold
+    )
+{
+  codec->deflate_threshold = threshold;
+}
+
+gsize
+g_websocket_codec_get_deflate_threshold(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->deflate_threshold;
+}
+
+/*
+ * Enables x-gwebsocket-zstd with the dictionary agreed in the handshake,
+ * NULL disables it. It takes the place of permessage-deflate, both mark
+ * compressed messages with RSV1.
+ */
+void
+g_websocket_codec_set_dictionary(
+    GWebSocketCodec * codec,
+    GWebSocketDictionary * dictionary
+    )
+{
+  g_clear_pointer(&(codec->zstd),_g_websocket_zstd_free);
+  if(dictionary)
+    codec->zstd = _g_websocket_zstd_new(dictionary);
+}
+
+GWebSocketDictionary *
+g_websocket_codec_get_dictionary(
+    GWebSocketCodec * codec
+    )
+{
+  return codec->zstd ? _g_websocket_zstd_get_dictionary(codec->zstd) : NULL;
+}
+
+/*
+ * Compresses the payload of a message to send into a pool buffer with
+ * headroom free bytes in front. Returns NULL when the message goes out
+ * uncompressed. The deflate compressor keeps its window between messages,
+ * so the messages must be compressed in the order they are sent.
+ */
+guint8 *
+_g_websocket_codec_compress(
+    GWebSocketCodec * codec,
+    const guint8 * data,
+    gsize count,
+    gsize headroom,
+    gsize * length)
+{
+  if(count < codec->deflate_threshold)
+    return NULL;
+  if(codec->zstd)
+    return _g_websocket_zstd_compress(_g_websocket_zstd_get_dictionary(codec->zstd),data,count,headroom,length);
+  if(codec->deflate)
+    return _g_websocket_deflate_compress(codec->deflate,data,count,headroom,length);
+  return NULL;
+}
+
+/*
+ * Window bits a message of count bytes is compressed with, 0 when it would
+ * be sent uncompressed.
+ */
+guint
+_g_websocket_codec_get_deflate_bits(
+    GWebSocketCodec * codec,
+    gsize count)
+{
+  if(!codec->deflate || (count < codec->deflate_threshold))
+    return 0;
+  return _g_websocket_deflate_get_bits(codec->deflate);
+}
+
+void
+_g_websocket_codec_reset_deflate(
+    GWebSocketCodec * codec)
+{
+  if(codec->deflate)
+    _g_websocket_deflate_reset(codec->deflate);
+}
+
+static guint8 *
+_g_websocket_codec_get_buffer(
+    GWebSocketCodec * codec,
+    gsize * size,
+    gboolean budgeted)
+{
+  GWebSocketFrame * frame = codec->frame;
+  if(frame)
+    {
+      gsize * allocated = (codec->target == frame) ? &(codec->frame_size) : &(codec->message_size);
+      gsize remain = frame->count - codec->received;
+      gsize room = *allocated - codec->offset - codec->received - 1;
+      if(room == 0)
+	{
+	  room = MIN(remain,MAX(codec->received,G_WEBSOCKET_CODEC_BUFFER_SIZE));
+	  gsize budget = budgeted ? (gsize)g_atomic_pointer_get(&memory_budget) : 0;
+	  if(budget && ((gsize)g_atomic_pointer_get(&memory_used) + room > budget))
+	    {
+	      *size = 0;
+	      return NULL;
+	    }
+	  _g_websocket_codec_reserve(codec,frame,codec->received + room);
+	}
+      *size = MIN(remain,room);
+      return codec->target->buffer + codec->offset + codec->received;
+    }
+  if(codec->start > 0)
+    {
+      memmove(codec->buffer,codec->buffer + codec->start,codec->end - codec->start);
+      codec->end -= codec->start;
+      codec->start = 0;
+    }
+  *size = G_WEBSOCKET_CODEC_BUFFER_SIZE - codec->end;
+  return codec->buffer + codec->end;
+}
+
+/*
+ * Returns where the next input bytes must be stored and how many fit there,
+ * the caller then reports how many it stored with g_websocket_codec_commit().
+ * Returns NULL when the memory budget is exhausted, the caller should try
+ * again later.
+ */
+guint8 *
+g_websocket_codec_get_buffer(
+    GWebSocketCodec * codec,
+    gsize * size
+    )
+{
+  return _g_websocket_codec_get_buffer(codec,size,TRUE);
+}
+
+gboolean
+g_websocket_codec_commit(
+    GWebSocketCodec * codec,
+    gsize count,
+    GError ** error
+    )
+{
+  if(codec->failed)
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_FAILED,"codec is in a failed state");
+      return FALSE;
+    }
+
+  GWebSocketFrame * frame = codec->frame;
+  if(frame)
+    {
+      /* the bytes were read in place, they are unmasked where they are */
+      guint8 * stored = codec->target->buffer + codec->offset + codec->received;
+      codec->failed = !_g_websocket_codec_store(codec,frame,stored,count,error);
+      if(codec->failed)
+	return FALSE;
+      codec->received += count;
+      if(codec->received == frame->count)
+	{
+	  codec->frame = NULL;
+	  codec->failed = !_g_websocket_codec_complete(codec,frame,error);
+	  if(codec->failed)
+	    {
+	      if(!codec->close_code)
+		codec->close_code = G_WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+	      return FALSE;
+	    }
+	}
+    }
+  else
+    {
+      codec->end += count;
+    }
+
+  codec->failed = !codec->decode(codec,error);
+  if(codec->failed && !codec->close_code)
+    codec->close_code = G_WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+  return !codec->failed;
+}
+
+gboolean
+g_websocket_codec_feed(
+    GWebSocketCodec * codec,
+    const guint8 * data,
+    gsize length,
+    GError ** error
+    )
+{
+  gboolean done = TRUE;
+  while(done && (length > 0))
+    {
+      gsize size = 0;
+      guint8 * buffer = _g_websocket_codec_get_buffer(codec,&size,FALSE);
+      size = MIN(size,length);
+      memcpy(buffer,data,size);
+      done = g_websocket_codec_commit(codec,size,error);
+      data += size;
+      length -= size;
+    }
+  return done;
+}
+
+gboolean
+g_websocket_codec_has_frames(
+    GWebSocketCodec * codec
+    )
+{
+  return !g_queue_is_empty(&(codec->frames));
+}
+
+GWebSocketFrame *
+g_websocket_codec_pop_frame(
+    GWebSocketCodec * codec
+    )
+{
+  GWebSocketFrame * frame = g_queue_pop_head(&(codec->frames));
+  if(frame)
+    {
+      codec->queued -= frame->count;
+      _g_websocket_codec_account(codec,-(gssize)(frame->count + 1));
+    }
+  return frame;
+}
+
+/* number of frames not popped yet, bytes receives their payload size */
+guint
+g_websocket_codec_get_queued(
+    GWebSocketCodec * codec,
+    gsize * bytes
+    )
+{
+  if(bytes)
+    *bytes = codec->queued;
+  return g_queue_get_length(&(codec->frames));
+}
+
+gsize
+g_websocket_codec_get_header_size(
+    GWebSocketCodec * codec,
+    gsize count
+    )
+{
+  gsize size = 2;
+  if(count > 65535)
+    size += 8;
+  else if(count > 125)
+    size += 2;
+  if(codec->role == G_WEBSOCKET_CODEC_CLIENT)
+    size += 4;
+  return size;
+}
+
+gsize
+g_websocket_codec_get_frame_size(
+    GWebSocketCodec * codec,
+    gsize count
+    )
+{
+  return g_websocket_codec_get_header_size(codec,count) + count;
+}
+
+/*
+ * Writes the header of frame, at most G_WEBSOCKET_CODEC_MAX_HEADER_SIZE
+ * bytes, and returns its size. The client picks the mask of the frame.
+ */
+gsize
+g_websocket_codec_encode_header(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    guint8 * header
+    )
+{
+  gboolean mid_header = frame->count > 125 && frame->count <= 65535;
+  gboolean long_header = frame->count > 65535;
+  gboolean masked = codec->role == G_WEBSOCKET_CODEC_CLIENT;
+  gsize p = 2;
+
+  if(masked)
+    frame->mask = g_websocket_generate_mask();
+  else
+    frame->mask = 0;
+
+  /* NB. big-endian spec => bit 0 == MSB */
+  header[0] = (frame->fin ? 0b10000000:0b00000000)|(frame->compressed ? 0b01000000:0b00000000)|(((guint8)frame->code) & 0b00001111);
+  header[1] = (masked ? 0b10000000:0b00000000)|(((guint8)(mid_header ? 126 : long_header ? 127 : frame->count)) & 0b01111111);
+
+  if (mid_header)
+    {
+      guint16 count16 = GUINT16_TO_BE((guint16)frame->count);
+      memcpy(header + p,&count16,2);
+      p += 2;
+    }
+  else if (long_header)
+    {
+      guint64 count64 = GUINT64_TO_BE((guint64)frame->count);
+      memcpy(header + p,&count64,8);
+      p += 8;
+    }
+  if(masked)
+    {
+      memcpy(header + p,&(frame->mask),4);
+      p += 4;
+    }
+  return p;
+}
+
+/*
+ * Writes the whole frame, header and masked payload, into output. Returns
+ * the number of bytes written or 0 when output is smaller than
+ * g_websocket_codec_get_frame_size().
+ */
+gsize
+g_websocket_codec_encode(
+    GWebSocketCodec * codec,
+    GWebSocketFrame * frame,
+    guint8 * output,
+    gsize size
+    )
+{
+  if(size < g_websocket_codec_get_frame_size(codec,frame->count))
+    return 0;
+
+  gsize p = g_websocket_codec_encode_header(codec,frame,output);
+  if(frame->count > 0)
+    {
+      if(frame->mask)
+	_g_websocket_mask(output + p,frame->buffer,frame->count,frame->mask,0);
+      else
+	memcpy(output + p,frame->buffer,frame->count);
+    }
+  return p + frame->count;
+}
+
+void
+g_websocket_frame_free(
+    GWebSocketFrame * frame
+    )
+{
+  _g_websocket_pool_free(frame->buffer);
+  _g_websocket_pool_free(frame);
+}
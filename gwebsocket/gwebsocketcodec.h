@@ -0,0 +1,270 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GWEBSOCKETCODEC_H_
+#define GWEBSOCKETCODEC_H_
+
+#include <glib.h>
+
+#define G_WEBSOCKET_CODEC_MAX_HEADER_SIZE	14
+#define G_WEBSOCKET_CODEC_DEFLATE_THRESHOLD	128
+
+/* close status codes, RFC 6455 section 7.4.1 */
+#define G_WEBSOCKET_CLOSE_NORMAL		1000
+#define G_WEBSOCKET_CLOSE_PROTOCOL_ERROR	1002
+#define G_WEBSOCKET_CLOSE_INVALID_DATA		1007
+#define G_WEBSOCKET_CLOSE_TOO_LARGE		1009
+
+typedef enum	_GWebSocketCodeOp	GWebSocketCodeOp;
+typedef enum	_GWebSocketCodecRole	GWebSocketCodecRole;
+typedef struct	_GWebSocketFrame	GWebSocketFrame;
+typedef struct	_GWebSocketCodec	GWebSocketCodec;
+typedef struct	_GWebSocketDeflateParams	GWebSocketDeflateParams;
+typedef struct	_GWebSocketDictionary	GWebSocketDictionary;
+
+enum _GWebSocketCodeOp
+{
+  G_WEBSOCKET_CODEOP_CONTINUE = 0x0,
+  G_WEBSOCKET_CODEOP_TEXT = 0x1,
+  G_WEBSOCKET_CODEOP_BINARY = 0x2,
+  G_WEBSOCKET_CODEOP_CLOSE = 0x8,
+  G_WEBSOCKET_CODEOP_PING = 0x9,
+  G_WEBSOCKET_CODEOP_PONG = 0xA
+};
+
+/* the server decodes masked frames and encodes unmasked ones, the client the opposite */
+enum _GWebSocketCodecRole
+{
+  G_WEBSOCKET_CODEC_SERVER,
+  G_WEBSOCKET_CODEC_CLIENT
+};
+
+struct _GWebSocketFrame
+{
+  gboolean fin;
+  GWebSocketCodeOp code;
+  guint32 mask;
+  guint8 * buffer;
+  gsize count;
+  gboolean compressed;
+};
+
+/*
+ * permessage-deflate as agreed in the handshake, RFC 7692. The window bits
+ * are the windows each side compresses with, 0 stands for 15.
+ */
+struct _GWebSocketDeflateParams
+{
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  guint server_max_window_bits;
+  guint client_max_window_bits;
+};
+
+G_BEGIN_DECLS
+
+guint32			g_websocket_generate_mask();
+
+GWebSocketCodec *	g_websocket_codec_new(
+			    GWebSocketCodecRole role
+			    );
+
+GWebSocketCodec *	g_websocket_codec_ref(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_unref(
+			    GWebSocketCodec * codec
+			    );
+
+guint16			g_websocket_codec_get_close_code(
+			    GWebSocketCodec * codec
+			    );
+
+GWebSocketCodecRole	g_websocket_codec_get_role(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_max_frame_size(
+			    GWebSocketCodec * codec,
+			    gsize max_frame_size
+			    );
+
+gsize			g_websocket_codec_get_max_frame_size(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_max_message_size(
+			    GWebSocketCodec * codec,
+			    gsize max_message_size
+			    );
+
+gsize			g_websocket_codec_get_max_message_size(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_max_memory(
+			    GWebSocketCodec * codec,
+			    gsize max_memory
+			    );
+
+gsize			g_websocket_codec_get_max_memory(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_spill_size(
+			    GWebSocketCodec * codec,
+			    gsize spill_size
+			    );
+
+gsize			g_websocket_codec_get_spill_size(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_memory_budget(
+			    gsize budget
+			    );
+
+gsize			g_websocket_codec_get_memory_budget();
+
+gsize			g_websocket_codec_get_memory_used();
+
+void			g_websocket_codec_set_reassemble(
+			    GWebSocketCodec * codec,
+			    gboolean reassemble
+			    );
+
+gboolean		g_websocket_codec_get_reassemble(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_deflate(
+			    GWebSocketCodec * codec,
+			    const GWebSocketDeflateParams * params
+			    );
+
+gboolean		g_websocket_codec_get_deflate(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_deflate_threshold(
+			    GWebSocketCodec * codec,
+			    gsize threshold
+			    );
+
+gsize			g_websocket_codec_get_deflate_threshold(
+			    GWebSocketCodec * codec
+			    );
+
+void			g_websocket_codec_set_dictionary(
+			    GWebSocketCodec * codec,
+			    GWebSocketDictionary * dictionary
+			    );
+
+GWebSocketDictionary *	g_websocket_codec_get_dictionary(
+			    GWebSocketCodec * codec
+			    );
+
+GWebSocketDictionary *	g_websocket_dictionary_new(
+			    GBytes * bytes,
+			    gint level,
+			    GError ** error
+			    );
+
+GWebSocketDictionary *	g_websocket_dictionary_new_from_file(
+			    const gchar * filename,
+			    gint level,
+			    GError ** error
+			    );
+
+GWebSocketDictionary *	g_websocket_dictionary_ref(
+			    GWebSocketDictionary * dictionary
+			    );
+
+void			g_websocket_dictionary_unref(
+			    GWebSocketDictionary * dictionary
+			    );
+
+guint32			g_websocket_dictionary_get_id(
+			    GWebSocketDictionary * dictionary
+			    );
+
+/* decoding */
+
+guint8 *		g_websocket_codec_get_buffer(
+			    GWebSocketCodec * codec,
+			    gsize * size
+			    );
+
+gboolean		g_websocket_codec_commit(
+			    GWebSocketCodec * codec,
+			    gsize count,
+			    GError ** error
+			    );
+
+gboolean		g_websocket_codec_feed(
+			    GWebSocketCodec * codec,
+			    const guint8 * data,
+			    gsize length,
+			    GError ** error
+			    );
+
+gboolean		g_websocket_codec_has_frames(
+			    GWebSocketCodec * codec
+			    );
+
+GWebSocketFrame *	g_websocket_codec_pop_frame(
+			    GWebSocketCodec * codec
+			    );
+
+guint			g_websocket_codec_get_queued(
+			    GWebSocketCodec * codec,
+			    gsize * bytes
+			    );
+
+/* encoding */
+
+gsize			g_websocket_codec_get_header_size(
+			    GWebSocketCodec * codec,
+			    gsize count
+			    );
+
+gsize			g_websocket_codec_get_frame_size(
+			    GWebSocketCodec * codec,
+			    gsize count
+			    );
+
+gsize			g_websocket_codec_encode_header(
+			    GWebSocketCodec * codec,
+			    GWebSocketFrame * frame,
+			    guint8 * header
+			    );
+
+gsize			g_websocket_codec_encode(
+			    GWebSocketCodec * codec,
+			    GWebSocketFrame * frame,
+			    guint8 * output,
+			    gsize size
+			    );
+
+void			g_websocket_frame_free(
+			    GWebSocketFrame * frame
+			    );
+
+G_END_DECLS
+
+#endif /* GWEBSOCKETCODEC_H_ */
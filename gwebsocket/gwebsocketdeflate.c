@@ -0,0 +1,593 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <zlib.h>
+#include <gio/gio.h>
+#include "gwebsocketcodec.h"
+
+typedef struct _GWebSocketDeflate GWebSocketDeflate;
+typedef struct _GWebSocketDeflateOffer GWebSocketDeflateOffer;
+
+#define G_WEBSOCKET_DEFLATE_NAME "permessage-deflate"
+#define G_WEBSOCKET_DEFLATE_MIN_BITS 9 //-> zlib can not compress with 8
+#define G_WEBSOCKET_DEFLATE_MAX_BITS 15
+#define G_WEBSOCKET_DEFLATE_INFLATE_STATE 7168
+
+/*
+ * The compressor and the decompressor of one connection. Each one is
+ * created on first use and, when its side does not take over the context,
+ * released again after every message, so an idle connection holds no zlib
+ * memory.
+ */
+struct _GWebSocketDeflate
+{
+  gint		deflate_bits;
+  gint		inflate_bits;
+  gboolean	deflate_reset;
+  gboolean	inflate_reset;
+  gboolean	deflating;
+  gboolean	inflating;
+  z_stream	deflater;
+  z_stream	inflater;
+};
+
+/* parameters of one offer, a window of -1 is absent and 0 has no value */
+struct _GWebSocketDeflateOffer
+{
+  gboolean	server_no_context_takeover;
+  gboolean	client_no_context_takeover;
+  gint		server_max_window_bits;
+  gint		client_max_window_bits;
+};
+
+GWebSocketDeflate *	_g_websocket_deflate_new(
+			    GWebSocketCodecRole role,
+			    const GWebSocketDeflateParams * params);
+
+void		_g_websocket_deflate_free(
+		    GWebSocketDeflate * state);
+
+guint8 *	_g_websocket_deflate_compress(
+		    GWebSocketDeflate * state,
+		    const guint8 * data,
+		    gsize count,
+		    gsize headroom,
+		    gsize * length);
+
+guint8 *	_g_websocket_deflate_inflate(
+		    GWebSocketDeflate * state,
+		    const guint8 * data,
+		    gsize count,
+		    gboolean fin,
+		    gsize limit,
+		    gsize * length,
+		    GError ** error);
+
+guint		_g_websocket_deflate_window_bits(
+		    gsize memory);
+
+gboolean	_g_websocket_deflate_negotiate(
+		    const gchar * offers,
+		    guint window_bits,
+		    gboolean no_context_takeover,
+		    GWebSocketDeflateParams * params,
+		    gchar ** response);
+
+gchar *		_g_websocket_deflate_offer(
+		    guint window_bits,
+		    gboolean no_context_takeover);
+
+gboolean	_g_websocket_deflate_accept(
+		    const gchar * response,
+		    guint window_bits,
+		    gboolean no_context_takeover,
+		    GWebSocketDeflateParams * params);
+
+guint		_g_websocket_deflate_get_bits(
+		    GWebSocketDeflate * state);
+
+void		_g_websocket_deflate_reset(
+		    GWebSocketDeflate * state);
+
+guint8 *	_g_websocket_deflate_compress_once(
+		    guint bits,
+		    const guint8 * data,
+		    gsize count,
+		    gsize headroom,
+		    gsize * length);
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+
+/* the streams allocate from the pool, a reset stream reuses cached blocks */
+static voidpf
+_g_websocket_deflate_zalloc(
+    voidpf opaque G_GNUC_UNUSED,
+    uInt items,
+    uInt size)
+{
+  return _g_websocket_pool_alloc((gsize)items * size);
+}
+
+static void
+_g_websocket_deflate_zfree(
+    voidpf opaque G_GNUC_UNUSED,
+    voidpf address)
+{
+  _g_websocket_pool_free(address);
+}
+
+static gint
+_g_websocket_deflate_mem_level(
+    gint bits)
+{
+  return MIN(bits - 7,8);
+}
+
+static gsize
+_g_websocket_deflate_memory(
+    gint bits)
+{
+  return ((gsize)1 << (bits + 2))
+	 + ((gsize)1 << (_g_websocket_deflate_mem_level(bits) + 9))
+	 + ((gsize)1 << bits)
+	 + G_WEBSOCKET_DEFLATE_INFLATE_STATE;
+}
+
+/*
+ * Largest window whose compressor and decompressor fit in memory bytes,
+ * 0 when not even the smallest one does. A memory of 0 has no limit.
+ */
+guint
+_g_websocket_deflate_window_bits(
+    gsize memory)
+{
+  if(memory == 0)
+    return G_WEBSOCKET_DEFLATE_MAX_BITS;
+  for(gint bits = G_WEBSOCKET_DEFLATE_MAX_BITS;bits >= G_WEBSOCKET_DEFLATE_MIN_BITS;bits--)
+    {
+      if(_g_websocket_deflate_memory(bits) <= memory)
+	return bits;
+    }
+  return 0;
+}
+
+GWebSocketDeflate *
+_g_websocket_deflate_new(
+    GWebSocketCodecRole role,
+    const GWebSocketDeflateParams * params)
+{
+  GWebSocketDeflate * state = g_new0(GWebSocketDeflate,1);
+  gint server_bits = params->server_max_window_bits ? params->server_max_window_bits : G_WEBSOCKET_DEFLATE_MAX_BITS;
+  gint client_bits = params->client_max_window_bits ? params->client_max_window_bits : G_WEBSOCKET_DEFLATE_MAX_BITS;
+  if(role == G_WEBSOCKET_CODEC_SERVER)
+    {
+      state->deflate_bits = server_bits;
+      state->inflate_bits = client_bits;
+      state->deflate_reset = params->server_no_context_takeover;
+      state->inflate_reset = params->client_no_context_takeover;
+    }
+  else
+    {
+      state->deflate_bits = client_bits;
+      state->inflate_bits = server_bits;
+      state->deflate_reset = params->client_no_context_takeover;
+      state->inflate_reset = params->server_no_context_takeover;
+    }
+  state->deflate_bits = CLAMP(state->deflate_bits,G_WEBSOCKET_DEFLATE_MIN_BITS,G_WEBSOCKET_DEFLATE_MAX_BITS);
+  state->inflate_bits = CLAMP(state->inflate_bits,G_WEBSOCKET_DEFLATE_MIN_BITS,G_WEBSOCKET_DEFLATE_MAX_BITS);
+  return state;
+}
+
+void
+_g_websocket_deflate_free(
+    GWebSocketDeflate * state)
+{
+  if(state->deflating)
+    deflateEnd(&(state->deflater));
+  if(state->inflating)
+    inflateEnd(&(state->inflater));
+  g_free(state);
+}
+
+/*
+ * Compresses a whole message into a pool buffer with headroom free bytes in
+ * front, RFC 7692 section 7.2.1. Returns NULL when the output would not be
+ * smaller than the input, the message is then sent as it is.
+ */
+guint8 *
+_g_websocket_deflate_compress(
+    GWebSocketDeflate * state,
+    const guint8 * data,
+    gsize count,
+    gsize headroom,
+    gsize * length)
+{
+  z_stream * z = &(state->deflater);
+  if(count > G_MAXUINT32 / 2)
+    return NULL;
+
+  if(!state->deflating)
+    {
+      memset(z,0,sizeof(z_stream));
+      z->zalloc = _g_websocket_deflate_zalloc;
+      z->zfree = _g_websocket_deflate_zfree;
+      if(deflateInit2(z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-state->deflate_bits,
+		      _g_websocket_deflate_mem_level(state->deflate_bits),Z_DEFAULT_STRATEGY) != Z_OK)
+	return NULL;
+      state->deflating = TRUE;
+    }
+
+  /* a sync flush adds at most an empty stored block to the bound */
+  gsize size = deflateBound(z,count) + 8;
+  guint8 * buffer = _g_websocket_pool_alloc(headroom + size);
+  z->next_in = (Bytef*)data;
+  z->avail_in = count;
+  z->next_out = buffer + headroom;
+  z->avail_out = size;
+  gint status = deflate(z,Z_SYNC_FLUSH);
+  gsize produced = size - z->avail_out;
+
+  if((status != Z_OK) || (z->avail_in != 0) || (produced < 4) || (produced - 4 >= count))
+    {
+      /* the peer will not see this message, forget it here too */
+      _g_websocket_pool_free(buffer);
+      if(state->deflate_reset)
+	{
+	  deflateEnd(z);
+	  state->deflating = FALSE;
+	}
+      else
+	{
+	  deflateReset(z);
+	}
+      return NULL;
+    }
+
+  /* the 0x00 0x00 0xff 0xff tail of the flush is implied */
+  /* without context takeover the window is not needed any more */
+  if(state->deflate_reset)
+    {
+      deflateEnd(z);
+      state->deflating = FALSE;
+    }
+  *length = produced - 4;
+  return buffer;
+}
+
+/* window bits of the compressor */
+guint
+_g_websocket_deflate_get_bits(
+    GWebSocketDeflate * state)
+{
+  return state->deflate_bits;
+}
+
+/*
+ * Makes the compressor forget the messages compressed so far, needed after
+ * the peer received a message the compressor did not see.
+ */
+void
+_g_websocket_deflate_reset(
+    GWebSocketDeflate * state)
+{
+  if(state->deflating)
+    deflateReset(&(state->deflater));
+}
+
+/*
+ * Compresses a message that refers to no earlier one, so any peer whose
+ * window is at least bits can inflate it whatever it received before.
+ */
+guint8 *
+_g_websocket_deflate_compress_once(
+    guint bits,
+    const guint8 * data,
+    gsize count,
+    gsize headroom,
+    gsize * length)
+{
+  GWebSocketDeflate state = { 0 };
+  state.deflate_bits = CLAMP(bits,G_WEBSOCKET_DEFLATE_MIN_BITS,G_WEBSOCKET_DEFLATE_MAX_BITS);
+  state.deflate_reset = TRUE;
+  return _g_websocket_deflate_compress(&state,data,count,headroom,length);
+}
+
+/*
+ * Decompresses a message, or a fragment of one when fin is FALSE, into a
+ * pool buffer with room for a NUL terminator. More than limit bytes of
+ * output is an error, so a small frame can not inflate into a huge one.
+ */
+guint8 *
+_g_websocket_deflate_inflate(
+    GWebSocketDeflate * state,
+    const guint8 * data,
+    gsize count,
+    gboolean fin,
+    gsize limit,
+    gsize * length,
+    GError ** error)
+{
+  static const guint8 tail[4] = { 0x00, 0x00, 0xff, 0xff };
+  z_stream * z = &(state->inflater);
+  gboolean tail_fed = !fin;
+  gboolean done = TRUE;
+
+  if(!state->inflating)
+    {
+      memset(z,0,sizeof(z_stream));
+      z->zalloc = _g_websocket_deflate_zalloc;
+      z->zfree = _g_websocket_deflate_zfree;
+      if(inflateInit2(z,-state->inflate_bits) != Z_OK)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE,"can not create the decompressor");
+	  return NULL;
+	}
+      state->inflating = TRUE;
+    }
+
+  gsize size = MIN(MAX(count * 4,256),limit + 1);
+  gsize produced = 0;
+  guint8 * buffer = _g_websocket_pool_alloc(size + 1);
+  z->next_in = (Bytef*)data;
+  z->avail_in = count;
+
+  while(done)
+    {
+      if((z->avail_in == 0) && !tail_fed)
+	{
+	  z->next_in = (Bytef*)tail;
+	  z->avail_in = 4;
+	  tail_fed = TRUE;
+	}
+      if(produced == size)
+	{
+	  if(size > limit)
+	    {
+	      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+	      done = FALSE;
+	      break;
+	    }
+	  size = MIN(size * 2,limit + 1);
+	  buffer = _g_websocket_pool_realloc(buffer,size + 1);
+	}
+      z->next_out = buffer + produced;
+      z->avail_out = size - produced;
+      gint status = inflate(z,Z_SYNC_FLUSH);
+      produced = size - z->avail_out;
+
+      if(status == Z_STREAM_END)
+	{
+	  /* a final block ends the stream, the next message starts a new one */
+	  inflateReset(z);
+	  if(z->avail_in == 0 || tail_fed)
+	    break;
+	}
+      else if((status == Z_OK) || (status == Z_BUF_ERROR))
+	{
+	  if((z->avail_in == 0) && tail_fed && (z->avail_out > 0))
+	    break;
+	}
+      else
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid compressed data");
+	  done = FALSE;
+	}
+    }
+
+  if(done && (produced > limit))
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+      done = FALSE;
+    }
+
+  if(!done)
+    {
+      _g_websocket_pool_free(buffer);
+      return NULL;
+    }
+
+  if(fin && state->inflate_reset)
+    {
+      inflateEnd(z);
+      state->inflating = FALSE;
+    }
+  buffer[produced] = 0;
+  *length = produced;
+  return buffer;
+}
+
+/* a window value, 8 to 15 with optional quotes */
+static gboolean
+_g_websocket_deflate_parse_bits(
+    const gchar * value,
+    gint * bits)
+{
+  gchar * text = g_strdup(value);
+  gsize length = strlen(g_strstrip(text));
+  guint64 number = 0;
+  gboolean valid = FALSE;
+  if((length >= 2) && (text[0] == '"') && (text[length - 1] == '"'))
+    {
+      text[length - 1] = 0;
+      memmove(text,text + 1,length - 1);
+    }
+  valid = g_ascii_string_to_unsigned(text,10,8,15,&number,NULL);
+  if(valid)
+    *bits = number;
+  g_free(text);
+  return valid;
+}
+
+/* parses one extension of a Sec-WebSocket-Extensions list */
+static gboolean
+_g_websocket_deflate_parse(
+    const gchar * extension,
+    GWebSocketDeflateOffer * offer)
+{
+  gchar ** params = g_strsplit(extension,";",-1);
+  gboolean valid = g_ascii_strcasecmp(g_strstrip(params[0]),G_WEBSOCKET_DEFLATE_NAME) == 0;
+
+  offer->server_no_context_takeover = FALSE;
+  offer->client_no_context_takeover = FALSE;
+  offer->server_max_window_bits = -1;
+  offer->client_max_window_bits = -1;
+
+  for(guint index = 1;valid && params[index];index++)
+    {
+      gchar * name = g_strstrip(params[index]);
+      gchar * value = strchr(name,'=');
+      if(value)
+	{
+	  *value = 0;
+	  value++;
+	  g_strchomp(name);
+	}
+
+      /* every parameter at most once, RFC 7692 section 5.1 */
+      if(g_ascii_strcasecmp(name,"server_no_context_takeover") == 0)
+	{
+	  valid = !value && !offer->server_no_context_takeover;
+	  offer->server_no_context_takeover = TRUE;
+	}
+      else if(g_ascii_strcasecmp(name,"client_no_context_takeover") == 0)
+	{
+	  valid = !value && !offer->client_no_context_takeover;
+	  offer->client_no_context_takeover = TRUE;
+	}
+      else if(g_ascii_strcasecmp(name,"server_max_window_bits") == 0)
+	{
+	  valid = value && (offer->server_max_window_bits < 0)
+		  && _g_websocket_deflate_parse_bits(value,&(offer->server_max_window_bits));
+	}
+      else if(g_ascii_strcasecmp(name,"client_max_window_bits") == 0)
+	{
+	  valid = offer->client_max_window_bits < 0;
+	  offer->client_max_window_bits = 0;
+	  if(valid && value)
+	    valid = _g_websocket_deflate_parse_bits(value,&(offer->client_max_window_bits));
+	}
+      else
+	{
+	  valid = FALSE;
+	}
+    }
+  g_strfreev(params);
+  return valid;
+}
+
+/*
+ * Server side, picks the first offer of the client it can accept within
+ * window_bits and fills params and the Sec-WebSocket-Extensions response.
+ * no_context_takeover makes the server forget its window between messages.
+ */
+gboolean
+_g_websocket_deflate_negotiate(
+    const gchar * offers,
+    guint window_bits,
+    gboolean no_context_takeover,
+    GWebSocketDeflateParams * params,
+    gchar ** response)
+{
+  gchar ** extensions = NULL;
+  gboolean accepted = FALSE;
+  if(!offers || (window_bits < G_WEBSOCKET_DEFLATE_MIN_BITS))
+    return FALSE;
+
+  extensions = g_strsplit(offers,",",-1);
+  for(guint index = 0;!accepted && extensions[index];index++)
+    {
+      GWebSocketDeflateOffer offer;
+      if(!_g_websocket_deflate_parse(extensions[index],&offer))
+	continue;
+
+      /* zlib has no 8 bit window to compress with */
+      if(offer.server_max_window_bits == 8)
+	continue;
+
+      /* without client_max_window_bits the client may use a 15 bit window */
+      if((offer.client_max_window_bits < 0) && (window_bits < G_WEBSOCKET_DEFLATE_MAX_BITS))
+	continue;
+
+      GString * text = g_string_new(G_WEBSOCKET_DEFLATE_NAME);
+      params->server_no_context_takeover = offer.server_no_context_takeover || no_context_takeover;
+      params->client_no_context_takeover = offer.client_no_context_takeover;
+      params->server_max_window_bits = (offer.server_max_window_bits > 0) ? MIN((guint)offer.server_max_window_bits,window_bits) : window_bits;
+      params->client_max_window_bits = (offer.client_max_window_bits > 0) ? MIN((guint)offer.client_max_window_bits,window_bits) : window_bits;
+
+      if(params->server_no_context_takeover)
+	g_string_append(text,"; server_no_context_takeover");
+      if(params->client_no_context_takeover)
+	g_string_append(text,"; client_no_context_takeover");
+      if((offer.server_max_window_bits > 0) || (params->server_max_window_bits < G_WEBSOCKET_DEFLATE_MAX_BITS))
+	g_string_append_printf(text,"; server_max_window_bits=%u",params->server_max_window_bits);
+      if(offer.client_max_window_bits >= 0)
+	g_string_append_printf(text,"; client_max_window_bits=%u",params->client_max_window_bits);
+      *response = g_string_free(text,FALSE);
+      accepted = TRUE;
+    }
+  g_strfreev(extensions);
+  return accepted;
+}
+
+/* client side, the Sec-WebSocket-Extensions offer */
+gchar *
+_g_websocket_deflate_offer(
+    guint window_bits,
+    gboolean no_context_takeover)
+{
+  GString * text = g_string_new(G_WEBSOCKET_DEFLATE_NAME);
+  g_string_append(text,"; client_max_window_bits");
+  if(window_bits < G_WEBSOCKET_DEFLATE_MAX_BITS)
+    g_string_append_printf(text,"; server_max_window_bits=%u",window_bits);
+  if(no_context_takeover)
+    g_string_append(text,"; client_no_context_takeover");
+  return g_string_free(text,FALSE);
+}
+
+/*
+ * Client side, checks the response of the server to the offer made with
+ * the same window_bits and no_context_takeover. A response the client can
+ * not honour fails the handshake.
+ */
+gboolean
+_g_websocket_deflate_accept(
+    const gchar * response,
+    guint window_bits,
+    gboolean no_context_takeover,
+    GWebSocketDeflateParams * params)
+{
+  GWebSocketDeflateOffer offer;
+  if(strchr(response,',') || !_g_websocket_deflate_parse(response,&offer))
+    return FALSE;
+
+  if(window_bits < G_WEBSOCKET_DEFLATE_MAX_BITS)
+    {
+      if((offer.server_max_window_bits < 0) || ((guint)offer.server_max_window_bits > window_bits))
+	return FALSE;
+    }
+  if((offer.client_max_window_bits == 0) || (offer.client_max_window_bits == 8))
+    return FALSE;
+
+  params->server_no_context_takeover = offer.server_no_context_takeover;
+  params->client_no_context_takeover = offer.client_no_context_takeover || no_context_takeover;
+  params->server_max_window_bits = (offer.server_max_window_bits > 0) ? (guint)offer.server_max_window_bits : G_WEBSOCKET_DEFLATE_MAX_BITS;
+  params->client_max_window_bits = (offer.client_max_window_bits > 0) ? MIN((guint)offer.client_max_window_bits,window_bits) : window_bits;
+  return TRUE;
+}
@@ -0,0 +1,187 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "gwebsocket.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define G_WEBSOCKET_MASK_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*GWebSocketMaskFunc)(guint8 * dst,const guint8 * src,gsize count,guint32 pattern);
+
+void		_g_websocket_mask(
+		    guint8 * dst,
+		    const guint8 * src,
+		    gsize count,
+		    guint32 mask,
+		    gsize offset);
+
+/*
+ * All the kernels receive the mask already rotated to the position of the
+ * first byte, every block they process is a multiple of four bytes so the
+ * pattern never needs to be rotated again inside the loop.
+ */
+
+static void
+_g_websocket_mask_tail(
+    guint8 * dst,
+    const guint8 * src,
+    gsize count,
+    guint32 pattern)
+{
+  const guint8 * key = (const guint8*)&pattern;
+  for(gsize index = 0;index < count;index++)
+    dst[index] = src[index] ^ key[index % 4];
+}
+
+static void
+_g_websocket_mask_word(
+    guint8 * dst,
+    const guint8 * src,
+    gsize count,
+    guint32 pattern)
+{
+  guint64 pattern64 = 0, block = 0;
+  gsize index = 0;
+
+  memcpy(((guint8*)&pattern64),&pattern,4);
+  memcpy(((guint8*)&pattern64) + 4,&pattern,4);
+
+  for(;index + 8 <= count;index += 8)
+    {
+      memcpy(&block,src + index,8);
+      block ^= pattern64;
+      memcpy(dst + index,&block,8);
+    }
+  _g_websocket_mask_tail(dst + index,src + index,count - index,pattern);
+}
+
+#ifdef G_WEBSOCKET_MASK_X86
+
+__attribute__((target("sse2")))
+static void
+_g_websocket_mask_sse2(
+    guint8 * dst,
+    const guint8 * src,
+    gsize count,
+    guint32 pattern)
+{
+  const __m128i pattern128 = _mm_set1_epi32((gint32)pattern);
+  gsize index = 0;
+
+  for(;index + 64 <= count;index += 64)
+    {
+      __m128i b0 = _mm_loadu_si128((const __m128i*)(src + index));
+      __m128i b1 = _mm_loadu_si128((const __m128i*)(src + index + 16));
+      __m128i b2 = _mm_loadu_si128((const __m128i*)(src + index + 32));
+      __m128i b3 = _mm_loadu_si128((const __m128i*)(src + index + 48));
+      _mm_storeu_si128((__m128i*)(dst + index),_mm_xor_si128(b0,pattern128));
+      _mm_storeu_si128((__m128i*)(dst + index + 16),_mm_xor_si128(b1,pattern128));
+      _mm_storeu_si128((__m128i*)(dst + index + 32),_mm_xor_si128(b2,pattern128));
+      _mm_storeu_si128((__m128i*)(dst + index + 48),_mm_xor_si128(b3,pattern128));
+    }
+  for(;index + 16 <= count;index += 16)
+    {
+      __m128i block = _mm_loadu_si128((const __m128i*)(src + index));
+      _mm_storeu_si128((__m128i*)(dst + index),_mm_xor_si128(block,pattern128));
+    }
+  _g_websocket_mask_word(dst + index,src + index,count - index,pattern);
+}
+
+__attribute__((target("avx2")))
+static void
+_g_websocket_mask_avx2(
+    guint8 * dst,
+    const guint8 * src,
+    gsize count,
+    guint32 pattern)
+{
+  const __m256i pattern256 = _mm256_set1_epi32((gint32)pattern);
+  gsize index = 0;
+
+  for(;index + 128 <= count;index += 128)
+    {
+      __m256i b0 = _mm256_loadu_si256((const __m256i*)(src + index));
+      __m256i b1 = _mm256_loadu_si256((const __m256i*)(src + index + 32));
+      __m256i b2 = _mm256_loadu_si256((const __m256i*)(src + index + 64));
+      __m256i b3 = _mm256_loadu_si256((const __m256i*)(src + index + 96));
+      _mm256_storeu_si256((__m256i*)(dst + index),_mm256_xor_si256(b0,pattern256));
+      _mm256_storeu_si256((__m256i*)(dst + index + 32),_mm256_xor_si256(b1,pattern256));
+      _mm256_storeu_si256((__m256i*)(dst + index + 64),_mm256_xor_si256(b2,pattern256));
+      _mm256_storeu_si256((__m256i*)(dst + index + 96),_mm256_xor_si256(b3,pattern256));
+    }
+  for(;index + 32 <= count;index += 32)
+    {
+      __m256i block = _mm256_loadu_si256((const __m256i*)(src + index));
+      _mm256_storeu_si256((__m256i*)(dst + index),_mm256_xor_si256(block,pattern256));
+    }
+  _mm256_zeroupper();
+  _g_websocket_mask_sse2(dst + index,src + index,count - index,pattern);
+}
+
+#endif
+
+static GWebSocketMaskFunc
+_g_websocket_mask_select(void)
+{
+  static gsize mask_func = 0;
+  if(g_once_init_enter(&mask_func))
+    {
+      GWebSocketMaskFunc func = _g_websocket_mask_word;
+#ifdef G_WEBSOCKET_MASK_X86
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx2"))
+	func = _g_websocket_mask_avx2;
+      else if(__builtin_cpu_supports("sse2"))
+	func = _g_websocket_mask_sse2;
+#endif
+      g_once_init_leave(&mask_func,(gsize)func);
+    }
+  return (GWebSocketMaskFunc)mask_func;
+}
+
+/*
+ * Applies the frame mask to count bytes of src and stores them in dst, which
+ * may be the same buffer. offset is the position of src[0] inside the frame
+ * payload so a payload can be masked in several pieces.
+ */
+void
+_g_websocket_mask(
+    guint8 * dst,
+    const guint8 * src,
+    gsize count,
+    guint32 mask,
+    gsize offset)
+{
+  const guint8 * key = (const guint8*)&mask;
+  guint8 rotated[4];
+  guint32 pattern;
+
+  if(count == 0)
+    return;
+
+  for(guint index = 0;index < 4;index++)
+    rotated[index] = key[(offset + index) % 4];
+  memcpy(&pattern,rotated,4);
+
+  if(count < 16)
+    _g_websocket_mask_tail(dst,src,count,pattern);
+  else
+    _g_websocket_mask_select()(dst,src,count,pattern);
+}
@@ -15,31 +15,95 @@
 	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include "gwebsocket.h"
 
+guint8 *	_g_websocket_message_builder_steal(
+		    GWebSocketMessageBuilder * builder,
+		    gsize * length);
+
+GWebSocketMessage *	_g_websocket_message_new_take(
+			    GWebSocketMessageType type,
+			    guint8 * buffer,
+			    gsize length);
+
+gint		_g_websocket_pool_get_fd(gconstpointer mem,gsize * offset);
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_alloc0(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+
+#define G_WEBSOCKET_MESSAGE_INLINE_SIZE 128
+
+struct _GWebSocketMessageBuilder
+{
+  GWebSocketMessageType type;
+  guint8 * buffer;
+  gsize length;
+  gsize allocated;
+};
+
+/* bytes of messages shared between threads are created under this lock */
+G_LOCK_DEFINE_STATIC(message_bytes);
+
 struct _GWebSocketMessage
 {
+  gint ref_count;
   GWebSocketMessageType type;
   union{
     guint8 * data;
     gchar * text;
   } content;
   gsize length;
+  GBytes * bytes;
+  gboolean pooled;
+  gboolean borrowed;
+  guint8 inline_data[];
 };
 
+/*
+ * Payloads shorter than G_WEBSOCKET_MESSAGE_INLINE_SIZE are stored right
+ * after the message in the same block, larger ones in a block of their own.
+ * There is always room for a NUL terminator.
+ */
+static GWebSocketMessage *
+_g_websocket_message_alloc(
+    GWebSocketMessageType type,
+    gsize length)
+{
+  GWebSocketMessage * message = NULL;
+  if(length < G_WEBSOCKET_MESSAGE_INLINE_SIZE)
+    {
+      message = _g_websocket_pool_alloc(sizeof(GWebSocketMessage) + length + 1);
+      message->content.data = message->inline_data;
+      message->pooled = FALSE;
+    }
+  else
+    {
+      message = _g_websocket_pool_alloc(sizeof(GWebSocketMessage));
+      message->content.data = _g_websocket_pool_alloc(length + 1);
+      message->pooled = TRUE;
+    }
+  message->content.data[length] = 0;
+  message->ref_count = 1;
+  message->type = type;
+  message->length = length;
+  message->bytes = NULL;
+  message->borrowed = FALSE;
+  return message;
+}
+
 GWebSocketMessage *
 g_websocket_message_new_text(
 			    const gchar * text,
 			    gssize length
 			    )
 {
-  GWebSocketMessage * message = g_new0(GWebSocketMessage,1);
   if(length < 0)
-    length = g_utf8_strlen(text,1024);
+    length = strlen(text);
 
-  message->content.text = g_strndup(text,length);
-  message->type = G_WEBSOCKET_MESSAGE_TEXT;
-  message->length = length;
+  GWebSocketMessage * message = _g_websocket_message_alloc(G_WEBSOCKET_MESSAGE_TEXT,length);
+  memcpy(message->content.text,text,length);
   return message;
 }
 
@@ -49,13 +113,86 @@ g_websocket_message_new_data(
 			    gsize length
 			    )
 {
-  GWebSocketMessage * message = g_new0(GWebSocketMessage,1);
-  message->content.data = g_memdup(data,length);
-  message->type = G_WEBSOCKET_MESSAGE_BINARY;
+  GWebSocketMessage * message = _g_websocket_message_alloc(G_WEBSOCKET_MESSAGE_BINARY,length);
+  memcpy(message->content.data,data,length);
+  return message;
+}
+
+/*
+ * Wraps bytes without copying them, the message keeps a reference. The
+ * payload of a text message made this way is not NUL terminated.
+ */
+GWebSocketMessage *
+g_websocket_message_new_from_bytes(
+			    GWebSocketMessageType type,
+			    GBytes * bytes
+			    )
+{
+  GWebSocketMessage * message = _g_websocket_pool_alloc(sizeof(GWebSocketMessage));
+  gsize length = 0;
+  message->ref_count = 1;
+  message->type = type;
+  message->content.data = (guint8*)g_bytes_get_data(bytes,&length);
+  message->length = length;
+  message->bytes = g_bytes_ref(bytes);
+  message->pooled = FALSE;
+  message->borrowed = FALSE;
+  return message;
+}
+
+/*
+ * Wraps data that outlives the message, such as a string literal or a
+ * buffer the caller frees after the last unref, without copying it. No
+ * GBytes is made unless g_websocket_message_get_bytes() asks for one.
+ */
+GWebSocketMessage *
+g_websocket_message_new_static(
+			    GWebSocketMessageType type,
+			    gconstpointer data,
+			    gsize length
+			    )
+{
+  GWebSocketMessage * message = _g_websocket_pool_alloc(sizeof(GWebSocketMessage));
+  message->ref_count = 1;
+  message->type = type;
+  message->content.data = (guint8*)data;
   message->length = length;
+  message->bytes = NULL;
+  message->pooled = FALSE;
+  message->borrowed = TRUE;
   return message;
 }
 
+/*
+ * Messages are immutable once created, a single message can be sent to
+ * many sockets and shared between threads.
+ */
+GWebSocketMessage *
+g_websocket_message_ref(
+			    GWebSocketMessage * message
+			    )
+{
+  g_return_val_if_fail(message != NULL,NULL);
+  g_atomic_int_inc(&(message->ref_count));
+  return message;
+}
+
+void
+g_websocket_message_unref(
+			    GWebSocketMessage * message
+			    )
+{
+  g_return_if_fail(message != NULL);
+  if(g_atomic_int_dec_and_test(&(message->ref_count)))
+    {
+      if(message->bytes)
+	g_bytes_unref(message->bytes);
+      else if(!message->borrowed && (message->content.data != message->inline_data))
+	_g_websocket_pool_free(message->content.data);
+      _g_websocket_pool_free(message);
+    }
+}
+
 GWebSocketMessageType
 g_websocket_message_get_type(
 			    GWebSocketMessage * message
@@ -82,6 +219,52 @@ g_websocket_message_get_data(
   return message->content.data;
 }
 
+/*
+ * Returns the payload as a GBytes that stays valid after the message is
+ * freed. Large payloads are shared, not copied, the buffer is released when
+ * both the message and the last reference are gone.
+ */
+GBytes *
+g_websocket_message_get_bytes(
+			    GWebSocketMessage * message
+			    )
+{
+  if(message->content.data == message->inline_data)
+    return g_bytes_new(message->inline_data,message->length);
+
+  G_LOCK(message_bytes);
+  if(!message->bytes && message->borrowed)
+    message->bytes = g_bytes_new_static(message->content.data,message->length);
+  else if(!message->bytes)
+    message->bytes = g_bytes_new_with_free_func(message->content.data,
+						message->length,
+						_g_websocket_pool_free,
+						message->content.data);
+  GBytes * bytes = g_bytes_ref(message->bytes);
+  G_UNLOCK(message_bytes);
+  return bytes;
+}
+
+/*
+ * Returns the memfd holding a payload spilled out of the heap, and where the
+ * payload starts inside it, or -1. The fd is sealed against writes, it
+ * belongs to the message and is valid while the message is.
+ */
+gint
+g_websocket_message_get_fd(
+			    GWebSocketMessage * message,
+			    goffset * offset
+			    )
+{
+  gsize start = 0;
+  gint fd = -1;
+  if(message->pooled)
+    fd = _g_websocket_pool_get_fd(message->content.data,&start);
+  if(offset)
+    *offset = start;
+  return fd;
+}
+
 gsize
 g_websocket_message_get_length(
 			    GWebSocketMessage * message
@@ -95,6 +278,137 @@ g_websocket_message_free(
 			    GWebSocketMessage * message
 			    )
 {
-  g_free(message->content.data);
-  g_free(message);
+  g_websocket_message_unref(message);
+}
+
+/*
+ * buffer must come from the pool and hold a NUL terminator after length
+ * bytes, the message owns it from now on. Small payloads are moved inline.
+ */
+GWebSocketMessage *
+_g_websocket_message_new_take(
+    GWebSocketMessageType type,
+    guint8 * buffer,
+    gsize length)
+{
+  GWebSocketMessage * message = NULL;
+  if(length < G_WEBSOCKET_MESSAGE_INLINE_SIZE)
+    {
+      message = _g_websocket_message_alloc(type,length);
+      memcpy(message->content.data,buffer,length);
+      _g_websocket_pool_free(buffer);
+    }
+  else
+    {
+      message = _g_websocket_pool_alloc(sizeof(GWebSocketMessage));
+      message->content.data = buffer;
+      message->ref_count = 1;
+      message->type = type;
+      message->length = length;
+      message->bytes = NULL;
+      message->pooled = TRUE;
+      message->borrowed = FALSE;
+    }
+  return message;
+}
+
+/*
+ * The builder keeps G_WEBSOCKET_CODEC_MAX_HEADER_SIZE free bytes in front of
+ * the payload, g_websocket_send_builder() encodes the frame header there and
+ * sends header and payload with a single write.
+ */
+GWebSocketMessageBuilder *
+g_websocket_message_builder_new(
+			    GWebSocketMessageType type,
+			    gsize size_hint
+			    )
+{
+  GWebSocketMessageBuilder * builder = _g_websocket_pool_alloc0(sizeof(GWebSocketMessageBuilder));
+  builder->type = type;
+  builder->allocated = MAX(size_hint,64);
+  builder->buffer = _g_websocket_pool_alloc(G_WEBSOCKET_CODEC_MAX_HEADER_SIZE + builder->allocated);
+  return builder;
+}
+
+GWebSocketMessageType
+g_websocket_message_builder_get_type(
+			    GWebSocketMessageBuilder * builder
+			    )
+{
+  return builder->type;
+}
+
+guint8 *
+g_websocket_message_builder_reserve(
+			    GWebSocketMessageBuilder * builder,
+			    gsize count
+			    )
+{
+  if(builder->length + count > builder->allocated)
+    {
+      while(builder->length + count > builder->allocated)
+	builder->allocated *= 2;
+      builder->buffer = _g_websocket_pool_realloc(builder->buffer,G_WEBSOCKET_CODEC_MAX_HEADER_SIZE + builder->allocated);
+    }
+  guint8 * data = builder->buffer + G_WEBSOCKET_CODEC_MAX_HEADER_SIZE + builder->length;
+  builder->length += count;
+  return data;
+}
+
+void
+g_websocket_message_builder_append(
+			    GWebSocketMessageBuilder * builder,
+			    gconstpointer data,
+			    gsize count
+			    )
+{
+  if(count > 0)
+    memcpy(g_websocket_message_builder_reserve(builder,count),data,count);
+}
+
+guint8 *
+g_websocket_message_builder_get_data(
+			    GWebSocketMessageBuilder * builder
+			    )
+{
+  return builder->buffer + G_WEBSOCKET_CODEC_MAX_HEADER_SIZE;
+}
+
+gsize
+g_websocket_message_builder_get_length(
+			    GWebSocketMessageBuilder * builder
+			    )
+{
+  return builder->length;
+}
+
+void
+g_websocket_message_builder_set_length(
+			    GWebSocketMessageBuilder * builder,
+			    gsize length
+			    )
+{
+  g_return_if_fail(length <= builder->allocated);
+  builder->length = length;
+}
+
+void
+g_websocket_message_builder_free(
+			    GWebSocketMessageBuilder * builder
+			    )
+{
+  _g_websocket_pool_free(builder->buffer);
+  _g_websocket_pool_free(builder);
+}
+
+/* returns the buffer, headroom included, and frees the builder */
+guint8 *
+_g_websocket_message_builder_steal(
+    GWebSocketMessageBuilder * builder,
+    gsize * length)
+{
+  guint8 * buffer = builder->buffer;
+  *length = builder->length;
+  _g_websocket_pool_free(builder);
+  return buffer;
 }
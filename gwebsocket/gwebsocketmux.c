@@ -0,0 +1,809 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "gwebsocketmux.h"
+
+/*
+ * Every mux frame is one binary message: kind, flags, the channel as a big
+ * endian 32 bit number and then the payload. DATA carries a fragment of a
+ * message of the channel, CREDIT the number of bytes the receiver is ready
+ * to take on top of what it granted before. Both ends start every channel
+ * with G_WEBSOCKET_MUX_INITIAL_WINDOW of credit. Clients open odd channels,
+ * servers even ones.
+ */
+#define G_WEBSOCKET_MUX_HEADER_SIZE	6
+
+#define G_WEBSOCKET_MUX_OPEN		1
+#define G_WEBSOCKET_MUX_DATA		2
+#define G_WEBSOCKET_MUX_CREDIT		3
+#define G_WEBSOCKET_MUX_CLOSE		4
+
+#define G_WEBSOCKET_MUX_FLAG_FIN	1
+#define G_WEBSOCKET_MUX_FLAG_TEXT	2
+
+typedef struct _GWebSocketMuxChannel	GWebSocketMuxChannel;
+typedef struct _GWebSocketMuxControl	GWebSocketMuxControl;
+typedef struct _GWebSocketMuxIdleData	GWebSocketMuxIdleData;
+
+struct _GWebSocketMuxChannel
+{
+  guint32		id;
+  /* send side */
+  GQueue		pending;
+  gsize			offset;
+  gsize			pending_size;
+  gsize			credit;
+  gboolean		queued;
+  gboolean		closing;
+  /* receive side */
+  gsize			granted;
+  gsize			consumed;
+  GWebSocketMessageType	type;
+  guint8 *		buffer;
+  gsize			length;
+  gsize			allocated;
+};
+
+struct _GWebSocketMuxControl
+{
+  guint8		data[G_WEBSOCKET_MUX_HEADER_SIZE + 4];
+  gsize			size;
+};
+
+struct _GWebSocketMuxIdleData
+{
+  GWebSocketMux *	mux;
+  GList *		channels;
+};
+
+struct _GWebSocketMux
+{
+  GObject		parent_instance;
+  GWebSocket *		socket;
+  gulong		message_id;
+  gulong		closed_id;
+  GMutex		mutex;
+  GHashTable *		channels;
+  guint32		next_channel;
+  gsize			window;
+  gsize			fragment_size;
+  gboolean		streaming;
+  GQueue		control;
+  GQueue		ready;
+  gboolean		writing;
+};
+
+enum
+{
+  SIGNAL_CHANNEL_OPENED,
+  SIGNAL_CHANNEL_CLOSED,
+  SIGNAL_MESSAGE,
+  SIGNAL_MESSAGE_CHUNK,
+  N_SIGNALS
+};
+
+static gint		g_websocket_mux_signals[N_SIGNALS];
+
+G_DEFINE_TYPE(GWebSocketMux,g_websocket_mux,G_TYPE_OBJECT)
+
+gboolean	_g_websocket_get_use_mask(GWebSocket * socket);
+
+gboolean	_g_websocket_mux_attached(GWebSocket * socket);
+
+void		_g_websocket_idle_add(GWebSocket * socket,GSourceFunc func,gpointer data);
+
+GWebSocketMessage *	_g_websocket_message_new_take(GWebSocketMessageType type,guint8 * buffer,gsize length);
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+
+static void	_g_websocket_mux_dispose(GObject * object);
+static void	_g_websocket_mux_finalize(GObject * object);
+
+static void	_g_websocket_mux_message(GWebSocket * socket,GWebSocketMessage * message,GWebSocketMux * mux);
+static void	_g_websocket_mux_closed(GWebSocket * socket,GWebSocketMux * mux);
+
+static GQuark
+_g_websocket_mux_quark(void)
+{
+  return g_quark_from_static_string("g-websocket-mux");
+}
+
+static void
+_g_websocket_mux_channel_free(GWebSocketMuxChannel * channel)
+{
+  g_queue_clear_full(&(channel->pending),(GDestroyNotify)g_websocket_message_unref);
+  if(channel->buffer)
+    _g_websocket_pool_free(channel->buffer);
+  g_free(channel);
+}
+
+static GWebSocketMuxChannel *
+_g_websocket_mux_channel_new(
+    GWebSocketMux * mux,
+    guint32 id)
+{
+  GWebSocketMuxChannel * channel = g_new0(GWebSocketMuxChannel,1);
+  channel->id = id;
+  g_queue_init(&(channel->pending));
+  channel->credit = G_WEBSOCKET_MUX_INITIAL_WINDOW;
+  channel->granted = G_WEBSOCKET_MUX_INITIAL_WINDOW;
+  g_hash_table_insert(mux->channels,GUINT_TO_POINTER(id),channel);
+  return channel;
+}
+
+static void
+g_websocket_mux_init(GWebSocketMux * self)
+{
+  g_mutex_init(&(self->mutex));
+  self->channels = g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,(GDestroyNotify)_g_websocket_mux_channel_free);
+  self->window = G_WEBSOCKET_MUX_INITIAL_WINDOW;
+  self->fragment_size = G_WEBSOCKET_MUX_FRAGMENT_SIZE;
+  self->streaming = FALSE;
+  g_queue_init(&(self->control));
+  g_queue_init(&(self->ready));
+  self->writing = FALSE;
+}
+
+static void
+g_websocket_mux_class_init(GWebSocketMuxClass * klass)
+{
+  G_OBJECT_CLASS(klass)->dispose = _g_websocket_mux_dispose;
+  G_OBJECT_CLASS(klass)->finalize = _g_websocket_mux_finalize;
+
+  const GType channel_params[1] = {G_TYPE_UINT};
+  const GType message_params[2] = {G_TYPE_UINT,G_TYPE_POINTER};
+  const GType chunk_params[3] = {G_TYPE_UINT,G_TYPE_POINTER,G_TYPE_BOOLEAN};
+
+  g_websocket_mux_signals[SIGNAL_CHANNEL_OPENED] =
+      g_signal_newv ("channel-opened",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       1     /* n_params */,
+       (GType*)channel_params  /* param_types */);
+
+  g_websocket_mux_signals[SIGNAL_CHANNEL_CLOSED] =
+      g_signal_newv ("channel-closed",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       1     /* n_params */,
+       (GType*)channel_params  /* param_types */);
+
+  g_websocket_mux_signals[SIGNAL_MESSAGE] =
+      g_signal_newv ("message",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       2     /* n_params */,
+       (GType*)message_params  /* param_types */);
+
+  g_websocket_mux_signals[SIGNAL_MESSAGE_CHUNK] =
+      g_signal_newv ("message-chunk",
+       G_TYPE_FROM_CLASS (klass),
+       G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+       NULL /* closure */,
+       NULL /* accumulator */,
+       NULL /* accumulator data */,
+       NULL /* C marshaller */,
+       G_TYPE_NONE /* return_type */,
+       3     /* n_params */,
+       (GType*)chunk_params  /* param_types */);
+}
+
+static void
+_g_websocket_mux_dispose(GObject * object)
+{
+  GWebSocketMux * self = G_WEBSOCKET_MUX(object);
+  if(self->socket)
+    {
+      g_signal_handler_disconnect(self->socket,self->message_id);
+      g_signal_handler_disconnect(self->socket,self->closed_id);
+      g_object_set_qdata(G_OBJECT(self->socket),_g_websocket_mux_quark(),NULL);
+      g_clear_object(&(self->socket));
+    }
+  g_mutex_lock(&(self->mutex));
+  g_queue_clear(&(self->ready));
+  g_queue_clear_full(&(self->control),g_free);
+  g_hash_table_remove_all(self->channels);
+  g_mutex_unlock(&(self->mutex));
+  G_OBJECT_CLASS(g_websocket_mux_parent_class)->dispose(object);
+}
+
+static void
+_g_websocket_mux_finalize(GObject * object)
+{
+  GWebSocketMux * self = G_WEBSOCKET_MUX(object);
+  g_hash_table_unref(self->channels);
+  g_mutex_clear(&(self->mutex));
+  G_OBJECT_CLASS(g_websocket_mux_parent_class)->finalize(object);
+}
+
+static void
+_g_websocket_mux_header(
+    guint8 * header,
+    guint8 kind,
+    guint8 flags,
+    guint32 channel)
+{
+  header[0] = kind;
+  header[1] = flags;
+  header[2] = (channel >> 24) & 0xFF;
+  header[3] = (channel >> 16) & 0xFF;
+  header[4] = (channel >> 8) & 0xFF;
+  header[5] = channel & 0xFF;
+}
+
+/* must be called with the mutex held */
+static void
+_g_websocket_mux_control(
+    GWebSocketMux * mux,
+    guint8 kind,
+    guint32 channel,
+    gsize credit)
+{
+  GWebSocketMuxControl * control = g_new(GWebSocketMuxControl,1);
+  _g_websocket_mux_header(control->data,kind,0,channel);
+  control->size = G_WEBSOCKET_MUX_HEADER_SIZE;
+  if(kind == G_WEBSOCKET_MUX_CREDIT)
+    {
+      guint32 amount = (guint32)MIN(credit,G_MAXUINT32);
+      control->data[6] = (amount >> 24) & 0xFF;
+      control->data[7] = (amount >> 16) & 0xFF;
+      control->data[8] = (amount >> 8) & 0xFF;
+      control->data[9] = amount & 0xFF;
+      control->size += 4;
+    }
+  g_queue_push_tail(&(mux->control),control);
+}
+
+/* the channel has a fragment, or its close, that can go out now */
+static gboolean
+_g_websocket_mux_channel_ready(GWebSocketMuxChannel * channel)
+{
+  GWebSocketMessage * head = g_queue_peek_head(&(channel->pending));
+  if(!head)
+    return channel->closing;
+  return (channel->credit > 0) || (g_websocket_message_get_length(head) == channel->offset);
+}
+
+/* must be called with the mutex held */
+static void
+_g_websocket_mux_schedule(
+    GWebSocketMux * mux,
+    GWebSocketMuxChannel * channel)
+{
+  if(!channel->queued && _g_websocket_mux_channel_ready(channel))
+    {
+      g_queue_push_tail(&(mux->ready),channel);
+      channel->queued = TRUE;
+    }
+}
+
+/*
+ * Pops the next frame to write: control frames first, then one fragment of
+ * the channel at the head of the ring, which goes back to the tail while it
+ * still has data and credit. Clears the writing flag when there is nothing
+ * left.
+ */
+static gboolean
+_g_websocket_mux_next(
+    GWebSocketMux * mux,
+    guint8 * header,
+    GOutputVector * vectors,
+    GWebSocketMessage ** message)
+{
+  gboolean found = FALSE;
+  *message = NULL;
+  g_mutex_lock(&(mux->mutex));
+  GWebSocketMuxControl * control = g_queue_pop_head(&(mux->control));
+  if(control)
+    {
+      memcpy(header,control->data,control->size);
+      vectors[0].buffer = header;
+      vectors[0].size = control->size;
+      g_free(control);
+      found = TRUE;
+    }
+  while(!found && !g_queue_is_empty(&(mux->ready)))
+    {
+      GWebSocketMuxChannel * channel = g_queue_pop_head(&(mux->ready));
+      GWebSocketMessage * head = g_queue_peek_head(&(channel->pending));
+      channel->queued = FALSE;
+      if(!_g_websocket_mux_channel_ready(channel))
+	continue;
+
+      if(!head)
+	{
+	  /* everything queued before the close is out */
+	  _g_websocket_mux_header(header,G_WEBSOCKET_MUX_CLOSE,0,channel->id);
+	  vectors[0].buffer = header;
+	  vectors[0].size = G_WEBSOCKET_MUX_HEADER_SIZE;
+	  g_hash_table_remove(mux->channels,GUINT_TO_POINTER(channel->id));
+	}
+      else
+	{
+	  gsize length = g_websocket_message_get_length(head);
+	  gsize count = MIN(MIN(length - channel->offset,channel->credit),mux->fragment_size);
+	  guint8 flags = 0;
+	  if((channel->offset == 0) && (g_websocket_message_get_type(head) == G_WEBSOCKET_MESSAGE_TEXT))
+	    flags |= G_WEBSOCKET_MUX_FLAG_TEXT;
+	  if(channel->offset + count == length)
+	    flags |= G_WEBSOCKET_MUX_FLAG_FIN;
+	  _g_websocket_mux_header(header,G_WEBSOCKET_MUX_DATA,flags,channel->id);
+	  vectors[0].buffer = header;
+	  vectors[0].size = G_WEBSOCKET_MUX_HEADER_SIZE;
+	  vectors[1].buffer = g_websocket_message_get_data(head) + channel->offset;
+	  vectors[1].size = count;
+	  *message = g_websocket_message_ref(head);
+
+	  channel->offset += count;
+	  channel->credit -= count;
+	  channel->pending_size -= count;
+	  if(channel->offset == length)
+	    {
+	      g_websocket_message_unref(g_queue_pop_head(&(channel->pending)));
+	      channel->offset = 0;
+	    }
+	  _g_websocket_mux_schedule(mux,channel);
+	}
+      found = TRUE;
+    }
+  if(!found)
+    mux->writing = FALSE;
+  g_mutex_unlock(&(mux->mutex));
+  return found;
+}
+
+static void
+_g_websocket_mux_write_thread(
+    GTask * task,
+    gpointer source_object,
+    gpointer task_data G_GNUC_UNUSED,
+    GCancellable * cancellable G_GNUC_UNUSED)
+{
+  GWebSocketMux * mux = G_WEBSOCKET_MUX(source_object);
+  guint8 header[G_WEBSOCKET_MUX_HEADER_SIZE + 4];
+  GOutputVector vectors[2];
+  GWebSocketMessage * message = NULL;
+  gboolean done = TRUE;
+
+  while(done && _g_websocket_mux_next(mux,header,vectors,&message))
+    {
+      done = mux->socket && g_websocket_send_vectors(mux->socket,G_WEBSOCKET_MESSAGE_BINARY,vectors,message ? 2 : 1,NULL);
+      if(message)
+	g_websocket_message_unref(message);
+    }
+  if(!done)
+    {
+      /* the socket is closed, its closed handler drops the channels */
+      g_mutex_lock(&(mux->mutex));
+      mux->writing = FALSE;
+      g_mutex_unlock(&(mux->mutex));
+    }
+  g_task_return_boolean(task,done);
+}
+
+/* must be called with the mutex held, one writer thread at a time */
+static void
+_g_websocket_mux_kick(GWebSocketMux * mux)
+{
+  if(!mux->writing && (!g_queue_is_empty(&(mux->control)) || !g_queue_is_empty(&(mux->ready))))
+    {
+      GTask * task = g_task_new(mux,NULL,NULL,NULL);
+      mux->writing = TRUE;
+      g_task_set_source_tag(task,_g_websocket_mux_kick);
+      g_task_run_in_thread(task,_g_websocket_mux_write_thread);
+      g_object_unref(task);
+    }
+}
+
+static void
+_g_websocket_mux_fail(GWebSocketMux * mux)
+{
+  /* protocol violation of the peer, there is no way to resync */
+  g_websocket_close(mux->socket,NULL);
+}
+
+static void
+_g_websocket_mux_receive(
+    GWebSocketMux * mux,
+    guint32 id,
+    guint8 flags,
+    const guint8 * data,
+    gsize count)
+{
+  GWebSocketMessage * message = NULL;
+  GWebSocketMessageType type = G_WEBSOCKET_MESSAGE_BINARY;
+  gboolean fin = (flags & G_WEBSOCKET_MUX_FLAG_FIN) != 0;
+  gboolean failed = FALSE;
+  gsize limit = g_websocket_get_max_message_size(mux->socket);
+
+  g_mutex_lock(&(mux->mutex));
+  GWebSocketMuxChannel * channel = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(id));
+  if(!channel)
+    {
+      /* closed here while the peer was still sending */
+      g_mutex_unlock(&(mux->mutex));
+      return;
+    }
+  if(count > channel->granted)
+    {
+      failed = TRUE;
+    }
+  else
+    {
+      channel->granted -= count;
+      channel->consumed += count;
+      if(channel->length == 0)
+	channel->type = (flags & G_WEBSOCKET_MUX_FLAG_TEXT) ? G_WEBSOCKET_MESSAGE_TEXT : G_WEBSOCKET_MESSAGE_BINARY;
+      type = channel->type;
+      if((limit > 0) && (count > limit - channel->length))
+	{
+	  failed = TRUE;
+	}
+      else if(mux->streaming)
+	{
+	  /* counts the message in progress against the limit */
+	  channel->length = fin ? 0 : channel->length + count;
+	}
+      else
+	{
+	  if(channel->length + count + 1 > channel->allocated)
+	    {
+	      channel->allocated = MAX(channel->length + count + 1,channel->allocated * 2);
+	      channel->buffer = _g_websocket_pool_realloc(channel->buffer,channel->allocated);
+	    }
+	  memcpy(channel->buffer + channel->length,data,count);
+	  channel->length += count;
+	  if(fin)
+	    {
+	      channel->buffer[channel->length] = 0;
+	      message = _g_websocket_message_new_take(type,channel->buffer,channel->length);
+	      channel->buffer = NULL;
+	      channel->length = 0;
+	      channel->allocated = 0;
+	    }
+	}
+    }
+  g_mutex_unlock(&(mux->mutex));
+
+  if(failed)
+    {
+      _g_websocket_mux_fail(mux);
+      return;
+    }
+
+  if(mux->streaming)
+    {
+      message = g_websocket_message_new_static(type,data,count);
+      g_signal_emit(mux,g_websocket_mux_signals[SIGNAL_MESSAGE_CHUNK],0,id,message,fin);
+      g_websocket_message_unref(message);
+    }
+  else if(message)
+    {
+      g_signal_emit(mux,g_websocket_mux_signals[SIGNAL_MESSAGE],0,id,message);
+      g_websocket_message_unref(message);
+    }
+
+  /* hands the consumed bytes back once they are worth a frame */
+  g_mutex_lock(&(mux->mutex));
+  channel = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(id));
+  if(channel && (channel->consumed > 0) && (fin || (channel->consumed >= mux->window / 4)))
+    {
+      _g_websocket_mux_control(mux,G_WEBSOCKET_MUX_CREDIT,id,channel->consumed);
+      channel->granted += channel->consumed;
+      channel->consumed = 0;
+      _g_websocket_mux_kick(mux);
+    }
+  g_mutex_unlock(&(mux->mutex));
+}
+
+static void
+_g_websocket_mux_message(
+    GWebSocket * socket G_GNUC_UNUSED,
+    GWebSocketMessage * message,
+    GWebSocketMux * mux)
+{
+  const guint8 * data = g_websocket_message_get_data(message);
+  gsize length = g_websocket_message_get_length(message);
+  GWebSocketMuxChannel * channel = NULL;
+  gboolean failed = FALSE, opened = FALSE, closed = FALSE;
+  guint32 id = 0;
+
+  if(length < G_WEBSOCKET_MUX_HEADER_SIZE)
+    {
+      _g_websocket_mux_fail(mux);
+      return;
+    }
+  id = ((guint32)data[2] << 24) | ((guint32)data[3] << 16) | ((guint32)data[4] << 8) | data[5];
+
+  switch(data[0])
+  {
+  case G_WEBSOCKET_MUX_DATA:
+    _g_websocket_mux_receive(mux,id,data[1],data + G_WEBSOCKET_MUX_HEADER_SIZE,length - G_WEBSOCKET_MUX_HEADER_SIZE);
+    break;
+  case G_WEBSOCKET_MUX_OPEN:
+    g_mutex_lock(&(mux->mutex));
+    /* the peer opens channels of the other parity */
+    if((id == 0) || ((id & 1) == (mux->next_channel & 1)) || g_hash_table_contains(mux->channels,GUINT_TO_POINTER(id)))
+      {
+	failed = TRUE;
+      }
+    else
+      {
+	channel = _g_websocket_mux_channel_new(mux,id);
+	if(mux->window > G_WEBSOCKET_MUX_INITIAL_WINDOW)
+	  {
+	    _g_websocket_mux_control(mux,G_WEBSOCKET_MUX_CREDIT,id,mux->window - G_WEBSOCKET_MUX_INITIAL_WINDOW);
+	    channel->granted = mux->window;
+	    _g_websocket_mux_kick(mux);
+	  }
+	opened = TRUE;
+      }
+    g_mutex_unlock(&(mux->mutex));
+    break;
+  case G_WEBSOCKET_MUX_CREDIT:
+    if(length < G_WEBSOCKET_MUX_HEADER_SIZE + 4)
+      {
+	failed = TRUE;
+	break;
+      }
+    g_mutex_lock(&(mux->mutex));
+    channel = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(id));
+    if(channel)
+      {
+	channel->credit += ((guint32)data[6] << 24) | ((guint32)data[7] << 16) | ((guint32)data[8] << 8) | data[9];
+	_g_websocket_mux_schedule(mux,channel);
+	_g_websocket_mux_kick(mux);
+      }
+    g_mutex_unlock(&(mux->mutex));
+    break;
+  case G_WEBSOCKET_MUX_CLOSE:
+    g_mutex_lock(&(mux->mutex));
+    channel = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(id));
+    if(channel)
+      {
+	if(channel->queued)
+	  g_queue_remove(&(mux->ready),channel);
+	g_hash_table_remove(mux->channels,GUINT_TO_POINTER(id));
+	closed = TRUE;
+      }
+    g_mutex_unlock(&(mux->mutex));
+    break;
+  default:
+    failed = TRUE;
+    break;
+  }
+
+  if(failed)
+    _g_websocket_mux_fail(mux);
+  else if(opened)
+    g_signal_emit(mux,g_websocket_mux_signals[SIGNAL_CHANNEL_OPENED],0,id);
+  else if(closed)
+    g_signal_emit(mux,g_websocket_mux_signals[SIGNAL_CHANNEL_CLOSED],0,id);
+}
+
+static gboolean
+_g_websocket_mux_closed_idle(gpointer data)
+{
+  GWebSocketMuxIdleData * idle_data = (GWebSocketMuxIdleData *)data;
+  for(GList * iter = idle_data->channels;iter;iter = iter->next)
+    g_signal_emit(idle_data->mux,g_websocket_mux_signals[SIGNAL_CHANNEL_CLOSED],0,GPOINTER_TO_UINT(iter->data));
+  g_list_free(idle_data->channels);
+  g_object_unref(idle_data->mux);
+  g_free(idle_data);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+_g_websocket_mux_closed(
+    GWebSocket * socket,
+    GWebSocketMux * mux)
+{
+  GWebSocketMuxIdleData * data = g_new0(GWebSocketMuxIdleData,1);
+  data->mux = g_object_ref(mux);
+  g_mutex_lock(&(mux->mutex));
+  data->channels = g_hash_table_get_keys(mux->channels);
+  g_queue_clear(&(mux->ready));
+  g_queue_clear_full(&(mux->control),g_free);
+  g_hash_table_remove_all(mux->channels);
+  g_mutex_unlock(&(mux->mutex));
+  /* closed may come from a writer thread, like the service does */
+  _g_websocket_idle_add(socket,_g_websocket_mux_closed_idle,data);
+}
+
+gboolean
+_g_websocket_mux_attached(GWebSocket * socket)
+{
+  return g_object_get_qdata(G_OBJECT(socket),_g_websocket_mux_quark()) != NULL;
+}
+
+/*
+ * Runs logical channels over a connected socket, each one with its own
+ * credit so a large transfer can not hold back the others. The socket must
+ * not be streaming nor batching, its messages are all taken by the mux and no longer
+ * reach the "message" signal of a GWebSocketService.
+ */
+GWebSocketMux *
+g_websocket_mux_new(GWebSocket * socket)
+{
+  g_return_val_if_fail(G_IS_WEBSOCKET(socket),NULL);
+  g_return_val_if_fail(!g_websocket_get_streaming(socket),NULL);
+  g_return_val_if_fail(g_websocket_get_batch_size(socket) == 0,NULL);
+  g_return_val_if_fail(!_g_websocket_mux_attached(socket),NULL);
+
+  GWebSocketMux * mux = G_WEBSOCKET_MUX(g_object_new(G_TYPE_WEBSOCKET_MUX,NULL));
+  mux->socket = g_object_ref(socket);
+  mux->next_channel = _g_websocket_get_use_mask(socket) ? 1 : 2;
+  mux->message_id = g_signal_connect(G_OBJECT(socket),"message",G_CALLBACK(_g_websocket_mux_message),mux);
+  mux->closed_id = g_signal_connect(G_OBJECT(socket),"closed",G_CALLBACK(_g_websocket_mux_closed),mux);
+  g_object_set_qdata(G_OBJECT(socket),_g_websocket_mux_quark(),mux);
+  return mux;
+}
+
+GWebSocket *
+g_websocket_mux_get_socket(GWebSocketMux * mux)
+{
+  return mux->socket;
+}
+
+/*
+ * Receive window of the channels opened from now on, what the peer may
+ * have in flight on each one. Never below G_WEBSOCKET_MUX_INITIAL_WINDOW,
+ * which every channel starts with.
+ */
+void
+g_websocket_mux_set_window(
+    GWebSocketMux * mux,
+    gsize window)
+{
+  mux->window = MAX(window,G_WEBSOCKET_MUX_INITIAL_WINDOW);
+}
+
+gsize
+g_websocket_mux_get_window(GWebSocketMux * mux)
+{
+  return mux->window;
+}
+
+/* largest DATA payload, smaller fragments interleave the channels finer */
+void
+g_websocket_mux_set_fragment_size(
+    GWebSocketMux * mux,
+    gsize fragment_size)
+{
+  g_return_if_fail(fragment_size > 0);
+  mux->fragment_size = fragment_size;
+}
+
+gsize
+g_websocket_mux_get_fragment_size(GWebSocketMux * mux)
+{
+  return mux->fragment_size;
+}
+
+/* delivers each fragment on "message-chunk" instead of whole messages */
+void
+g_websocket_mux_set_streaming(
+    GWebSocketMux * mux,
+    gboolean streaming)
+{
+  mux->streaming = streaming;
+}
+
+gboolean
+g_websocket_mux_get_streaming(GWebSocketMux * mux)
+{
+  return mux->streaming;
+}
+
+guint32
+g_websocket_mux_open(GWebSocketMux * mux)
+{
+  guint32 id = 0;
+  g_mutex_lock(&(mux->mutex));
+  id = mux->next_channel;
+  mux->next_channel += 2;
+  GWebSocketMuxChannel * channel = _g_websocket_mux_channel_new(mux,id);
+  _g_websocket_mux_control(mux,G_WEBSOCKET_MUX_OPEN,id,0);
+  if(mux->window > G_WEBSOCKET_MUX_INITIAL_WINDOW)
+    {
+      _g_websocket_mux_control(mux,G_WEBSOCKET_MUX_CREDIT,id,mux->window - G_WEBSOCKET_MUX_INITIAL_WINDOW);
+      channel->granted = mux->window;
+    }
+  _g_websocket_mux_kick(mux);
+  g_mutex_unlock(&(mux->mutex));
+  return id;
+}
+
+/*
+ * Queues the message on the channel and returns at once, it goes out in
+ * fragments as the peer grants credit. The mux keeps a reference.
+ */
+gboolean
+g_websocket_mux_send(
+    GWebSocketMux * mux,
+    guint32 channel,
+    GWebSocketMessage * message,
+    GError ** error)
+{
+  gboolean done = FALSE;
+  g_mutex_lock(&(mux->mutex));
+  GWebSocketMuxChannel * state = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(channel));
+  if(state && !state->closing)
+    {
+      g_queue_push_tail(&(state->pending),g_websocket_message_ref(message));
+      state->pending_size += g_websocket_message_get_length(message);
+      _g_websocket_mux_schedule(mux,state);
+      _g_websocket_mux_kick(mux);
+      done = TRUE;
+    }
+  else
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_CLOSED,"channel is closed");
+    }
+  g_mutex_unlock(&(mux->mutex));
+  return done;
+}
+
+/* bytes queued on the channel the peer has not been sent yet */
+gsize
+g_websocket_mux_get_pending(
+    GWebSocketMux * mux,
+    guint32 channel)
+{
+  gsize pending = 0;
+  g_mutex_lock(&(mux->mutex));
+  GWebSocketMuxChannel * state = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(channel));
+  if(state)
+    pending = state->pending_size;
+  g_mutex_unlock(&(mux->mutex));
+  return pending;
+}
+
+/* closes the channel once the messages already queued on it are sent */
+void
+g_websocket_mux_close(
+    GWebSocketMux * mux,
+    guint32 channel)
+{
+  g_mutex_lock(&(mux->mutex));
+  GWebSocketMuxChannel * state = g_hash_table_lookup(mux->channels,GUINT_TO_POINTER(channel));
+  if(state && !state->closing)
+    {
+      state->closing = TRUE;
+      _g_websocket_mux_schedule(mux,state);
+      _g_websocket_mux_kick(mux);
+    }
+  g_mutex_unlock(&(mux->mutex));
+}
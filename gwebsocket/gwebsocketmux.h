@@ -0,0 +1,87 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GWEBSOCKETMUX_H_
+#define GWEBSOCKETMUX_H_
+
+#include "gwebsocket.h"
+
+#define G_WEBSOCKET_MUX_INITIAL_WINDOW	65536
+#define G_WEBSOCKET_MUX_FRAGMENT_SIZE	16384
+
+#define G_TYPE_WEBSOCKET_MUX	(g_websocket_mux_get_type())
+G_DECLARE_FINAL_TYPE	(GWebSocketMux,g_websocket_mux,G,WEBSOCKET_MUX,GObject)
+
+GType		g_websocket_mux_get_type(void);
+
+GWebSocketMux *	g_websocket_mux_new(
+		    GWebSocket * socket
+		    );
+
+GWebSocket *	g_websocket_mux_get_socket(
+		    GWebSocketMux * mux
+		    );
+
+void		g_websocket_mux_set_window(
+		    GWebSocketMux * mux,
+		    gsize window
+		    );
+
+gsize		g_websocket_mux_get_window(
+		    GWebSocketMux * mux
+		    );
+
+void		g_websocket_mux_set_fragment_size(
+		    GWebSocketMux * mux,
+		    gsize fragment_size
+		    );
+
+gsize		g_websocket_mux_get_fragment_size(
+		    GWebSocketMux * mux
+		    );
+
+void		g_websocket_mux_set_streaming(
+		    GWebSocketMux * mux,
+		    gboolean streaming
+		    );
+
+gboolean	g_websocket_mux_get_streaming(
+		    GWebSocketMux * mux
+		    );
+
+guint32		g_websocket_mux_open(
+		    GWebSocketMux * mux
+		    );
+
+gboolean	g_websocket_mux_send(
+		    GWebSocketMux * mux,
+		    guint32 channel,
+		    GWebSocketMessage * message,
+		    GError ** error
+		    );
+
+gsize		g_websocket_mux_get_pending(
+		    GWebSocketMux * mux,
+		    guint32 channel
+		    );
+
+void		g_websocket_mux_close(
+		    GWebSocketMux * mux,
+		    guint32 channel
+		    );
+
+#endif /* GWEBSOCKETMUX_H_ */
@@ -0,0 +1,521 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "gwebsocketpool.h"
+
+typedef struct _GWebSocketPoolHeader GWebSocketPoolHeader;
+typedef struct _GWebSocketPoolCounters GWebSocketPoolCounters;
+typedef struct _GWebSocketPoolCache GWebSocketPoolCache;
+
+#define G_WEBSOCKET_POOL_MIN_SHIFT 6 //-> 64B
+#define G_WEBSOCKET_POOL_MAX_SHIFT 22 //-> 4MB
+#define G_WEBSOCKET_POOL_CLASSES (G_WEBSOCKET_POOL_MAX_SHIFT - G_WEBSOCKET_POOL_MIN_SHIFT + 1)
+#define G_WEBSOCKET_POOL_DIRECT G_WEBSOCKET_POOL_CLASSES
+#define G_WEBSOCKET_POOL_MAPPED (G_WEBSOCKET_POOL_CLASSES + 1)
+#define G_WEBSOCKET_POOL_HEADER_SIZE 16
+#define G_WEBSOCKET_POOL_HUGE_PAGE 2097152L
+#define G_WEBSOCKET_POOL_TRIM_INTERVAL 1000 //-> ms
+
+/*
+ * In front of every block, the size of the block including the header.
+ * huge_page tells a block mapped for transparent huge pages, fd is the
+ * memfd of a mapped block and -1 for any other.
+ */
+struct _GWebSocketPoolHeader
+{
+  guint16	size_class;
+  guint16	huge_page;
+  gint32	fd;
+  gsize		size;
+};
+
+/*
+ * Statistics of one thread, only that thread writes them so counting never
+ * contends. cached may go below zero where another thread freed a block.
+ */
+struct _GWebSocketPoolCounters
+{
+  gsize		allocs;
+  gsize		frees;
+  gsize		system_allocs;
+  gsize		system_frees;
+  gssize	cached;
+};
+
+/*
+ * Free blocks of one thread. low is the shortest each list has been since
+ * the last trim, those blocks were not needed and are given back.
+ * generation follows the g_websocket_pool_trim() calls of any thread.
+ */
+struct _GWebSocketPoolCache
+{
+  GWebSocketPoolHeader *	blocks[G_WEBSOCKET_POOL_CLASSES];
+  guint				count[G_WEBSOCKET_POOL_CLASSES];
+  guint				low[G_WEBSOCKET_POOL_CLASSES];
+  gsize				cached;
+  gint64			trimmed;
+  gint				generation;
+  GWebSocketPoolCounters	counters;
+};
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_alloc0(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+gpointer	_g_websocket_pool_alloc_mapped(gsize size);
+gpointer	_g_websocket_pool_seal(gpointer mem);
+gint		_g_websocket_pool_get_fd(gconstpointer mem,gsize * offset);
+
+static void	_g_websocket_pool_cache_free(gpointer data);
+
+static GPrivate pool_cache = G_PRIVATE_INIT(_g_websocket_pool_cache_free);
+static gsize pool_max_cached = 4194304L; //-> 4MB per thread
+static gboolean pool_huge_pages = FALSE;
+
+/* the caches of the running threads, and what exited threads counted */
+static GMutex pool_caches_mutex;
+static GList * pool_caches = NULL;
+static GWebSocketPoolCounters pool_retired = { 0 };
+
+/* bumped by g_websocket_pool_trim(), every thread trims once it sees it */
+static gint pool_trim_generation = 0;
+
+/* the owner updates its counters, g_websocket_pool_get_stats() reads them from any thread */
+#define G_WEBSOCKET_POOL_COUNT(counter,delta) __atomic_store_n(&(counter),(counter) + (delta),__ATOMIC_RELAXED)
+#define G_WEBSOCKET_POOL_READ(counter) __atomic_load_n(&(counter),__ATOMIC_RELAXED)
+
+#define G_WEBSOCKET_POOL_NEXT(header) (*((GWebSocketPoolHeader**)(((guint8*)(header)) + G_WEBSOCKET_POOL_HEADER_SIZE)))
+
+static GWebSocketPoolHeader *
+_g_websocket_pool_system_alloc(
+    GWebSocketPoolCache * cache,
+    gsize size,
+    guint size_class)
+{
+  GWebSocketPoolHeader * header = NULL;
+  G_WEBSOCKET_POOL_COUNT(cache->counters.system_allocs,1);
+#ifdef MADV_HUGEPAGE
+  if(pool_huge_pages && (size >= G_WEBSOCKET_POOL_HUGE_PAGE))
+    {
+      gsize mapped = (size + G_WEBSOCKET_POOL_HUGE_PAGE - 1) & ~(G_WEBSOCKET_POOL_HUGE_PAGE - 1);
+      gpointer block = mmap(NULL,mapped,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+      if(block != MAP_FAILED)
+	{
+	  madvise(block,mapped,MADV_HUGEPAGE);
+	  header = (GWebSocketPoolHeader*)block;
+	  header->size_class = size_class;
+	  header->huge_page = TRUE;
+	  header->fd = -1;
+	  header->size = mapped;
+	  return header;
+	}
+    }
+#endif
+  header = g_malloc(size);
+  header->size_class = size_class;
+  header->huge_page = FALSE;
+  header->fd = -1;
+  header->size = size;
+  return header;
+}
+
+static void
+_g_websocket_pool_system_free(
+    GWebSocketPoolCache * cache,
+    GWebSocketPoolHeader * header)
+{
+  G_WEBSOCKET_POOL_COUNT(cache->counters.system_frees,1);
+  if(header->huge_page)
+    munmap(header,header->size);
+  else
+    g_free(header);
+}
+
+static void
+_g_websocket_pool_release(
+    GWebSocketPoolCache * cache,
+    guint size_class,
+    guint count)
+{
+  for(guint index = 0;index < count;index++)
+    {
+      GWebSocketPoolHeader * header = cache->blocks[size_class];
+      cache->blocks[size_class] = G_WEBSOCKET_POOL_NEXT(header);
+      cache->count[size_class]--;
+      cache->cached -= header->size;
+      G_WEBSOCKET_POOL_COUNT(cache->counters.cached,-(gssize)header->size);
+      _g_websocket_pool_system_free(cache,header);
+    }
+  cache->low[size_class] = cache->count[size_class];
+}
+
+static void
+_g_websocket_pool_cache_free(
+    gpointer data)
+{
+  GWebSocketPoolCache * cache = (GWebSocketPoolCache*)data;
+  for(guint size_class = 0;size_class < G_WEBSOCKET_POOL_CLASSES;size_class++)
+    _g_websocket_pool_release(cache,size_class,cache->count[size_class]);
+
+  g_mutex_lock(&pool_caches_mutex);
+  pool_caches = g_list_remove(pool_caches,cache);
+  pool_retired.allocs += cache->counters.allocs;
+  pool_retired.frees += cache->counters.frees;
+  pool_retired.system_allocs += cache->counters.system_allocs;
+  pool_retired.system_frees += cache->counters.system_frees;
+  pool_retired.cached += cache->counters.cached;
+  g_mutex_unlock(&pool_caches_mutex);
+  g_free(cache);
+}
+
+/* milliseconds, a coarse clock is enough for the trim interval and cheaper */
+static gint64
+_g_websocket_pool_now()
+{
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE,&now);
+#else
+  clock_gettime(CLOCK_MONOTONIC,&now);
+#endif
+  return (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static GWebSocketPoolCache *
+_g_websocket_pool_get_cache()
+{
+  GWebSocketPoolCache * cache = g_private_get(&pool_cache);
+  if(!cache)
+    {
+      cache = g_new0(GWebSocketPoolCache,1);
+      cache->trimmed = _g_websocket_pool_now();
+      cache->generation = g_atomic_int_get(&pool_trim_generation);
+      g_private_set(&pool_cache,cache);
+      g_mutex_lock(&pool_caches_mutex);
+      pool_caches = g_list_prepend(pool_caches,cache);
+      g_mutex_unlock(&pool_caches_mutex);
+    }
+  return cache;
+}
+
+/*
+ * Gives back the blocks that were not used since the last trim, once the
+ * trim interval has passed. A thread that was idle longer trims on its
+ * next operation. After a g_websocket_pool_trim() everything is given back.
+ */
+static void
+_g_websocket_pool_tick(
+    GWebSocketPoolCache * cache)
+{
+  gint generation = g_atomic_int_get(&pool_trim_generation);
+  gint64 now = _g_websocket_pool_now();
+  if(generation != cache->generation)
+    {
+      cache->generation = generation;
+      cache->trimmed = now;
+      for(guint size_class = 0;size_class < G_WEBSOCKET_POOL_CLASSES;size_class++)
+	_g_websocket_pool_release(cache,size_class,cache->count[size_class]);
+    }
+  else if(now - cache->trimmed >= G_WEBSOCKET_POOL_TRIM_INTERVAL)
+    {
+      cache->trimmed = now;
+      for(guint size_class = 0;size_class < G_WEBSOCKET_POOL_CLASSES;size_class++)
+	_g_websocket_pool_release(cache,size_class,cache->low[size_class]);
+    }
+}
+
+static guint
+_g_websocket_pool_size_class(
+    gsize size)
+{
+  guint shift = G_WEBSOCKET_POOL_MIN_SHIFT;
+  while((shift <= G_WEBSOCKET_POOL_MAX_SHIFT) && (((gsize)1 << shift) < size))
+    shift++;
+  return shift - G_WEBSOCKET_POOL_MIN_SHIFT;
+}
+
+/*
+ * Returns a block of at least size bytes. Blocks up to 4MB are rounded up to
+ * a power of two and recycled by the thread that frees them, larger blocks
+ * always come from the system.
+ */
+gpointer
+_g_websocket_pool_alloc(
+    gsize size)
+{
+  gsize total = size + G_WEBSOCKET_POOL_HEADER_SIZE;
+  guint size_class = _g_websocket_pool_size_class(total);
+  GWebSocketPoolHeader * header = NULL;
+  GWebSocketPoolCache * cache = _g_websocket_pool_get_cache();
+
+  G_WEBSOCKET_POOL_COUNT(cache->counters.allocs,1);
+  if(size_class < G_WEBSOCKET_POOL_CLASSES)
+    {
+      header = cache->blocks[size_class];
+      if(header)
+	{
+	  cache->blocks[size_class] = G_WEBSOCKET_POOL_NEXT(header);
+	  cache->count[size_class]--;
+	  cache->low[size_class] = MIN(cache->low[size_class],cache->count[size_class]);
+	  cache->cached -= header->size;
+	  G_WEBSOCKET_POOL_COUNT(cache->counters.cached,-(gssize)header->size);
+	}
+      else
+	{
+	  header = _g_websocket_pool_system_alloc(cache,(gsize)1 << (size_class + G_WEBSOCKET_POOL_MIN_SHIFT),size_class);
+	}
+      _g_websocket_pool_tick(cache);
+    }
+  else
+    {
+      header = _g_websocket_pool_system_alloc(cache,total,G_WEBSOCKET_POOL_DIRECT);
+    }
+  return ((guint8*)header) + G_WEBSOCKET_POOL_HEADER_SIZE;
+}
+
+gpointer
+_g_websocket_pool_alloc0(
+    gsize size)
+{
+  gpointer mem = _g_websocket_pool_alloc(size);
+  memset(mem,0,size);
+  return mem;
+}
+
+static gsize
+_g_websocket_pool_mapped_size(
+    gsize size)
+{
+  gsize page = sysconf(_SC_PAGESIZE);
+  return (size + G_WEBSOCKET_POOL_HEADER_SIZE + page - 1) & ~(page - 1);
+}
+
+/*
+ * Returns a block backed by an anonymous memfd instead of the heap, its
+ * pages go back to the system as soon as it is freed and the fd can be
+ * handed to other code or processes. Falls back to a heap block when
+ * memfd_create() is not available.
+ */
+gpointer
+_g_websocket_pool_alloc_mapped(
+    gsize size)
+{
+  gsize mapped = _g_websocket_pool_mapped_size(size);
+  gint fd = memfd_create("gwebsocket",MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd < 0)
+    return _g_websocket_pool_alloc(size);
+
+  gpointer block = MAP_FAILED;
+  if(ftruncate(fd,mapped) == 0)
+    block = mmap(NULL,mapped,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if(block == MAP_FAILED)
+    {
+      close(fd);
+      return _g_websocket_pool_alloc(size);
+    }
+
+  GWebSocketPoolCache * cache = _g_websocket_pool_get_cache();
+  GWebSocketPoolHeader * header = (GWebSocketPoolHeader*)block;
+  header->size_class = G_WEBSOCKET_POOL_MAPPED;
+  header->huge_page = FALSE;
+  header->fd = fd;
+  header->size = mapped;
+  G_WEBSOCKET_POOL_COUNT(cache->counters.allocs,1);
+  G_WEBSOCKET_POOL_COUNT(cache->counters.system_allocs,1);
+  return ((guint8*)header) + G_WEBSOCKET_POOL_HEADER_SIZE;
+}
+
+/*
+ * Makes a mapped block read only and seals its memfd so nobody can change
+ * it anymore. The block may move, other blocks are returned as they are.
+ */
+gpointer
+_g_websocket_pool_seal(
+    gpointer mem)
+{
+  GWebSocketPoolHeader * header = (GWebSocketPoolHeader*)(((guint8*)mem) - G_WEBSOCKET_POOL_HEADER_SIZE);
+  if(header->size_class != G_WEBSOCKET_POOL_MAPPED)
+    return mem;
+
+  gint fd = header->fd;
+  gsize size = header->size;
+  /* a private mapping does not keep the write seal from being added */
+  gpointer block = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+  if(block == MAP_FAILED)
+    return mem;
+  munmap(header,size);
+  fcntl(fd,F_ADD_SEALS,F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  return ((guint8*)block) + G_WEBSOCKET_POOL_HEADER_SIZE;
+}
+
+/* returns the memfd of a mapped block and where mem is inside it, or -1 */
+gint
+_g_websocket_pool_get_fd(
+    gconstpointer mem,
+    gsize * offset)
+{
+  const GWebSocketPoolHeader * header = (const GWebSocketPoolHeader*)(((const guint8*)mem) - G_WEBSOCKET_POOL_HEADER_SIZE);
+  if(header->size_class != G_WEBSOCKET_POOL_MAPPED)
+    return -1;
+  if(offset)
+    *offset = G_WEBSOCKET_POOL_HEADER_SIZE;
+  return header->fd;
+}
+
+gpointer
+_g_websocket_pool_realloc(
+    gpointer mem,
+    gsize size)
+{
+  if(!mem)
+    return _g_websocket_pool_alloc(size);
+
+  GWebSocketPoolHeader * header = (GWebSocketPoolHeader*)(((guint8*)mem) - G_WEBSOCKET_POOL_HEADER_SIZE);
+  gsize usable = header->size - G_WEBSOCKET_POOL_HEADER_SIZE;
+  if(size <= usable)
+    return mem;
+
+  if(header->size_class == G_WEBSOCKET_POOL_MAPPED)
+    {
+      /* grow the file and let the kernel move the mapping */
+      gsize mapped = _g_websocket_pool_mapped_size(size);
+      if(ftruncate(header->fd,mapped) == 0)
+	{
+	  gpointer block = mremap(header,header->size,mapped,MREMAP_MAYMOVE);
+	  if(block != MAP_FAILED)
+	    {
+	      header = (GWebSocketPoolHeader*)block;
+	      header->size = mapped;
+	      return ((guint8*)header) + G_WEBSOCKET_POOL_HEADER_SIZE;
+	    }
+	}
+    }
+
+  gpointer grown = (header->size_class == G_WEBSOCKET_POOL_MAPPED) ? _g_websocket_pool_alloc_mapped(size) : _g_websocket_pool_alloc(size);
+  memcpy(grown,mem,usable);
+  _g_websocket_pool_free(mem);
+  return grown;
+}
+
+void
+_g_websocket_pool_free(
+    gpointer mem)
+{
+  if(!mem)
+    return;
+
+  GWebSocketPoolHeader * header = (GWebSocketPoolHeader*)(((guint8*)mem) - G_WEBSOCKET_POOL_HEADER_SIZE);
+  GWebSocketPoolCache * cache = _g_websocket_pool_get_cache();
+  G_WEBSOCKET_POOL_COUNT(cache->counters.frees,1);
+  if(header->size_class == G_WEBSOCKET_POOL_MAPPED)
+    {
+      gint fd = header->fd;
+      G_WEBSOCKET_POOL_COUNT(cache->counters.system_frees,1);
+      munmap(header,header->size);
+      close(fd);
+      return;
+    }
+  if(header->size_class == G_WEBSOCKET_POOL_DIRECT)
+    {
+      _g_websocket_pool_system_free(cache,header);
+      return;
+    }
+
+  if(cache->cached + header->size > pool_max_cached)
+    {
+      _g_websocket_pool_system_free(cache,header);
+    }
+  else
+    {
+      G_WEBSOCKET_POOL_NEXT(header) = cache->blocks[header->size_class];
+      cache->blocks[header->size_class] = header;
+      cache->count[header->size_class]++;
+      cache->cached += header->size;
+      G_WEBSOCKET_POOL_COUNT(cache->counters.cached,(gssize)header->size);
+    }
+  _g_websocket_pool_tick(cache);
+}
+
+/* sums the counters every thread keeps, a snapshot while they run */
+void
+g_websocket_pool_get_stats(
+    GWebSocketPoolStats * stats
+    )
+{
+  GWebSocketPoolCounters total;
+  g_mutex_lock(&pool_caches_mutex);
+  total = pool_retired;
+  for(GList * item = pool_caches;item;item = item->next)
+    {
+      GWebSocketPoolCounters * counters = &(((GWebSocketPoolCache*)item->data)->counters);
+      total.allocs += G_WEBSOCKET_POOL_READ(counters->allocs);
+      total.frees += G_WEBSOCKET_POOL_READ(counters->frees);
+      total.system_allocs += G_WEBSOCKET_POOL_READ(counters->system_allocs);
+      total.system_frees += G_WEBSOCKET_POOL_READ(counters->system_frees);
+      total.cached += G_WEBSOCKET_POOL_READ(counters->cached);
+    }
+  g_mutex_unlock(&pool_caches_mutex);
+
+  stats->allocs = total.allocs;
+  stats->frees = total.frees;
+  stats->system_allocs = total.system_allocs;
+  stats->system_frees = total.system_frees;
+  stats->cached_bytes = MAX(total.cached,0);
+}
+
+/*
+ * Gives every cached block of the calling thread back to the system. The
+ * other threads give theirs back on their next pool operation.
+ */
+void
+g_websocket_pool_trim()
+{
+  g_atomic_int_inc(&pool_trim_generation);
+  GWebSocketPoolCache * cache = g_private_get(&pool_cache);
+  if(cache)
+    _g_websocket_pool_tick(cache);
+}
+
+/*
+ * Limits the bytes each thread keeps cached, blocks freed past the limit go
+ * back to the system.
+ */
+void
+g_websocket_pool_set_max_cached(
+    gsize max_cached
+    )
+{
+  pool_max_cached = max_cached;
+}
+
+/*
+ * Blocks of 2MB or more are mapped and advised as transparent huge pages,
+ * only the blocks allocated afterwards are affected.
+ */
+void
+g_websocket_pool_set_huge_pages(
+    gboolean huge_pages
+    )
+{
+  pool_huge_pages = huge_pages;
+}
@@ -0,0 +1,53 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GWEBSOCKETPOOL_H_
+#define GWEBSOCKETPOOL_H_
+
+#include <glib.h>
+
+typedef struct	_GWebSocketPoolStats	GWebSocketPoolStats;
+
+/* counters of all the threads, system_* count the calls to the allocator */
+struct _GWebSocketPoolStats
+{
+  gsize allocs;
+  gsize frees;
+  gsize system_allocs;
+  gsize system_frees;
+  gsize cached_bytes;
+};
+
+G_BEGIN_DECLS
+
+void			g_websocket_pool_get_stats(
+			    GWebSocketPoolStats * stats
+			    );
+
+void			g_websocket_pool_trim();
+
+void			g_websocket_pool_set_max_cached(
+			    gsize max_cached
+			    );
+
+void			g_websocket_pool_set_huge_pages(
+			    gboolean huge_pages
+			    );
+
+G_END_DECLS
+
+#endif /* GWEBSOCKETPOOL_H_ */
@@ -19,6 +19,7 @@
 
 typedef struct _GWebSocketServicePrivate GWebSocketServicePrivate;
 typedef struct _GWebSocketServiceIdleData GWebSocketServiceIdleData;
+typedef struct _GWebSocketEncodings GWebSocketEncodings;
 
 static GMutex g_websocket_service_mutex = G_STATIC_MUTEX_INIT;
 
@@ -27,6 +28,26 @@ struct _GWebSocketServicePrivate
   GMutex  mutex_internal;
   GList * clients;
   glong   ping_task_id;
+  gboolean streaming;
+  gsize   max_frame_size;
+  gsize   max_message_size;
+  gsize   max_receive_memory;
+  gsize   spill_size;
+  gboolean deflate;
+  gboolean deflate_no_context_takeover;
+  gsize   deflate_memory;
+  gsize   deflate_threshold;
+  GPtrArray * dictionaries;
+  GMainContext * context;
+  gint    priority;
+  gboolean inline_dispatch;
+  guint   batch_size;
+  guint   batch_time;
+  guint   queue_depth;
+  gsize   queue_high_water;
+  GWebSocketHandlers handlers;
+  gboolean has_handlers;
+  gpointer handlers_data;
 };
 
 struct _GWebSocketServiceIdleData
@@ -41,6 +62,14 @@ void		_g_websocket_service_dispose(GObject * object);
 
 gboolean	_g_websocket_ping(GWebSocket * socket);
 
+gboolean	_g_websocket_mux_attached(GWebSocket * socket);
+
+void		_g_websocket_idle_add(GWebSocket * socket,GSourceFunc func,gpointer data);
+
+GWebSocketEncodings *	_g_websocket_encodings_new(GWebSocketMessage * message);
+void			_g_websocket_encodings_free(GWebSocketEncodings * encodings);
+gboolean		_g_websocket_send_encoded(GWebSocket * socket,GWebSocketEncodings * encodings,GError ** error);
+
 gboolean	_g_websocket_complete(
 		    GWebSocket * socket,
 		    GSocketConnection * connection,
@@ -59,6 +88,18 @@ void		_g_websocket_service_client_message(
 		    GWebSocketMessage * message,
 		    GWebSocketService * service);
 
+void		_g_websocket_service_client_message_chunk(
+		    GWebSocket * socket,
+		    GWebSocketMessage * message,
+		    gboolean last,
+		    GWebSocketService * service);
+
+void		_g_websocket_service_client_messages(
+		    GWebSocket * socket,
+		    GWebSocketMessage ** messages,
+		    guint n_messages,
+		    GWebSocketService * service);
+
 void		_g_websocket_service_client_closed(
 		    GWebSocket * socket,
 		    GWebSocketService * service);
@@ -69,6 +110,8 @@ enum
 	SIGNAL_MESSAGE = 1,
 	SIGNAL_CLOSED = 2,
 	SIGNAL_REQUEST = 3,
+	SIGNAL_MESSAGE_CHUNK = 4,
+	SIGNAL_MESSAGES = 5,
 	N_SIGNALS
 };
 
@@ -77,7 +120,7 @@ enum
 static gint		g_websocket_service_signals[N_SIGNALS];
 
 static void
-g_websocket_service_ping_task_broadcast(GWebSocketService * service,GWebSocket * socket,gpointer data)
+g_websocket_service_ping_task_broadcast(GWebSocketService * service G_GNUC_UNUSED,GWebSocket * socket,gpointer data G_GNUC_UNUSED)
 {
   _g_websocket_ping(socket);
 }
@@ -96,6 +139,24 @@ g_websocket_service_init(GWebSocketService * self)
   GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(self);
   g_signal_connect(self,"run",G_CALLBACK(_g_websocket_service_run),NULL);
   g_mutex_init(&(priv->mutex_internal));
+  priv->streaming = FALSE;
+  priv->max_frame_size = 15728640L;
+  priv->max_message_size = 15728640L; //-> 15MB
+  priv->max_receive_memory = 0;
+  priv->spill_size = 0;
+  priv->deflate = FALSE;
+  priv->deflate_no_context_takeover = FALSE;
+  priv->deflate_memory = 0;
+  priv->deflate_threshold = G_WEBSOCKET_CODEC_DEFLATE_THRESHOLD;
+  priv->dictionaries = g_ptr_array_new_with_free_func((GDestroyNotify)g_websocket_dictionary_unref);
+  priv->context = NULL;
+  priv->priority = G_PRIORITY_DEFAULT_IDLE;
+  priv->inline_dispatch = FALSE;
+  priv->batch_size = 0;
+  priv->batch_time = 0;
+  priv->queue_depth = G_WEBSOCKET_QUEUE_DEPTH;
+  priv->queue_high_water = G_WEBSOCKET_QUEUE_HIGH_WATER;
+  priv->has_handlers = FALSE;
   priv->ping_task_id = g_timeout_add(5000,g_websocket_service_ping_task,self);
 }
 
@@ -107,6 +168,8 @@ g_websocket_service_class_init(GWebSocketServiceClass * klass)
   const GType message_params[2] = {G_TYPE_OBJECT,G_TYPE_POINTER};
   const GType socket_params[1] = {G_TYPE_OBJECT};
   const GType request_params[2] = {G_TYPE_OBJECT,G_TYPE_OBJECT};
+  const GType chunk_params[3] = {G_TYPE_OBJECT,G_TYPE_POINTER,G_TYPE_BOOLEAN};
+  const GType messages_params[3] = {G_TYPE_OBJECT,G_TYPE_POINTER,G_TYPE_UINT};
 
   g_websocket_service_signals[SIGNAL_CONNECTED] =
      g_signal_newv ("connected",
@@ -155,12 +218,36 @@ g_websocket_service_class_init(GWebSocketServiceClass * klass)
       G_TYPE_NONE /* return_type */,
       2     /* n_params */,
       (GType*)request_params  /* param_types */);
+
+  g_websocket_service_signals[SIGNAL_MESSAGE_CHUNK] =
+     g_signal_newv ("message-chunk",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE,
+      NULL /* closure */,
+      NULL /* accumulator */,
+      NULL /* accumulator data */,
+      NULL /* C marshaller */,
+      G_TYPE_NONE /* return_type */,
+      3     /* n_params */,
+      (GType*)chunk_params  /* param_types */);
+
+  g_websocket_service_signals[SIGNAL_MESSAGES] =
+     g_signal_newv ("messages",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_FIRST | G_SIGNAL_NO_RECURSE,
+      NULL /* closure */,
+      NULL /* accumulator */,
+      NULL /* accumulator data */,
+      NULL /* C marshaller */,
+      G_TYPE_NONE /* return_type */,
+      3     /* n_params */,
+      (GType*)messages_params  /* param_types */);
 }
 
 static gboolean	_g_websocket_service_run (
 		  GThreadedSocketService *service,
 		  GSocketConnection      *connection,
-		  GObject                *source_object)
+		  GObject                *source_object G_GNUC_UNUSED)
 {
   g_mutex_lock(&g_websocket_service_mutex);
   GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(G_WEBSOCKET_SERVICE(service));
@@ -184,11 +271,37 @@ static gboolean	_g_websocket_service_run (
 	{
 	  g_socket_set_timeout(g_socket_connection_get_socket(connection),0);
 	  GWebSocket * socket = g_websocket_new();
+	  g_websocket_set_streaming(socket,priv->streaming);
+	  g_websocket_set_max_frame_size(socket,priv->max_frame_size);
+	  g_websocket_set_max_message_size(socket,priv->max_message_size);
+	  g_websocket_set_max_receive_memory(socket,priv->max_receive_memory);
+	  g_websocket_set_spill_size(socket,priv->spill_size);
+	  g_websocket_set_deflate(socket,priv->deflate);
+	  g_websocket_set_deflate_no_context_takeover(socket,priv->deflate_no_context_takeover);
+	  g_websocket_set_deflate_memory(socket,priv->deflate_memory);
+	  g_websocket_set_deflate_threshold(socket,priv->deflate_threshold);
+	  for(guint index = 0;priv->dictionaries && (index < priv->dictionaries->len);index++)
+	    g_websocket_add_dictionary(socket,g_ptr_array_index(priv->dictionaries,index));
+	  g_websocket_set_context(socket,priv->context);
+	  g_websocket_set_priority(socket,priv->priority);
+	  g_websocket_set_inline_dispatch(socket,priv->inline_dispatch);
+	  g_websocket_set_batch_size(socket,priv->batch_size);
+	  g_websocket_set_batch_time(socket,priv->batch_time);
+	  g_websocket_set_queue_depth(socket,priv->queue_depth);
+	  g_websocket_set_queue_high_water(socket,priv->queue_high_water);
+	  if(priv->has_handlers)
+	    g_websocket_set_handlers(socket,&(priv->handlers),priv->handlers_data);
 	   if(_g_websocket_complete(socket,connection,request,key,origin))
 	     {
 	       g_mutex_lock(&(priv->mutex_internal));
 	       priv->clients = g_list_append(priv->clients,g_object_ref(socket));
-	       g_signal_connect(G_OBJECT(socket),"message",G_CALLBACK(_g_websocket_service_client_message),service);
+	       /* with handlers, only the signals someone listens to are relayed */
+	       if(!priv->has_handlers || g_signal_has_handler_pending(service,g_websocket_service_signals[SIGNAL_MESSAGE],0,TRUE))
+		 g_signal_connect(G_OBJECT(socket),"message",G_CALLBACK(_g_websocket_service_client_message),service);
+	       if(!priv->has_handlers || g_signal_has_handler_pending(service,g_websocket_service_signals[SIGNAL_MESSAGE_CHUNK],0,TRUE))
+		 g_signal_connect(G_OBJECT(socket),"message-chunk",G_CALLBACK(_g_websocket_service_client_message_chunk),service);
+	       if(!priv->has_handlers || g_signal_has_handler_pending(service,g_websocket_service_signals[SIGNAL_MESSAGES],0,TRUE))
+		 g_signal_connect(G_OBJECT(socket),"messages",G_CALLBACK(_g_websocket_service_client_messages),service);
 	       g_signal_connect(G_OBJECT(socket),"closed",G_CALLBACK(_g_websocket_service_client_closed),service);
 	       g_mutex_unlock(&(priv->mutex_internal));
 	       g_signal_emit (G_WEBSOCKET_SERVICE(service), g_websocket_service_signals[SIGNAL_CONNECTED],0,socket);
@@ -237,7 +350,31 @@ _g_websocket_service_client_message(
 		  GWebSocketMessage * message,
 		  GWebSocketService * service)
 {
-  g_signal_emit (service, g_websocket_service_signals[SIGNAL_MESSAGE],0,socket,message);
+  /* the mux owns every message of its socket */
+  if(!_g_websocket_mux_attached(socket))
+    g_signal_emit (service, g_websocket_service_signals[SIGNAL_MESSAGE],0,socket,message);
+}
+
+
+void
+_g_websocket_service_client_message_chunk(
+		  GWebSocket * socket,
+		  GWebSocketMessage * message,
+		  gboolean last,
+		  GWebSocketService * service)
+{
+  g_signal_emit (service, g_websocket_service_signals[SIGNAL_MESSAGE_CHUNK],0,socket,message,last);
+}
+
+
+void
+_g_websocket_service_client_messages(
+		  GWebSocket * socket,
+		  GWebSocketMessage ** messages,
+		  guint n_messages,
+		  GWebSocketService * service)
+{
+  g_signal_emit (service, g_websocket_service_signals[SIGNAL_MESSAGES],0,socket,messages,n_messages);
 }
 
 
@@ -249,7 +386,7 @@ _g_websocket_service_client_closed(
   GWebSocketServiceIdleData * data = g_new0(GWebSocketServiceIdleData,1);
   data->service = service;
   data->socket = socket;
-  g_idle_add(_g_websocket_service_client_closed_idle,data);
+  _g_websocket_idle_add(socket,_g_websocket_service_client_closed_idle,data);
 }
 
 GWebSocketService *
@@ -272,6 +409,200 @@ g_websocket_service_broadcast(GWebSocketService * service,GWebSocketBroadCastFun
   g_mutex_unlock(&(priv->mutex_internal));
 }
 
+/*
+ * Sends message to every client, compressing and framing it once for each
+ * encoding in use instead of once per client. Returns the number of clients
+ * it was sent to. The writes block, they are made on a copy of the client
+ * list so clients can come and go meanwhile.
+ */
+guint
+g_websocket_service_broadcast_message(GWebSocketService * service,GWebSocketMessage * message)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  GWebSocketEncodings * encodings = _g_websocket_encodings_new(message);
+  guint count = 0;
+  GList * clients = NULL;
+  g_mutex_lock(&(priv->mutex_internal));
+  for(GList * iter = g_list_first(priv->clients);iter;iter = g_list_next(iter))
+    clients = g_list_prepend(clients,g_object_ref(iter->data));
+  g_mutex_unlock(&(priv->mutex_internal));
+  clients = g_list_reverse(clients);
+  for(GList * iter = clients;iter;iter = g_list_next(iter))
+    {
+      if(_g_websocket_send_encoded(G_WEBSOCKET(iter->data),encodings,NULL))
+	count++;
+    }
+  g_list_free_full(clients,g_object_unref);
+  _g_websocket_encodings_free(encodings);
+  return count;
+}
+
+void
+g_websocket_service_set_streaming(GWebSocketService * service,gboolean streaming)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->streaming = streaming;
+}
+
+void
+g_websocket_service_set_max_message_size(GWebSocketService * service,gsize max_message_size)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->max_message_size = max_message_size;
+}
+
+void
+g_websocket_service_set_max_frame_size(GWebSocketService * service,gsize max_frame_size)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->max_frame_size = max_frame_size;
+}
+
+void
+g_websocket_service_set_max_receive_memory(GWebSocketService * service,gsize max_receive_memory)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->max_receive_memory = max_receive_memory;
+}
+
+void
+g_websocket_service_set_spill_size(GWebSocketService * service,gsize spill_size)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->spill_size = spill_size;
+}
+
+/*
+ * Accepts permessage-deflate from the clients that offer it, see
+ * g_websocket_set_deflate().
+ */
+void
+g_websocket_service_set_deflate(GWebSocketService * service,gboolean deflate)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->deflate = deflate;
+}
+
+void
+g_websocket_service_set_deflate_no_context_takeover(GWebSocketService * service,gboolean no_context_takeover)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->deflate_no_context_takeover = no_context_takeover;
+}
+
+void
+g_websocket_service_set_deflate_memory(GWebSocketService * service,gsize memory)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->deflate_memory = memory;
+}
+
+void
+g_websocket_service_set_deflate_threshold(GWebSocketService * service,gsize threshold)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->deflate_threshold = threshold;
+}
+
+/*
+ * Accepts x-gwebsocket-zstd with dictionary from the gwebsocket clients
+ * that offer it, see g_websocket_add_dictionary(). Call before starting.
+ */
+void
+g_websocket_service_add_dictionary(GWebSocketService * service,GWebSocketDictionary * dictionary)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  g_ptr_array_add(priv->dictionaries,g_websocket_dictionary_ref(dictionary));
+}
+
+/*
+ * Context and priority the messages of the clients are delivered with, see
+ * g_websocket_set_context(). Call before starting.
+ */
+void
+g_websocket_service_set_context(GWebSocketService * service,GMainContext * context)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  if(context)
+    g_main_context_ref(context);
+  if(priv->context)
+    g_main_context_unref(priv->context);
+  priv->context = context;
+}
+
+void
+g_websocket_service_set_priority(GWebSocketService * service,gint priority)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->priority = priority;
+}
+
+void
+g_websocket_service_set_inline_dispatch(GWebSocketService * service,gboolean inline_dispatch)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->inline_dispatch = inline_dispatch;
+}
+
+/* see g_websocket_set_batch_size() and g_websocket_set_batch_time() */
+void
+g_websocket_service_set_batch_size(GWebSocketService * service,guint batch_size)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->batch_size = batch_size;
+}
+
+void
+g_websocket_service_set_batch_time(GWebSocketService * service,guint batch_time)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->batch_time = batch_time;
+}
+
+/* see g_websocket_set_queue_depth() and g_websocket_set_queue_high_water() */
+void
+g_websocket_service_set_queue_depth(GWebSocketService * service,guint queue_depth)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->queue_depth = queue_depth;
+}
+
+void
+g_websocket_service_set_queue_high_water(GWebSocketService * service,gsize queue_high_water)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  priv->queue_high_water = queue_high_water;
+}
+
+/*
+ * Calls handlers straight from every client, see g_websocket_set_handlers().
+ * The "message", "message-chunk" and "messages" signals of the service are
+ * still emitted for the clients that connect while a handler is connected
+ * to them. The clients copy the handlers when they connect, so they can
+ * only be set while the service is not active.
+ */
+void
+g_websocket_service_set_handlers(GWebSocketService * service,const GWebSocketHandlers * handlers,gpointer user_data)
+{
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(service);
+  g_return_if_fail(!g_socket_service_is_active(G_SOCKET_SERVICE(service)));
+  priv->has_handlers = (handlers != NULL);
+  if(handlers)
+    priv->handlers = *handlers;
+  priv->handlers_data = user_data;
+}
+
+/*
+ * Caps the receive memory of every websocket of the process, not only the
+ * clients of one service, they pause reading while it is exhausted. 0
+ * means no budget. The same as g_websocket_codec_set_memory_budget().
+ */
+void
+g_websocket_service_set_global_memory_budget(gsize budget)
+{
+  g_websocket_codec_set_memory_budget(budget);
+}
+
 gsize
 g_websocket_service_get_count(GWebSocketService * service)
 {
@@ -288,5 +619,7 @@ g_websocket_service_get_count(GWebSocketService * service)
 void
 _g_websocket_service_dispose(GObject * object)
 {
-
+  GWebSocketServicePrivate * priv = g_websocket_service_get_instance_private(G_WEBSOCKET_SERVICE(object));
+  g_clear_pointer(&(priv->dictionaries),g_ptr_array_unref);
+  g_clear_pointer(&(priv->context),g_main_context_unref);
 }
@@ -37,6 +37,46 @@ GWebSocketService *	g_websocket_service_new(int max_threads);
 
 void			g_websocket_service_broadcast(GWebSocketService * service,GWebSocketBroadCastFunc func,gpointer data);
 
+guint			g_websocket_service_broadcast_message(GWebSocketService * service,GWebSocketMessage * message);
+
 gsize			g_websocket_service_get_count(GWebSocketService * service);
 
+void			g_websocket_service_set_streaming(GWebSocketService * service,gboolean streaming);
+
+void			g_websocket_service_set_max_message_size(GWebSocketService * service,gsize max_message_size);
+
+void			g_websocket_service_set_max_frame_size(GWebSocketService * service,gsize max_frame_size);
+
+void			g_websocket_service_set_max_receive_memory(GWebSocketService * service,gsize max_receive_memory);
+
+void			g_websocket_service_set_spill_size(GWebSocketService * service,gsize spill_size);
+
+void			g_websocket_service_set_deflate(GWebSocketService * service,gboolean deflate);
+
+void			g_websocket_service_set_deflate_no_context_takeover(GWebSocketService * service,gboolean no_context_takeover);
+
+void			g_websocket_service_set_deflate_memory(GWebSocketService * service,gsize memory);
+
+void			g_websocket_service_set_deflate_threshold(GWebSocketService * service,gsize threshold);
+
+void			g_websocket_service_add_dictionary(GWebSocketService * service,GWebSocketDictionary * dictionary);
+
+void			g_websocket_service_set_context(GWebSocketService * service,GMainContext * context);
+
+void			g_websocket_service_set_priority(GWebSocketService * service,gint priority);
+
+void			g_websocket_service_set_inline_dispatch(GWebSocketService * service,gboolean inline_dispatch);
+
+void			g_websocket_service_set_batch_size(GWebSocketService * service,guint batch_size);
+
+void			g_websocket_service_set_batch_time(GWebSocketService * service,guint batch_time);
+
+void			g_websocket_service_set_queue_depth(GWebSocketService * service,guint queue_depth);
+
+void			g_websocket_service_set_queue_high_water(GWebSocketService * service,gsize queue_high_water);
+
+void			g_websocket_service_set_handlers(GWebSocketService * service,const GWebSocketHandlers * handlers,gpointer user_data);
+
+void			g_websocket_service_set_global_memory_budget(gsize budget);
+
 #endif /* GWEBSOCKETSERVICE_H_ */
@@ -0,0 +1,210 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define G_WEBSOCKET_UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+/* consecutive ASCII bytes after which the ascii kernel is tried again */
+#define G_WEBSOCKET_UTF8_ASCII_RUN 16
+
+typedef gsize (*GWebSocketAsciiFunc)(const guint8 * data,gsize count);
+
+gboolean	_g_websocket_utf8_validate(
+		    guint32 * state,
+		    const guint8 * data,
+		    gsize count);
+
+/*
+ * The ascii kernels return how many leading bytes of data are ASCII, they
+ * may stop early at a block boundary, never after a non ASCII byte.
+ */
+
+static gsize
+_g_websocket_ascii_word(
+    const guint8 * data,
+    gsize count)
+{
+  gsize index = 0;
+  guint64 block = 0;
+  for(;index + 8 <= count;index += 8)
+    {
+      memcpy(&block,data + index,8);
+      if(block & G_GUINT64_CONSTANT(0x8080808080808080))
+	break;
+    }
+  return index;
+}
+
+#ifdef G_WEBSOCKET_UTF8_X86
+
+__attribute__((target("sse2")))
+static gsize
+_g_websocket_ascii_sse2(
+    const guint8 * data,
+    gsize count)
+{
+  gsize index = 0;
+  for(;index + 64 <= count;index += 64)
+    {
+      __m128i b0 = _mm_loadu_si128((const __m128i*)(data + index));
+      __m128i b1 = _mm_loadu_si128((const __m128i*)(data + index + 16));
+      __m128i b2 = _mm_loadu_si128((const __m128i*)(data + index + 32));
+      __m128i b3 = _mm_loadu_si128((const __m128i*)(data + index + 48));
+      __m128i any = _mm_or_si128(_mm_or_si128(b0,b1),_mm_or_si128(b2,b3));
+      if(_mm_movemask_epi8(any))
+	break;
+    }
+  for(;index + 16 <= count;index += 16)
+    {
+      if(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + index))))
+	return index;
+    }
+  return index + _g_websocket_ascii_word(data + index,count - index);
+}
+
+__attribute__((target("avx2")))
+static gsize
+_g_websocket_ascii_avx2(
+    const guint8 * data,
+    gsize count)
+{
+  gsize index = 0;
+  for(;index + 128 <= count;index += 128)
+    {
+      __m256i b0 = _mm256_loadu_si256((const __m256i*)(data + index));
+      __m256i b1 = _mm256_loadu_si256((const __m256i*)(data + index + 32));
+      __m256i b2 = _mm256_loadu_si256((const __m256i*)(data + index + 64));
+      __m256i b3 = _mm256_loadu_si256((const __m256i*)(data + index + 96));
+      __m256i any = _mm256_or_si256(_mm256_or_si256(b0,b1),_mm256_or_si256(b2,b3));
+      if(_mm256_movemask_epi8(any))
+	break;
+    }
+  for(;index + 32 <= count;index += 32)
+    {
+      if(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(data + index))))
+	break;
+    }
+  _mm256_zeroupper();
+  return index + _g_websocket_ascii_sse2(data + index,count - index);
+}
+
+#endif
+
+static GWebSocketAsciiFunc
+_g_websocket_ascii_select(void)
+{
+  static gsize ascii_func = 0;
+  if(g_once_init_enter(&ascii_func))
+    {
+      GWebSocketAsciiFunc func = _g_websocket_ascii_word;
+#ifdef G_WEBSOCKET_UTF8_X86
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx2"))
+	func = _g_websocket_ascii_avx2;
+      else if(__builtin_cpu_supports("sse2"))
+	func = _g_websocket_ascii_sse2;
+#endif
+      g_once_init_leave(&ascii_func,(gsize)func);
+    }
+  return (GWebSocketAsciiFunc)ascii_func;
+}
+
+/*
+ * Validates count more bytes of an UTF-8 stream. state is 0 at a character
+ * boundary, otherwise it holds the continuation bytes still expected and
+ * the range allowed for the next one, so a character may be split between
+ * calls and between fragments. The stream is complete and valid when the
+ * function returned TRUE and state is 0. Overlong forms, surrogates and
+ * code points past U+10FFFF are rejected. The ascii kernel skips runs of
+ * ASCII, other characters are range checked a byte at a time.
+ */
+gboolean
+_g_websocket_utf8_validate(
+    guint32 * state,
+    const guint8 * data,
+    gsize count)
+{
+  GWebSocketAsciiFunc ascii = _g_websocket_ascii_select();
+  guint need = *state & 0xFF;
+  guint8 lower = (*state >> 8) & 0xFF;
+  guint8 upper = (*state >> 16) & 0xFF;
+  gsize index = need ? 0 : ascii(data,count);
+  guint run = 0;
+
+  while(index < count)
+    {
+      guint8 byte = data[index];
+      if(need)
+	{
+	  if((byte < lower) || (byte > upper))
+	    return FALSE;
+	  need--;
+	  lower = 0x80;
+	  upper = 0xBF;
+	  index++;
+	}
+      else if(byte < 0x80)
+	{
+	  index++;
+	  if((++run >= G_WEBSOCKET_UTF8_ASCII_RUN) && (count - index >= 16))
+	    {
+	      index += ascii(data + index,count - index);
+	      run = 0;
+	    }
+	}
+      else if(byte < 0xC2)
+	{
+	  return FALSE;
+	}
+      else if(byte < 0xE0)
+	{
+	  run = 0;
+	  need = 1;
+	  lower = 0x80;
+	  upper = 0xBF;
+	  index++;
+	}
+      else if(byte < 0xF0)
+	{
+	  run = 0;
+	  need = 2;
+	  lower = (byte == 0xE0) ? 0xA0 : 0x80;
+	  upper = (byte == 0xED) ? 0x9F : 0xBF;
+	  index++;
+	}
+      else if(byte < 0xF5)
+	{
+	  run = 0;
+	  need = 3;
+	  lower = (byte == 0xF0) ? 0x90 : 0x80;
+	  upper = (byte == 0xF4) ? 0x8F : 0xBF;
+	  index++;
+	}
+      else
+	{
+	  return FALSE;
+	}
+    }
+
+  *state = need ? (need | ((guint32)lower << 8) | ((guint32)upper << 16)) : 0;
+  return TRUE;
+}
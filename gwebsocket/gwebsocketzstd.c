@@ -0,0 +1,489 @@
+/*
+	Copyright (C) 2017 Ramiro Jose Garcia Moraga
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <zstd.h>
+#include <gio/gio.h>
+#include "gwebsocketcodec.h"
+
+/*
+ * x-gwebsocket-zstd, a private extension for links where both ends run
+ * gwebsocket. Every message is one zstd frame compressed with a trained
+ * dictionary both ends hold, agreed by its ID in the handshake:
+ *
+ *   Sec-WebSocket-Extensions: x-gwebsocket-zstd; dict=1234567
+ *
+ * As with permessage-deflate RSV1 marks the first frame of a compressed
+ * message, so only one of the two is agreed on a connection. A message
+ * never refers to an earlier one, the dictionary is all the context.
+ */
+
+typedef struct _GWebSocketZstd GWebSocketZstd;
+
+#define G_WEBSOCKET_ZSTD_NAME "x-gwebsocket-zstd"
+
+/* a trained dictionary, digested once for all the connections using it */
+struct _GWebSocketDictionary
+{
+  gint		ref_count;
+  guint32	id;
+  ZSTD_CDict *	cdict;
+  ZSTD_DDict *	ddict;
+};
+
+/*
+ * The zstd state of one connection. A message that arrives whole is
+ * decompressed with the context of the thread, only one streamed in
+ * fragments keeps a context of its own until its last fragment.
+ */
+struct _GWebSocketZstd
+{
+  GWebSocketDictionary *	dictionary;
+  ZSTD_DCtx *			dctx;
+  gboolean			ended;
+};
+
+GWebSocketZstd *	_g_websocket_zstd_new(
+			    GWebSocketDictionary * dictionary);
+
+void		_g_websocket_zstd_free(
+		    GWebSocketZstd * state);
+
+GWebSocketDictionary *	_g_websocket_zstd_get_dictionary(
+			    GWebSocketZstd * state);
+
+guint8 *	_g_websocket_zstd_compress(
+		    GWebSocketDictionary * dictionary,
+		    const guint8 * data,
+		    gsize count,
+		    gsize headroom,
+		    gsize * length);
+
+guint8 *	_g_websocket_zstd_decompress(
+		    GWebSocketZstd * state,
+		    const guint8 * data,
+		    gsize count,
+		    gboolean fin,
+		    gsize limit,
+		    gsize * length,
+		    GError ** error);
+
+GWebSocketDictionary *	_g_websocket_zstd_negotiate(
+			    const gchar * offers,
+			    GPtrArray * dictionaries,
+			    gchar ** response);
+
+gchar *		_g_websocket_zstd_offer(
+		    GPtrArray * dictionaries);
+
+GWebSocketDictionary *	_g_websocket_zstd_accept(
+			    const gchar * response,
+			    GPtrArray * dictionaries);
+
+gpointer	_g_websocket_pool_alloc(gsize size);
+gpointer	_g_websocket_pool_realloc(gpointer mem,gsize size);
+void		_g_websocket_pool_free(gpointer mem);
+
+static void
+_g_websocket_zstd_free_compressor(
+    gpointer cctx)
+{
+  ZSTD_freeCCtx(cctx);
+}
+
+static void
+_g_websocket_zstd_free_decompressor(
+    gpointer dctx)
+{
+  ZSTD_freeDCtx(dctx);
+}
+
+/* messages are independent, so every thread compresses with one context */
+static GPrivate compressor = G_PRIVATE_INIT(_g_websocket_zstd_free_compressor);
+static GPrivate decompressor = G_PRIVATE_INIT(_g_websocket_zstd_free_decompressor);
+
+/*
+ * Loads a dictionary trained with zstd --train or ZDICT_trainFromBuffer(),
+ * level 0 compresses with the default zstd level. Raw content without a
+ * dictionary ID can not be agreed in the handshake and is refused.
+ */
+GWebSocketDictionary *
+g_websocket_dictionary_new(
+    GBytes * bytes,
+    gint level,
+    GError ** error)
+{
+  gsize size = 0;
+  gconstpointer data = g_bytes_get_data(bytes,&size);
+  guint32 id = ZSTD_getDictID_fromDict(data,size);
+  if(id == 0)
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"not a trained zstd dictionary");
+      return NULL;
+    }
+
+  GWebSocketDictionary * dictionary = g_new0(GWebSocketDictionary,1);
+  dictionary->ref_count = 1;
+  dictionary->id = id;
+  dictionary->cdict = ZSTD_createCDict(data,size,level ? level : ZSTD_CLEVEL_DEFAULT);
+  dictionary->ddict = ZSTD_createDDict(data,size);
+  if(!dictionary->cdict || !dictionary->ddict)
+    {
+      g_websocket_dictionary_unref(dictionary);
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE,"can not load the zstd dictionary");
+      return NULL;
+    }
+  return dictionary;
+}
+
+GWebSocketDictionary *
+g_websocket_dictionary_new_from_file(
+    const gchar * filename,
+    gint level,
+    GError ** error)
+{
+  gchar * contents = NULL;
+  gsize length = 0;
+  if(!g_file_get_contents(filename,&contents,&length,error))
+    return NULL;
+
+  GBytes * bytes = g_bytes_new_take(contents,length);
+  GWebSocketDictionary * dictionary = g_websocket_dictionary_new(bytes,level,error);
+  g_bytes_unref(bytes);
+  return dictionary;
+}
+
+GWebSocketDictionary *
+g_websocket_dictionary_ref(
+    GWebSocketDictionary * dictionary
+    )
+{
+  g_return_val_if_fail(dictionary != NULL,NULL);
+  g_atomic_int_inc(&(dictionary->ref_count));
+  return dictionary;
+}
+
+void
+g_websocket_dictionary_unref(
+    GWebSocketDictionary * dictionary
+    )
+{
+  g_return_if_fail(dictionary != NULL);
+  if(g_atomic_int_dec_and_test(&(dictionary->ref_count)))
+    {
+      ZSTD_freeCDict(dictionary->cdict);
+      ZSTD_freeDDict(dictionary->ddict);
+      g_free(dictionary);
+    }
+}
+
+guint32
+g_websocket_dictionary_get_id(
+    GWebSocketDictionary * dictionary
+    )
+{
+  return dictionary->id;
+}
+
+GWebSocketZstd *
+_g_websocket_zstd_new(
+    GWebSocketDictionary * dictionary)
+{
+  GWebSocketZstd * state = g_new0(GWebSocketZstd,1);
+  state->dictionary = g_websocket_dictionary_ref(dictionary);
+  return state;
+}
+
+void
+_g_websocket_zstd_free(
+    GWebSocketZstd * state)
+{
+  if(state->dctx)
+    ZSTD_freeDCtx(state->dctx);
+  g_websocket_dictionary_unref(state->dictionary);
+  g_free(state);
+}
+
+GWebSocketDictionary *
+_g_websocket_zstd_get_dictionary(
+    GWebSocketZstd * state)
+{
+  return state->dictionary;
+}
+
+/*
+ * Compresses a whole message into a pool buffer with headroom free bytes in
+ * front. Returns NULL when the output would not be smaller than the input.
+ * The dictionary ID is left out of the frame, the handshake agreed it.
+ */
+guint8 *
+_g_websocket_zstd_compress(
+    GWebSocketDictionary * dictionary,
+    const guint8 * data,
+    gsize count,
+    gsize headroom,
+    gsize * length)
+{
+  ZSTD_CCtx * cctx = g_private_get(&compressor);
+  if(!cctx)
+    {
+      cctx = ZSTD_createCCtx();
+      if(!cctx)
+	return NULL;
+      g_private_set(&compressor,cctx);
+    }
+
+  gsize size = ZSTD_compressBound(count);
+  guint8 * buffer = _g_websocket_pool_alloc(headroom + size);
+  ZSTD_CCtx_reset(cctx,ZSTD_reset_session_and_parameters);
+  ZSTD_CCtx_setParameter(cctx,ZSTD_c_dictIDFlag,0);
+  ZSTD_CCtx_refCDict(cctx,dictionary->cdict);
+  gsize produced = ZSTD_compress2(cctx,buffer + headroom,size,data,count);
+  if(ZSTD_isError(produced) || (produced >= count))
+    {
+      _g_websocket_pool_free(buffer);
+      return NULL;
+    }
+  *length = produced;
+  return buffer;
+}
+
+/*
+ * Decompresses a message, or a fragment of one when fin is FALSE, into a
+ * pool buffer with room for a NUL terminator. More than limit bytes of
+ * output is an error, and so is anything but exactly one zstd frame.
+ */
+guint8 *
+_g_websocket_zstd_decompress(
+    GWebSocketZstd * state,
+    const guint8 * data,
+    gsize count,
+    gboolean fin,
+    gsize limit,
+    gsize * length,
+    GError ** error)
+{
+  ZSTD_DCtx * dctx = state->dctx;
+  gboolean ended = state->ended;
+  gboolean done = TRUE;
+  gsize size = MIN(MAX(count * 4,256),limit + 1);
+
+  if(!dctx)
+    {
+      if(fin)
+	{
+	  dctx = g_private_get(&decompressor);
+	  if(!dctx && (dctx = ZSTD_createDCtx()))
+	    g_private_set(&decompressor,dctx);
+	}
+      else
+	{
+	  dctx = state->dctx = ZSTD_createDCtx();
+	}
+      if(!dctx)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE,"can not create the decompressor");
+	  return NULL;
+	}
+      ZSTD_DCtx_reset(dctx,ZSTD_reset_session_and_parameters);
+      ZSTD_DCtx_refDDict(dctx,state->dictionary->ddict);
+    }
+
+  /* a whole message tells its size, a bomb is refused before any work */
+  if(fin && !state->dctx)
+    {
+      unsigned long long content = ZSTD_getFrameContentSize(data,count);
+      if(content == ZSTD_CONTENTSIZE_ERROR)
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid compressed data");
+	  done = FALSE;
+	}
+      else if((content != ZSTD_CONTENTSIZE_UNKNOWN) && (content > limit))
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+	  done = FALSE;
+	}
+      else if(content != ZSTD_CONTENTSIZE_UNKNOWN)
+	{
+	  size = MAX(content,1);
+	}
+    }
+
+  gsize produced = 0;
+  guint8 * buffer = _g_websocket_pool_alloc(size + 1);
+  ZSTD_inBuffer input = { data, count, 0 };
+
+  /* data after the end of the frame */
+  if(done && ended && count)
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid compressed data");
+      done = FALSE;
+    }
+
+  /* a full buffer may leave output inside the decompressor */
+  while(done && ((input.pos < input.size) || (count && !ended && (produced == size))))
+    {
+      if(produced == size)
+	{
+	  if(size > limit)
+	    {
+	      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+	      done = FALSE;
+	      break;
+	    }
+	  size = MIN(size * 2,limit + 1);
+	  buffer = _g_websocket_pool_realloc(buffer,size + 1);
+	}
+      ZSTD_outBuffer output = { buffer, size, produced };
+      gsize hint = ZSTD_decompressStream(dctx,&output,&input);
+      produced = output.pos;
+      ended = hint == 0;
+      if(ZSTD_isError(hint) || (ended && (input.pos < input.size)))
+	{
+	  g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"invalid compressed data");
+	  done = FALSE;
+	}
+    }
+
+  if(done && (produced > limit))
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_MESSAGE_TOO_LARGE,"message too large");
+      done = FALSE;
+    }
+  if(done && fin && !ended)
+    {
+      g_set_error_literal(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"truncated compressed data");
+      done = FALSE;
+    }
+
+  state->ended = done && !fin && ended;
+  if((!done || fin) && state->dctx)
+    {
+      ZSTD_freeDCtx(state->dctx);
+      state->dctx = NULL;
+    }
+  if(!done)
+    {
+      _g_websocket_pool_free(buffer);
+      return NULL;
+    }
+  buffer[produced] = 0;
+  *length = produced;
+  return buffer;
+}
+
+/* the dictionary ID of one x-gwebsocket-zstd extension, 0 if it is not one */
+static guint32
+_g_websocket_zstd_parse(
+    const gchar * extension)
+{
+  gchar ** params = g_strsplit(extension,";",-1);
+  guint64 id = 0;
+  gboolean valid = g_ascii_strcasecmp(g_strstrip(params[0]),G_WEBSOCKET_ZSTD_NAME) == 0;
+
+  for(guint index = 1;valid && params[index];index++)
+    {
+      gchar * name = g_strstrip(params[index]);
+      gchar * value = strchr(name,'=');
+      if(value)
+	{
+	  *value = 0;
+	  value = g_strstrip(value + 1);
+	  g_strchomp(name);
+	}
+
+      gsize length = value ? strlen(value) : 0;
+      if((length >= 2) && (value[0] == '"') && (value[length - 1] == '"'))
+	{
+	  value[length - 1] = 0;
+	  value++;
+	}
+      valid = value && (id == 0) && (g_ascii_strcasecmp(name,"dict") == 0)
+	      && g_ascii_string_to_unsigned(value,10,1,G_MAXUINT32,&id,NULL);
+    }
+  g_strfreev(params);
+  return valid ? (guint32)id : 0;
+}
+
+static GWebSocketDictionary *
+_g_websocket_zstd_lookup(
+    GPtrArray * dictionaries,
+    guint32 id)
+{
+  for(guint index = 0;id && (index < dictionaries->len);index++)
+    {
+      GWebSocketDictionary * dictionary = g_ptr_array_index(dictionaries,index);
+      if(dictionary->id == id)
+	return dictionary;
+    }
+  return NULL;
+}
+
+/*
+ * Server side, picks the first offer of the client naming one of the
+ * dictionaries and fills the Sec-WebSocket-Extensions response. Returns a
+ * new reference to the dictionary, NULL when no offer names one.
+ */
+GWebSocketDictionary *
+_g_websocket_zstd_negotiate(
+    const gchar * offers,
+    GPtrArray * dictionaries,
+    gchar ** response)
+{
+  gchar ** extensions = NULL;
+  GWebSocketDictionary * dictionary = NULL;
+  if(!offers || !dictionaries->len)
+    return NULL;
+
+  extensions = g_strsplit(offers,",",-1);
+  for(guint index = 0;!dictionary && extensions[index];index++)
+    dictionary = _g_websocket_zstd_lookup(dictionaries,_g_websocket_zstd_parse(extensions[index]));
+  g_strfreev(extensions);
+
+  if(dictionary)
+    *response = g_strdup_printf(G_WEBSOCKET_ZSTD_NAME "; dict=%u",dictionary->id);
+  return dictionary ? g_websocket_dictionary_ref(dictionary) : NULL;
+}
+
+/* client side, one offer for every dictionary in order of preference */
+gchar *
+_g_websocket_zstd_offer(
+    GPtrArray * dictionaries)
+{
+  GString * text = g_string_new(NULL);
+  for(guint index = 0;index < dictionaries->len;index++)
+    {
+      GWebSocketDictionary * dictionary = g_ptr_array_index(dictionaries,index);
+      g_string_append_printf(text,"%s" G_WEBSOCKET_ZSTD_NAME "; dict=%u",index ? ", " : "",dictionary->id);
+    }
+  return g_string_free(text,FALSE);
+}
+
+/*
+ * Client side, the dictionary the server answered with, NULL when the
+ * response is not this extension or names a dictionary never offered.
+ */
+GWebSocketDictionary *
+_g_websocket_zstd_accept(
+    const gchar * response,
+    GPtrArray * dictionaries)
+{
+  GWebSocketDictionary * dictionary = NULL;
+  if(!strchr(response,','))
+    dictionary = _g_websocket_zstd_lookup(dictionaries,_g_websocket_zstd_parse(response));
+  return dictionary ? g_websocket_dictionary_ref(dictionary) : NULL;
+}